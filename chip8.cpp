@@ -1,8 +1,16 @@
-
 #include <iostream>
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_main.h>
 #include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <atomic>
+#include "chip8_core.h"
 
 // SDL Container object
 typedef struct 
@@ -10,83 +18,543 @@ typedef struct
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Event event;
+    SDL_Texture *screen; // Chip 8 display at 128x64, low resolution pixels are 2x2 texels
+    SDL_Texture *outlines; // Window sized pixel outline overlay, NULL when outlines are off
+    uint32_t pixels[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT]; // RGBA copy of what is in the screen texture
+    chip8_display_t shown; // Display the screen texture currently holds
+    bool redraw; // Present next frame even if no row changed
+    bool rewind; // Backspace is held, step back through history instead of running
+    bool keypad[16]; // Keys held on the keyboard, handed to the emulation thread every poll
 
 } sdl_t;
 
-// Configuration object
-typedef struct 
-{
-    uint32_t window_width; // SDL Window width
-    uint32_t window_height; // SDL Window height
-    uint32_t fg_color; // Foreground colour
-    uint32_t bg_color; // background colour
-    uint32_t scale_factor; // scale factor
-    bool pixel_outlines; // Draw [pixel outline]
-    uint32_t insts_per_sec; // CPU Clock rat or hz
-} config_t;
-
-// Emulator states
-typedef enum 
-{
-    QUIT,
-    RUNNING,
-    PAUSE
-} emulator_state_t;
+// Lock free triple buffer of finished frames. The emulation thread fills back and swaps it with
+// middle, the renderer swaps middle with front when middle holds a frame it has not seen yet
+#define FRAME_FRESH 0x4 // Set in middle while it holds an unread frame
 
-// CHIP8 Instruction format
 typedef struct {
-    uint16_t opcode;
-    uint16_t NNN; // 12 bit address
-    uint8_t NN;  // 8 bit
-    uint8_t N; // 4 bit
-    uint8_t X;  // 4 bit register identifier
-    uint8_t Y;  // 4 bit register identifier
-} instruction_t;
-
-// Chip 8 Object
-typedef struct 
-{
-    emulator_state_t state;
-    uint8_t ram[4096];
-    bool display[64 * 32]; // original chip 8 resolution
-    uint16_t stack[16]; // Subroutine stack
-    uint16_t *stack_ptr;
-    uint8_t V[16]; // Data Register
-    uint16_t I; // Index Register
-    uint8_t delay_timer; // Decrement at 60hz wheb > 0
-    uint8_t sound_timer; // Decrement at 60hz and play tones > 0
-    uint16_t PC; // Program Counter
-    bool keypad[16]; // Key pad 0x0-0xF
-    const char *rom_name; // Current rom name
-    instruction_t inst; // Current chip 8 instruction
-    
-} chip8_t;
+    chip8_display_t display[3];
+    std::atomic<uint8_t> middle; // Buffer index, plus FRAME_FRESH
+    uint8_t back; // Only touched by the emulation thread
+    uint8_t front; // Only touched by the renderer
+    chip8_display_t shown; // Last frame published, emulation thread only
+} frame_buffer_t;
+
+// Commands the SDL thread leaves for the emulation thread
+#define EMU_SAVE 0x1 // Quick save to <rom>.state
+#define EMU_LOAD 0x2 // Quick load from <rom>.state
+
+// Everything the SDL thread and the emulation thread share, nothing else crosses over
+typedef struct {
+    std::atomic<emulator_state_t> state; // RUNNING, PAUSE or QUIT, set by the SDL thread
+    std::atomic<uint16_t> keys; // Keypad mask, bit N is key N
+    std::atomic<bool> rewind; // Step back instead of running
+    std::atomic<uint32_t> commands; // EMU_ bits, cleared by the emulation thread as it runs them
+    frame_buffer_t frames;
+} emu_link_t;
 
+// Set up init emulate config from passed in argu
+bool set_config(config_t *config, const int argc, const char **argv) {
+    config_defaults(config);
 
+    // Override default values, the first non option is the rom
+    for (int i = 1; i <  argc; i ++) {
+        if (strncmp(argv[i], "--", 2) != 0 && !config->rom_name) {
+            config->rom_name = argv[i];
+        }
+        else if (strcmp(argv[i], "--headless") == 0) {
+            config->headless = true;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            config->max_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--insts") == 0 && i + 1 < argc) {
+            config->max_insts = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (!parse_engine(argv[++i], &config->engine)) {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                return false;
+            }
+            if (strcmp(argv[i], "jit") == 0 && config->engine != ENGINE_JIT) {
+                fprintf(stderr, "JIT needs an x86-64 host, using the block engine\n");
+            }
+            if (strcmp(argv[i], "aot") == 0 && config->engine != ENGINE_AOT) {
+                fprintf(stderr, "No rom is compiled into this build (see make aot), using the block engine\n");
+            }
+        }
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            if (!parse_quirks(argv[++i], &config->quirks)) {
+                fprintf(stderr, "Unknown quirk profile: %s\n", argv[i]);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            config->batch_manifest = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config->threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            config->out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            config->load_state = argv[++i];
+        }
+        else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+            config->save_state = argv[++i];
+        }
+        else if (strcmp(argv[i], "--rewind-mb") == 0 && i + 1 < argc) {
+            config->rewind_mb = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            config->seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--record-input") == 0 && i + 1 < argc) {
+            config->record_input = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            config->replay_input = argv[++i];
+            config->headless = true;
+        }
+        else if (strcmp(argv[i], "--audio-buffer") == 0 && i + 1 < argc) {
+            config->audio_buffer = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--audio-latency") == 0 && i + 1 < argc) {
+            config->audio_latency_ms = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--spin-us") == 0 && i + 1 < argc) {
+            config->spin_us = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            config->insts_per_sec = (uint32_t)strtoul(argv[++i], NULL, 10);
+            if (config->insts_per_sec == 0) {
+                config->insts_per_sec = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            // WxH in window pixels, the display is stretched to fill it
+            uint32_t w = 0, h = 0;
+            if (sscanf(argv[++i], "%ux%u", &w, &h) != 2 || w == 0 || h == 0) {
+                fprintf(stderr, "Window size is WIDTHxHEIGHT: %s\n", argv[i]);
+                return false;
+            }
+            config->window_width = w;
+            config->window_height = h;
+        }
+        else if (strcmp(argv[i], "--aot-out") == 0 && i + 1 < argc) {
+            config->aot_out = argv[++i];
+        }
+        else if (strcmp(argv[i], "--no-idle-skip") == 0) {
+            config->idle_skip = false;
+        }
+        #ifdef PROFILE
+        else if (strcmp(argv[i], "--profile-out") == 0 && i + 1 < argc) {
+            config->profile_out = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile-time") == 0) {
+            config->profile_timed = true;
+        }
+        #endif
+        #ifdef TRACE
+        else if (strcmp(argv[i], "--trace-out") == 0 && i + 1 < argc) {
+            config->trace_out = argv[++i];
+        }
+        else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+            config->decode_trace = argv[++i];
+        }
+        #endif
+        else if (strcmp(argv[i], "--rewind-interval") == 0 && i + 1 < argc) {
+            config->rewind_interval = (uint32_t)strtoul(argv[++i], NULL, 10);
+            if (config->rewind_interval == 0) {
+                config->rewind_interval = 1;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
 
 
+// Save state file: "C8ST", then a little endian uint16 version and the fields of that version
+#define STATE_MAGIC "C8ST"
+#define STATE_VERSION 2 // 1 had 32 display rows in place of the resolution, planes and coded display
+
+// Zero run length coding: a byte of 0x80 | (n - 1) is n zeros, a byte n - 1 below 0x80
+// is followed by n bytes as they are. Most of RAM, and most of a delta, is zeros
+void rle_encode(const uint8_t *src, const size_t size, std::vector<uint8_t> *out) {
+    size_t i = 0;
+    while (i < size) {
+        // Zero runs a word at a time first, deltas are mostly zero
+        size_t run = 0;
+        uint64_t word;
+        while (run + 8 <= 128 && i + run + 8 <= size &&
+               (memcpy(&word, &src[i + run], 8), word == 0)) {
+            run += 8;
+        }
+        while (i + run < size && src[i + run] == 0 && run < 128) {
+            run++;
+        }
+        if (run > 0) {
+            out->push_back((uint8_t)(0x80 | (run - 1)));
+            i += run;
+            continue;
+        }
 
-// Set up init emulate config from passed in argu
-bool set_config(config_t *config, const int argc, const char **argv) {
+        // Literals up to the next zero pair, a lone zero is cheaper to keep inline
+        size_t len = 0;
+        while (i + len < size && len < 128 &&
+               !(src[i + len] == 0 && (i + len + 1 == size || src[i + len + 1] == 0))) {
+            len++;
+        }
+        out->push_back((uint8_t)(len - 1));
+        out->insert(out->end(), src + i, src + i + len);
+        i += len;
+    }
+}
 
-    // Set default
-    *config = config_t{
-        64, // Origin X
-        32, // Origin Y
-        0xFFFFFFFF, // White
-        0x00000000, // Black
-        10, // Scale Factor
-        true, // Draw pixel outlines by default
-        500
-    };
+// Decode exactly size bytes, false if the data is short, long or runs past the end
+bool rle_decode(const uint8_t *src, const size_t src_size, uint8_t *dst, const size_t size) {
+    size_t in = 0;
+    size_t out = 0;
+    while (in < src_size) {
+        const uint8_t control = src[in++];
+        const size_t len = (control & 0x7F) + 1;
+        if (out + len > size) {
+            return false;
+        }
+        if (control & 0x80) {
+            memset(&dst[out], 0, len);
+        }
+        else {
+            if (in + len > src_size) {
+                return false;
+            }
+            memcpy(&dst[out], &src[in], len);
+            in += len;
+        }
+        out += len;
+    }
+    return out == size;
+}
 
-    // Override default values
-    for (int i = 1; i <  argc; i ++) {
-        (void)argv[i]; // Prevent compiler error from unused variables
+// Decode like rle_decode but XOR the bytes into dst, zero runs leave dst as it is
+bool rle_decode_xor(const uint8_t *src, const size_t src_size, uint8_t *dst, const size_t size) {
+    size_t in = 0;
+    size_t out = 0;
+    while (in < src_size) {
+        const uint8_t control = src[in++];
+        const size_t len = (control & 0x7F) + 1;
+        if (out + len > size) {
+            return false;
+        }
+        if (!(control & 0x80)) {
+            if (in + len > src_size) {
+                return false;
+            }
+            for (size_t i = 0; i < len; i++) {
+                dst[out + i] ^= src[in + i];
+            }
+            in += len;
+        }
+        out += len;
+    }
+    return out == size;
+}
+
+// Little endian field writers and readers for the state file
+static void put_le(std::vector<uint8_t> *out, const uint64_t value, const uint32_t bytes) {
+    for (uint32_t i = 0; i < bytes; i++) {
+        out->push_back((uint8_t)(value >> (8 * i)));
+    }
+}
+
+static bool get_le(const std::vector<uint8_t> &in, size_t *pos, const uint32_t bytes, uint64_t *value) {
+    if (*pos + bytes > in.size()) {
+        return false;
+    }
+    *value = 0;
+    for (uint32_t i = 0; i < bytes; i++) {
+        *value |= (uint64_t)in[*pos + i] << (8 * i);
+    }
+    *pos += bytes;
+    return true;
+}
+
+// Write a snapshot as a version 2 state file:
+//   magic, version, PC, I, V0-VF, stack pointer, delay, sound, keypad mask, RNG,
+//   16 stack entries, hires, plane mask, display size and zero run coded display words
+//   (plane 0 then plane 1, little endian), RAM size and zero run coded RAM
+bool write_state(const char *path, const chip8_state_t *state) {
+    std::vector<uint8_t> out(STATE_MAGIC, STATE_MAGIC + 4);
+    put_le(&out, STATE_VERSION, 2);
+    put_le(&out, state->PC, 2);
+    put_le(&out, state->I, 2);
+    out.insert(out.end(), state->V, state->V + 16);
+    put_le(&out, state->stack_ptr, 1);
+    put_le(&out, state->delay_timer, 1);
+    put_le(&out, state->sound_timer, 1);
+
+    uint16_t keys = 0;
+    for (uint8_t i = 0; i < 16; i++) {
+        keys |= (uint16_t)state->keypad[i] << i;
+    }
+    put_le(&out, keys, 2);
+    put_le(&out, state->rng, 4);
+
+    for (uint8_t i = 0; i < 16; i++) {
+        put_le(&out, state->stack[i], 2);
+    }
+    put_le(&out, state->display.hires, 1);
+    put_le(&out, state->planes, 1);
+    std::vector<uint8_t> words, display;
+    for (const auto &plane : state->display.plane) {
+        for (const uint64_t word : plane) {
+            put_le(&words, word, 8);
+        }
+    }
+    rle_encode(words.data(), words.size(), &display);
+    put_le(&out, display.size(), 4);
+    out.insert(out.end(), display.begin(), display.end());
+
+    std::vector<uint8_t> ram;
+    rle_encode(state->ram, sizeof state->ram, &ram);
+    put_le(&out, ram.size(), 4);
+    out.insert(out.end(), ram.begin(), ram.end());
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    const bool ok = fwrite(out.data(), out.size(), 1, file) == 1;
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", path);
+    }
+    return ok;
+}
+
+// Read a state file, the snapshot is untouched unless the whole file is good
+bool read_state(const char *path, chip8_state_t *state) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open state file %s\n", path);
+        return false;
+    }
+    std::vector<uint8_t> in;
+    uint8_t chunk[4096];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof chunk, file)) > 0) {
+        in.insert(in.end(), chunk, chunk + got);
+    }
+    fclose(file);
+
+    if (in.size() < 6 || memcmp(in.data(), STATE_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s is not a chip 8 state file\n", path);
+        return false;
+    }
+
+    size_t pos = 4;
+    uint64_t version = 0, value = 0;
+    get_le(in, &pos, 2, &version);
+    if (version != STATE_VERSION && version != 1) {
+        fprintf(stderr, "%s: unsupported state version %u\n", path, (unsigned)version);
+        return false;
+    }
+
+    chip8_state_t s = {};
+    bool ok = true;
+    ok &= get_le(in, &pos, 2, &value); s.PC = (uint16_t)value;
+    ok &= get_le(in, &pos, 2, &value); s.I = (uint16_t)value;
+    for (uint8_t i = 0; i < 16; i++) {
+        ok &= get_le(in, &pos, 1, &value); s.V[i] = (uint8_t)value;
+    }
+    ok &= get_le(in, &pos, 1, &value); s.stack_ptr = (uint8_t)value;
+    ok &= get_le(in, &pos, 1, &value); s.delay_timer = (uint8_t)value;
+    ok &= get_le(in, &pos, 1, &value); s.sound_timer = (uint8_t)value;
+    ok &= get_le(in, &pos, 2, &value);
+    for (uint8_t i = 0; i < 16; i++) {
+        s.keypad[i] = (value >> i) & 1;
+    }
+    ok &= get_le(in, &pos, 4, &value); s.rng = (uint32_t)value;
+    for (uint8_t i = 0; i < 16; i++) {
+        ok &= get_le(in, &pos, 2, &value); s.stack[i] = (uint16_t)value;
+    }
+    if (version == 1) {
+        // Low resolution, plane 0 only
+        for (uint32_t y = 0; y < CHIP8_HEIGHT; y++) {
+            ok &= get_le(in, &pos, 8, &value); s.display.plane[0][y] = value;
+        }
+        s.planes = 1;
+    }
+    else {
+        ok &= get_le(in, &pos, 1, &value); s.display.hires = value != 0;
+        ok &= get_le(in, &pos, 1, &value); s.planes = (uint8_t)value & 3;
+        std::vector<uint8_t> words(sizeof s.display.plane);
+        ok &= get_le(in, &pos, 4, &value);
+        ok = ok && pos + value <= in.size() && rle_decode(&in[pos], value, words.data(), words.size());
+        pos += value;
+        size_t word_pos = 0;
+        for (auto &plane : s.display.plane) {
+            for (uint64_t &word : plane) {
+                get_le(words, &word_pos, 8, &value);
+                word = value;
+            }
+        }
+    }
+    ok &= get_le(in, &pos, 4, &value);
+    ok = ok && pos + value == in.size() && rle_decode(&in[pos], value, s.ram, sizeof s.ram);
+
+    if (!ok) {
+        fprintf(stderr, "%s: truncated or corrupt state file\n", path);
+        return false;
+    }
+    *state = s;
+    return true;
+}
+
+
+// Rewind history. The newest recorded state is kept whole, every older one is a zero run coded
+// XOR against the state after it, so stepping back is one delta applied to the newest copy.
+// Deltas live in a byte ring allocated once at the budget, the oldest are dropped to make room
+typedef struct {
+    std::vector<uint8_t> ring; // Entries of <uint32 length, delta, uint32 length>
+    size_t head; // Where the next entry goes
+    size_t tail; // Start of the oldest entry
+    size_t used; // Bytes of the ring holding entries
+    uint32_t entries; // Records that can be stepped back to
+    uint32_t interval; // Frames between records
+    uint32_t frames; // Frames since the last record
+    bool recorded; // newest holds a state
+    chip8_state_t newest; // Full copy of the last recorded state
+    chip8_state_t current; // Scratch snapshot, kept here so it is not a 4 KB stack copy per frame
+    std::vector<uint8_t> delta; // Scratch encoding, keeps its capacity between records
+} rewind_t;
+
+// Size the history, budget_bytes of 0 leaves recording off
+void rewind_init(rewind_t *rw, const size_t budget_bytes, const uint32_t interval) {
+    rw->ring.assign(budget_bytes, 0);
+    rw->head = rw->tail = rw->used = 0;
+    rw->entries = 0;
+    rw->interval = interval ? interval : 1;
+    rw->frames = 0;
+    rw->recorded = false;
+    memset(&rw->newest, 0, sizeof rw->newest);
+    memset(&rw->current, 0, sizeof rw->current);
+    rw->delta.clear();
+    rw->delta.reserve(2 * sizeof(chip8_state_t));
+}
+
+// Copy bytes in and out of the ring at pos, wrapping at the end
+static void rewind_put(rewind_t *rw, size_t pos, const void *src, size_t len) {
+    const size_t first = len < rw->ring.size() - pos ? len : rw->ring.size() - pos;
+    memcpy(&rw->ring[pos], src, first);
+    memcpy(&rw->ring[0], (const uint8_t *)src + first, len - first);
+}
+
+static void rewind_get(const rewind_t *rw, size_t pos, void *dst, size_t len) {
+    const size_t first = len < rw->ring.size() - pos ? len : rw->ring.size() - pos;
+    memcpy(dst, &rw->ring[pos], first);
+    memcpy((uint8_t *)dst + first, &rw->ring[0], len - first);
+}
+
+// Call once per emulated frame, records every interval frames
+void rewind_record(rewind_t *rw, const chip8_t *chip8) {
+    if (rw->ring.empty() || ++rw->frames < rw->interval) {
+        return;
+    }
+    rw->frames = 0;
+
+    snapshot_chip8(chip8, &rw->current);
+    if (!rw->recorded) {
+        rw->newest = rw->current;
+        rw->recorded = true;
+        return;
+    }
+
+    // XOR into newest, which is the delta from current back to the old newest, then code it
+    uint8_t *old = (uint8_t *)&rw->newest;
+    const uint8_t *now = (const uint8_t *)&rw->current;
+    for (size_t i = 0; i < sizeof(chip8_state_t); i++) {
+        old[i] ^= now[i];
+    }
+    rw->delta.clear();
+    rle_encode(old, sizeof(chip8_state_t), &rw->delta);
+    rw->newest = rw->current;
+
+    const uint32_t len = (uint32_t)rw->delta.size();
+    const size_t need = len + 2 * sizeof len;
+    if (need > rw->ring.size()) {
+        // Cannot ever fit, history before this frame is gone
+        rw->head = rw->tail = rw->used = 0;
+        rw->entries = 0;
+        return;
+    }
+
+    // Drop the oldest until the new entry fits
+    while (rw->ring.size() - rw->used < need) {
+        uint32_t old_len;
+        rewind_get(rw, rw->tail, &old_len, sizeof old_len);
+        rw->tail = (rw->tail + old_len + 2 * sizeof old_len) % rw->ring.size();
+        rw->used -= old_len + 2 * sizeof old_len;
+        rw->entries--;
     }
+
+    rewind_put(rw, rw->head, &len, sizeof len);
+    rewind_put(rw, (rw->head + sizeof len) % rw->ring.size(), rw->delta.data(), len);
+    rewind_put(rw, (rw->head + sizeof len + len) % rw->ring.size(), &len, sizeof len);
+    rw->head = (rw->head + need) % rw->ring.size();
+    rw->used += need;
+    rw->entries++;
+}
+
+// Go back one record, false when the history is used up
+bool rewind_step(rewind_t *rw, chip8_t *chip8) {
+    if (rw->entries == 0) {
+        return false;
+    }
+
+    // Newest entry ends at head, its trailing length says where it starts
+    const size_t size = rw->ring.size();
+    uint32_t len;
+    rewind_get(rw, (rw->head + size - sizeof len) % size, &len, sizeof len);
+    const size_t start = (rw->head + size - len - 2 * sizeof len) % size;
+
+    rw->delta.resize(len);
+    rewind_get(rw, (start + sizeof len) % size, rw->delta.data(), len);
+    rle_decode_xor(rw->delta.data(), len, (uint8_t *)&rw->newest, sizeof(chip8_state_t));
+
+    rw->head = start;
+    rw->used -= len + 2 * sizeof len;
+    rw->entries--;
+    rw->frames = 0;
+    restore_chip8(chip8, &rw->newest);
     return true;
 }
 
+// Redraw the outline overlay for a cols x rows display. Transparent everywhere except a background
+// coloured rect around each pixel, which is only visible on top of lit pixels
+static void draw_outlines(sdl_t *sdl, const config_t config, const uint32_t cols, const uint32_t rows) {
+    SDL_SetRenderTarget(sdl -> renderer, sdl -> outlines);
+    SDL_SetRenderDrawColor(sdl -> renderer, 0, 0, 0, 0);
+    SDL_RenderClear(sdl -> renderer);
+    SDL_SetRenderDrawColor(sdl -> renderer, (config.bg_color >> 24) & 0xFF, (config.bg_color >> 16) & 0xFF,
+                           (config.bg_color >> 8) & 0xFF, (config.bg_color >> 0) & 0xFF);
+
+    const float w = (float)config.window_width / cols;
+    const float h = (float)config.window_height / rows;
+    SDL_FRect rect = {0, 0, w, h};
+    for (uint32_t i = 0; i < cols * rows; i++) {
+        rect.x = (i % cols) * w;
+        rect.y = (i / cols) * h;
+        SDL_RenderRect(sdl -> renderer, &rect);
+    }
+    SDL_SetRenderTarget(sdl -> renderer, NULL);
+}
 
 // Init SDL
 bool init_sdl(sdl_t *sdl, const config_t config) {
@@ -101,8 +569,8 @@ bool init_sdl(sdl_t *sdl, const config_t config) {
 
     sdl -> window = SDL_CreateWindow(
         "SDL 3 Window ", // Window title
-        config.window_width * config.scale_factor, // Width, in pixel
-        config.window_height * config.scale_factor, // Height, in pixel
+        config.window_width, // Width, in pixel
+        config.window_height, // Height, in pixel
         0 // Flags
     );
 
@@ -117,18 +585,205 @@ bool init_sdl(sdl_t *sdl, const config_t config) {
         SDL_Log("Could not create SDL renderer %s", SDL_GetError());
         return false;
     }
+
+    // Display texture, rows are streamed in as they change. Always the high resolution size so a mode
+    // switch never recreates it, the window size only sets how far it is stretched
+    sdl -> screen = SDL_CreateTexture(sdl -> renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+                                      CHIP8_HIRES_WIDTH, CHIP8_HIRES_HEIGHT);
+    if (!sdl -> screen) {
+        SDL_Log("Could not create SDL screen texture %s", SDL_GetError());
+        return false;
+    }
+    SDL_SetTextureScaleMode(sdl -> screen, SDL_SCALEMODE_NEAREST); // Keep pixels square when upscaled
+
+    // Fill the texture with background, every row differs from the blank display on the first frame
+    for (uint32_t i = 0; i < CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT; i++) {
+        sdl -> pixels[i] = config.bg_color;
+    }
+    SDL_UpdateTexture(sdl -> screen, NULL, sdl -> pixels, CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+    memset(&sdl -> shown, 0, sizeof sdl -> shown);
+    sdl -> redraw = true;
+
+    // Outlines only change with the resolution, they are drawn once into an overlay
+    sdl -> outlines = NULL;
+    if (config.pixel_outlines) {
+        sdl -> outlines = SDL_CreateTexture(sdl -> renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                            config.window_width, config.window_height);
+        if (!sdl -> outlines) {
+            SDL_Log("Could not create SDL outline texture %s", SDL_GetError());
+            return false;
+        }
+        SDL_SetTextureBlendMode(sdl -> outlines, SDL_BLENDMODE_BLEND);
+        draw_outlines(sdl, config, CHIP8_WIDTH, CHIP8_HEIGHT);
+    }
     return true;
 }
 
 // Final clean up program
 void final_cleanup(sdl_t *sdl) {
-    SDL_DestroyWindow(sdl -> window);
+    if (sdl -> outlines) {
+        SDL_DestroyTexture(sdl -> outlines);
+    }
+    if (sdl -> screen) {
+        SDL_DestroyTexture(sdl -> screen);
+    }
     SDL_DestroyRenderer(sdl -> renderer);
+    SDL_DestroyWindow(sdl -> window);
     SDL_Quit(); // Shut up subsystem
 }
 
+// Sound. The emulation thread renders a frame of samples at a time into a lock free ring, the
+// SDL audio callback copies them out to the device stream. Neither side locks or allocates
+#define AUDIO_RATE 48000
+#define AUDIO_RING 8192 // Samples, a power of two, far more than the latency target ever keeps
+#define AUDIO_VOLUME 3000
+
+typedef struct {
+    SDL_AudioStream *stream; // NULL when there is no audio device
+    int16_t ring[AUDIO_RING];
+    std::atomic<uint32_t> head; // Samples written, only the emulation thread moves it
+    std::atomic<uint32_t> tail; // Samples played, only the audio callback moves it
+    std::atomic<uint32_t> underruns; // Callbacks that ran out of samples
+    std::atomic<uint32_t> silence; // Samples of silence played in their place
+    uint32_t dropped; // Samples skipped to stay at the latency target
+    uint32_t target; // Samples left in the ring when the next frame is written
+    uint32_t slack; // How far from target the ring may drift before it is corrected, the device buffer
+
+    // Tone, emulation thread only. XO-CHIP style: 128 one bit samples played in a loop at pitch_rate
+    // bits a second. The default pattern is a square wave, half the bits on
+    uint8_t pattern[16];
+    uint32_t pitch_rate;
+    uint64_t phase; // Pattern position, 32.32 fixed point bits
+} audio_t;
+
+// Called on SDL's audio thread whenever the stream wants more
+static void SDLCALL audio_callback(void *userdata, SDL_AudioStream *stream, int additional_amount, int total_amount) {
+    (void)total_amount;
+    audio_t *audio = (audio_t *)userdata;
+    int16_t chunk[512];
+    uint32_t need = (uint32_t)additional_amount / sizeof chunk[0];
+    bool ran_out = false;
+
+    while (need > 0) {
+        const uint32_t n = need < 512 ? need : 512;
+        const uint32_t tail = audio->tail.load(std::memory_order_relaxed);
+        const uint32_t ready = audio->head.load(std::memory_order_acquire) - tail;
+        const uint32_t take = ready < n ? ready : n;
+        for (uint32_t i = 0; i < take; i++) {
+            chunk[i] = audio->ring[(tail + i) & (AUDIO_RING - 1)];
+        }
+        audio->tail.store(tail + take, std::memory_order_release);
+
+        if (take < n) {
+            memset(&chunk[take], 0, (n - take) * sizeof chunk[0]);
+            audio->silence.fetch_add(n - take, std::memory_order_relaxed);
+            ran_out = true;
+        }
+        SDL_PutAudioStreamData(stream, chunk, (int)(n * sizeof chunk[0]));
+        need -= n;
+    }
+
+    if (ran_out) {
+        audio->underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Open the default playback device, a device of buffer_frames samples and latency_ms of ring on top.
+// No device is not an error, the rom just runs silent
+void init_audio(audio_t *audio, const config_t config) {
+    static const uint8_t square[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    memcpy(audio->pattern, square, sizeof audio->pattern);
+    audio->pitch_rate = 440 * 128; // One pattern loop per cycle of a 440 Hz beep
+    audio->phase = 0;
+    audio->tail = 0;
+    audio->underruns = 0;
+    audio->silence = 0;
+    audio->dropped = 0;
+    audio->target = AUDIO_RATE * config.audio_latency_ms / 1000;
+    if (audio->target > AUDIO_RING / 2) {
+        audio->target = AUDIO_RING / 2;
+    }
+    audio->slack = config.audio_buffer < AUDIO_RING / 4 ? config.audio_buffer : AUDIO_RING / 4;
+
+    // Start with the cushion in place, as silence
+    memset(audio->ring, 0, sizeof audio->ring);
+    audio->head = audio->target;
+
+    char frames[16];
+    snprintf(frames, sizeof frames, "%u", config.audio_buffer);
+    SDL_SetHint(SDL_HINT_AUDIO_DEVICE_SAMPLE_FRAMES, frames);
+
+    const SDL_AudioSpec spec = {SDL_AUDIO_S16, 1, AUDIO_RATE};
+    audio->stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, audio_callback, audio);
+    if (!audio->stream) {
+        SDL_Log("Could not open audio, running silent %s", SDL_GetError());
+        return;
+    }
+    SDL_ResumeAudioStreamDevice(audio->stream);
+}
+
+// Render one emulated frame of sound, a tone when on and silence when not
+void audio_frame(audio_t *audio, const bool on) {
+    if (!audio->stream) {
+        return;
+    }
+
+    // A frame of samples, nudged toward target. The device clock and the frame clock never quite
+    // agree, this keeps the cushion against late frames from draining and the delay between
+    // sound_timer and the speaker from building up. The device takes samples a buffer at a time,
+    // so the fill only counts as off once it is more than a buffer away
+    const uint32_t frame = AUDIO_RATE / 60;
+    const uint32_t head = audio->head.load(std::memory_order_relaxed);
+    const uint32_t fill = head - audio->tail.load(std::memory_order_acquire);
+    uint32_t count = frame;
+    if (fill + audio->slack < audio->target) {
+        count += (audio->target - fill) / 4 + 1;
+    }
+    else if (fill > audio->target + audio->slack) {
+        const uint32_t skip = (fill - audio->target) / 4 + 1 < frame ? (fill - audio->target) / 4 + 1 : frame;
+        audio->dropped += skip;
+        count -= skip;
+    }
+
+    const uint64_t step = ((uint64_t)audio->pitch_rate << 32) / AUDIO_RATE;
+    for (uint32_t i = 0; i < count; i++) {
+        int16_t sample = 0;
+        if (on) {
+            const uint32_t bit = (uint32_t)(audio->phase >> 32) & 127;
+            sample = (audio->pattern[bit >> 3] >> (7 - (bit & 7))) & 1 ? AUDIO_VOLUME : -AUDIO_VOLUME;
+        }
+        audio->ring[(head + i) & (AUDIO_RING - 1)] = sample;
+        audio->phase += step;
+    }
+    audio->head.store(head + count, std::memory_order_release);
+}
+
+// Stop the device while the emulator is paused, its silence is not an underrun
+void pause_audio(audio_t *audio, const bool pause) {
+    if (!audio->stream) {
+        return;
+    }
+    if (pause) {
+        SDL_PauseAudioStreamDevice(audio->stream);
+    }
+    else {
+        SDL_ResumeAudioStreamDevice(audio->stream);
+    }
+}
+
+// Stop the device and say how well the ring kept up
+void close_audio(audio_t *audio) {
+    if (!audio->stream) {
+        return;
+    }
+    SDL_DestroyAudioStream(audio->stream);
+    audio->stream = NULL;
+    fprintf(stderr, "Audio: %u underruns (%u samples of silence), %u samples dropped, target %.1f ms\n",
+            audio->underruns.load(), audio->silence.load(), audio->dropped, audio->target * 1000.0 / AUDIO_RATE);
+}
+
 // Clear screen
-void clear_screen(const config_t config, sdl_t sdl) {
+void clear_screen(const config_t config, const sdl_t *sdl) {
 
     // Int screen clear
     const uint8_t r = (config.bg_color >> 24) & 0xFF; // Shift to 24 bits then mask it off
@@ -136,151 +791,205 @@ void clear_screen(const config_t config, sdl_t sdl) {
     const uint8_t b = (config.bg_color >> 8) & 0xFF; // Shift to 8 bits then mask it off
     const uint8_t a = (config.bg_color >> 0) & 0xFF; // Shift to 0 bit then mask it off
 
-    SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
-    SDL_RenderClear(sdl.renderer);
+    SDL_SetRenderDrawColor(sdl->renderer, r, g, b, a);
+    SDL_RenderClear(sdl->renderer);
 }
 
 // Update screen with changes
-void update_screen(const sdl_t sdl, const config_t config, const chip8_t chip8) {
-    SDL_FRect rect = {0, 0, (float)config.scale_factor, (float)config.scale_factor};
-
-    // Colours values foregrounds
-    const uint8_t fg_r = (config.fg_color >> 24) & 0xFF; // Shift to 24 bits then mask it off
-    const uint8_t fg_g = (config.fg_color >> 16) & 0xFF; // Shift to 16 bits then mask it off
-    const uint8_t fg_b = (config.fg_color >> 8) & 0xFF; // Shift to 8 bits then mask it off
-    const uint8_t fg_a = (config.fg_color >> 0) & 0xFF; // Shift to 0 bit then mask it off
-
-    // Colours values background
-    const uint8_t bg_r = (config.bg_color >> 24) & 0xFF; // Shift to 24 bits then mask it off
-    const uint8_t bg_g = (config.bg_color >> 16) & 0xFF; // Shift to 16 bits then mask it off
-    const uint8_t bg_b = (config.bg_color >> 8) & 0xFF; // Shift to 8 bits then mask it off
-    const uint8_t bg_a = (config.bg_color >> 0) & 0xFF; // Shift to 0 bit then mask it off
-
-    // loop through display pixel, draw a rect pre pixel to sdl window
-    for (uint32_t i = 0; i < sizeof chip8.display; i++) {
-        // translate index i to 2d x/y coords
-        // x = i % widdow_width
-        // y = i / window_width
-        rect.x = (i % config.window_width) * config.scale_factor;
-        rect.y = (i / config.window_width) * config.scale_factor;
-
-        // If the pixel is on, draw foreground
-        if (chip8.display[i]) {
-            SDL_SetRenderDrawColor(sdl.renderer, fg_r, fg_g, fg_b, fg_a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
-
-            // If user requuest drawing pixel outlines, draw those
-            if (config.pixel_outlines) {
-                SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-                SDL_RenderRect(sdl.renderer, &rect);
-            }
-
-        }
-        // pixel is off, draw background
-        else {
-            SDL_SetRenderDrawColor(sdl.renderer, bg_r, bg_g, bg_b, bg_a);
-            SDL_RenderFillRect(sdl.renderer, &rect);
+void update_screen(sdl_t *sdl, const config_t config, const chip8_display_t *display) {
+    const uint32_t palette[4] = {config.bg_color, config.fg_color, config.plane2_color, config.blend_color};
+    const uint32_t width = display->hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    const uint32_t height = display->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    const uint32_t words = width / 64; // Per display row
+    const uint32_t scale = CHIP8_HIRES_WIDTH / width; // Texels per pixel, each way
+
+    // A resolution change repaints every row and redraws the outlines at the new pixel size
+    const bool resized = display->hires != sdl->shown.hires;
+    if (resized && sdl->outlines) {
+        draw_outlines(sdl, config, width, height);
+    }
+    sdl->shown.hires = display->hires;
+
+    // Convert only the rows that changed since the last present
+    uint32_t first = height;
+    uint32_t last = 0;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint64_t *row0 = &display->plane[0][y * words];
+        const uint64_t *row1 = &display->plane[1][y * words];
+        uint64_t *shown0 = &sdl->shown.plane[0][y * words];
+        uint64_t *shown1 = &sdl->shown.plane[1][y * words];
+        if (!resized && memcmp(row0, shown0, words * sizeof *row0) == 0 &&
+            memcmp(row1, shown1, words * sizeof *row1) == 0) {
+            continue;
+        }
+
+        uint32_t *pixel = &sdl->pixels[y * scale * CHIP8_HIRES_WIDTH];
+        for (uint32_t x = 0; x < CHIP8_HIRES_WIDTH; x++) {
+            pixel[x] = palette[display_pixel(display, x / scale, y)];
+        }
+        if (scale == 2) {
+            memcpy(pixel + CHIP8_HIRES_WIDTH, pixel, CHIP8_HIRES_WIDTH * sizeof *pixel);
         }
+        memcpy(shown0, row0, words * sizeof *row0);
+        memcpy(shown1, row1, words * sizeof *row1);
 
+        if (y < first) first = y;
+        last = y;
     }
-    SDL_RenderPresent(sdl.renderer);
+
+    // Nothing changed, what is on screen is still right
+    if (first == height && !sdl->redraw) {
+        return;
+    }
+
+    // Upload the span of changed rows
+    if (first < height) {
+        const SDL_Rect rows = {0, (int)(first * scale), CHIP8_HIRES_WIDTH, (int)((last - first + 1) * scale)};
+        SDL_UpdateTexture(sdl->screen, &rows, &sdl->pixels[first * scale * CHIP8_HIRES_WIDTH], CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+    }
+
+    // One scaled copy of the display, then the outlines on top
+    SDL_RenderTexture(sdl->renderer, sdl->screen, NULL, NULL);
+    if (sdl->outlines) {
+        SDL_RenderTexture(sdl->renderer, sdl->outlines, NULL, NULL);
+    }
+    SDL_RenderPresent(sdl->renderer);
+    sdl->redraw = false;
+}
+
+// Hand a finished frame to the renderer, never waits. False when it matched the last one
+bool publish_frame(frame_buffer_t *frames, const chip8_display_t *display) {
+    // Nothing new to show, the renderer sleeps through frames like this. Field by field, the
+    // padding after hires is not part of the picture
+    if (frames->shown.hires == display->hires &&
+        memcmp(frames->shown.plane, display->plane, sizeof frames->shown.plane) == 0) {
+        return false;
+    }
+    frames->shown = *display;
+    frames->display[frames->back] = *display;
+    frames->back = frames->middle.exchange(frames->back | FRAME_FRESH, std::memory_order_acq_rel) & 3;
+    return true;
+}
+
+// Newest frame the renderer has not seen, NULL when there is none
+const chip8_display_t *consume_frame(frame_buffer_t *frames) {
+    if (!(frames->middle.load(std::memory_order_acquire) & FRAME_FRESH)) {
+        return NULL;
+    }
+    frames->front = frames->middle.exchange(frames->front, std::memory_order_acq_rel) & 3;
+    return &frames->display[frames->front];
 }
 
 // Hanlde user input
-void handle_input(chip8_t *chip8) {
+void handle_input(emu_link_t *link, sdl_t *sdl) {
     // Event
     SDL_Event event;
     while (SDL_PollEvent(&event)) {  // Poll events from SDL
         switch (event.type)
         {
         case SDL_EVENT_QUIT:
-            chip8 -> state = QUIT;
+            link->state = QUIT;
             return;
+
+        case SDL_EVENT_WINDOW_EXPOSED:
+            // Window contents were lost, present again even if the display did not change
+            sdl->redraw = true;
+            break;
         
         case SDL_EVENT_KEY_DOWN:
             if (event.key.key == SDLK_ESCAPE) {
-                chip8->state = QUIT;
+                link->state = QUIT;
                 return;
             }
             // Space bar
             else if (event.key.key == SDLK_SPACE) {
-                if (chip8->state == RUNNING) {
-                    chip8->state = PAUSE;
+                if (link->state == RUNNING) {
+                    link->state = PAUSE;
                     puts("=====PAUSED=====");
                 }
                 else {
-                    chip8->state = RUNNING;
+                    link->state = RUNNING;
                 }
                 return;
             }
+            // Hold backspace to rewind
+            else if (event.key.key == SDLK_BACKSPACE) {
+                sdl->rewind = true;
+                break;
+            }
+            // Quick save and load, to <rom>.state
+            else if (event.key.key == SDLK_F5 || event.key.key == SDLK_F9) {
+                link->commands |= event.key.key == SDLK_F5 ? EMU_SAVE : EMU_LOAD;
+                break;
+            }
             //
             // Key pads, Map
             //
 
             
             else if (event.key.key == SDLK_1) {
-                chip8->keypad[0x1] = true;
+                sdl->keypad[0x1] = true;
                 break;
             }
             else if (event.key.key == SDLK_2) {
-                chip8->keypad[0x2] = true;
+                sdl->keypad[0x2] = true;
                 break;
             }
             else if (event.key.key == SDLK_3) {
-                chip8->keypad[0x3] = true;
+                sdl->keypad[0x3] = true;
                 break;
             }
             else if (event.key.key == SDLK_4) {
-                chip8->keypad[0xC] = true;
+                sdl->keypad[0xC] = true;
                 break;
             }
 
             else if (event.key.key == SDLK_Q) {
-                chip8->keypad[0x4] = true;
+                sdl->keypad[0x4] = true;
                 break;
             }
             else if (event.key.key == SDLK_W) {
-                chip8->keypad[0x5] = true;
+                sdl->keypad[0x5] = true;
                 break;
             }
             else if (event.key.key == SDLK_E) {
-                chip8->keypad[0x6] = true;
+                sdl->keypad[0x6] = true;
                 break;
             }
             else if (event.key.key == SDLK_R) {
-                chip8->keypad[0xD] = true;
+                sdl->keypad[0xD] = true;
                 break;
             }
             else if (event.key.key == SDLK_A) {
-                chip8->keypad[0x7] = true;
+                sdl->keypad[0x7] = true;
                 break;
             }
             else if (event.key.key == SDLK_S) {
-                chip8->keypad[0x8] = true;
+                sdl->keypad[0x8] = true;
                 break;
             }
             else if (event.key.key == SDLK_D) {
-                chip8->keypad[0x9] = true;
+                sdl->keypad[0x9] = true;
                 break;
             }
             else if (event.key.key == SDLK_F) {
-                chip8->keypad[0xE] = true;
+                sdl->keypad[0xE] = true;
                 break;
             }
             else if (event.key.key == SDLK_Z) {
-                chip8->keypad[0xA] = true;
+                sdl->keypad[0xA] = true;
                 break;
             }
             else if (event.key.key == SDLK_X) {
-                chip8->keypad[0x0] = true;
+                sdl->keypad[0x0] = true;
                 break;
             }
             else if (event.key.key == SDLK_C) {
-                chip8->keypad[0xB] = true;
+                sdl->keypad[0xB] = true;
                 break;
             }
             else if (event.key.key == SDLK_V) {
-                chip8->keypad[0xF] = true;
+                sdl->keypad[0xF] = true;
                 break;
             }
 
@@ -289,69 +998,73 @@ void handle_input(chip8_t *chip8) {
 
         case SDL_EVENT_KEY_UP:
 
-            if (event.key.key == SDLK_1) {
-                chip8->keypad[0x1] = false;
+            if (event.key.key == SDLK_BACKSPACE) {
+                sdl->rewind = false;
+                break;
+            }
+            else if (event.key.key == SDLK_1) {
+                sdl->keypad[0x1] = false;
                 break;
             }
             else if (event.key.key == SDLK_2) {
-                chip8->keypad[0x2] = false;
+                sdl->keypad[0x2] = false;
                 break;
             }
             else if (event.key.key == SDLK_3) {
-                chip8->keypad[0x3] = false;
+                sdl->keypad[0x3] = false;
                 break;
             }
             else if (event.key.key == SDLK_4) {
-                chip8->keypad[0xC] = false;
+                sdl->keypad[0xC] = false;
                 break;
             }
 
             else if (event.key.key == SDLK_Q) {
-                chip8->keypad[0x4] = false;
+                sdl->keypad[0x4] = false;
                 break;
             }
             else if (event.key.key == SDLK_W) {
-                chip8->keypad[0x5] = false;
+                sdl->keypad[0x5] = false;
                 break;
             }
             else if (event.key.key == SDLK_E) {
-                chip8->keypad[0x6] = false;
+                sdl->keypad[0x6] = false;
                 break;
             }
             else if (event.key.key == SDLK_R) {
-                chip8->keypad[0xD] = false;
+                sdl->keypad[0xD] = false;
                 break;
             }
             else if (event.key.key == SDLK_A) {
-                chip8->keypad[0x7] = false;
+                sdl->keypad[0x7] = false;
                 break;
             }
             else if (event.key.key == SDLK_S) {
-                chip8->keypad[0x8] = false;
+                sdl->keypad[0x8] = false;
                 break;
             }
             else if (event.key.key == SDLK_D) {
-                chip8->keypad[0x9] = false;
+                sdl->keypad[0x9] = false;
                 break;
             }
             else if (event.key.key == SDLK_F) {
-                chip8->keypad[0xE] = false;
+                sdl->keypad[0xE] = false;
                 break;
             }
             else if (event.key.key == SDLK_Z) {
-                chip8->keypad[0xA] = false;
+                sdl->keypad[0xA] = false;
                 break;
             }
             else if (event.key.key == SDLK_X) {
-                chip8->keypad[0x0] = false;
+                sdl->keypad[0x0] = false;
                 break;
             }
             else if (event.key.key == SDLK_C) {
-                chip8->keypad[0xB] = false;
+                sdl->keypad[0xB] = false;
                 break;
             }
             else if (event.key.key == SDLK_V) {
-                chip8->keypad[0xF] = false;
+                sdl->keypad[0xF] = false;
                 break;
             }
             break;
@@ -362,568 +1075,1013 @@ void handle_input(chip8_t *chip8) {
     }
 }
 
-#ifdef DEBUG
-void print_debug_info(chip8_t *chip8) {
-    printf("Address: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC, chip8->inst.opcode);
-    switch ((chip8->inst.opcode >> 12) & 0x0F)
-    {
-        case 0x00:
-            if (chip8->inst.NN == 0xE0) {
-                // clear screen 0x00E0
-                printf("clear screen\n");
-                
-            }
-            else if (chip8->inst.NN == 0xEE) {
-                // Return from subroutine
-                printf("Return from subroutine from address 0x%04X\n", *(chip8->stack_ptr - 1));
-            }
-            else {
-                printf("Unimplemented opcode. \n");
-            }
-            break;
-        
-        case 0x01:
-            // 0x01: Jump to address NNN
-            printf("Jump to address NNN (0x%04X)\n", chip8->inst.NNN);
-            break;
-            
-        case 0x02:
-            // call subroutine 0x2NNN at NNN
-            printf("Called subroutine\n");
-
-            break;
+// Read the rom file rom_name into image. It reads one byte past the most that fits, so an
+// oversized rom is caught when the image is loaded
+#define ROM_IMAGE_SIZE (4096 - 0x200 + 1)
+bool read_rom(const char rom_name[], uint8_t image[ROM_IMAGE_SIZE], size_t *rom_size) {
+    FILE *rom = fopen(rom_name, "rb");
+    if (!rom ) {
+        fprintf(stderr, "Could not open rom file %s\n", rom_name);
+        return false;
+    }
 
-        case 0x03:
-            // 0x03XNN: Check if VX == NN, if so, skip to next instruction
-            printf("Check if V%X == NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-            break;
+    *rom_size = fread(image, 1, ROM_IMAGE_SIZE, rom);
+    const bool read_ok = !ferror(rom);
+    fclose(rom);
+    if (!read_ok) {
+        fprintf(stderr, "Can not read rom file to chip 8 memory\n");
+        return false;
+    }
+    return true;
+}
 
-        case 0x04:
-            // 0x03XNN: Check if VX == NN, if so, skip to next instruction
-            printf("Check if V%X != NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-            break;
+// Init a machine with the rom in file rom_name
+bool init_chip8(chip8_t *chip8, const char rom_name[]) {
+    uint8_t image[ROM_IMAGE_SIZE];
+    size_t rom_size;
+    if (!read_rom(rom_name, image, &rom_size)) {
+        return false;
+    }
+    if (!init_chip8_image(chip8, rom_name, image, rom_size)) {
+        fprintf(stderr, "Too big of rom file\n");
+        return false;
+    }
+    return true;
+}
 
-        case 0x05:
-            // 0x03XY0: Check if VX == VY,  if so, skip the next instruction
-            printf("Check if V%X == V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y);
-            break;
-        
-        case 0x06:
-            // 0x6XNN: Set reigster VX to NN
-            printf("Set register V%X = NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
-            break;
+// Print registers, timers and the display once a headless run is over
+void print_final_state(const chip8_t *chip8) {
+    printf("PC: 0x%04X  I: 0x%04X  SP: %d  DT: %d  ST: %d\n", chip8->PC, chip8->I,
+        chip8->stack_ptr, chip8->delay_timer, chip8->sound_timer);
 
-        case 0x07:
-            // 0x7XNN: Set register VC += to NN
-            printf("Set register V%X (0x%02X) += NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
-            break;
+    for (uint8_t i = 0; i < 16; i++) {
+        printf("V%X: 0x%02X%s", i, chip8->V[i], (i % 8 == 7) ? "\n" : "  ");
+    }
 
-        case 0x08: {
-            switch(chip8->inst.N) {
-                case 0: // 8XY0: Vx = Vy
-                    
-                    printf("Set V%X = V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
-                    break;
-
-                case 1: // 8XY1: Vx |= Vy
-                    
-                    printf("Set V%X |= V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
-                    break;
-
-                case 2: // 8XY2: Vx &= Vy
-                    
-                    printf("Set V%X &= V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
-                    break;
-
-                case 3: // 8XY3: Vx ^= Vy
-                    
-                    printf("Set V%X ^= V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
-                    break;
-
-                case 4: // 8XY4: Vx += Vy, VF = carry
-                    
-                    printf("V%X += V%X -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.Y, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
-                    break;
-
-                case 5: // 8XY5: Vx -= Vy, VF = NOT borrow
-                    
-                    printf("V%X -= V%X -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.Y, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
-                    break;
-
-                case 6: // 8XY6: Vx >>= 1, VF = LSB
-                    
-                    printf("V%X >>= 1 -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
-                    break;
-
-                case 7: // 8XY7: Vx = Vy - Vx, VF = NOT borrow
-                    
-                    printf("V%X = V%X - V%X -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.Y, chip8->inst.X, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
-                    break;
-
-                case 8: // 8XY8: Vx <<= 1, VF = MSB
-                    
-                    printf("V%X <<= 1 -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
-                    break;
-
-                default:
-                    printf("Unknown 0x8XYN opcode: 0x%X\n", chip8->inst.N);
-                    break;
-            }
-            break;
+    // Plane 0 is #, XO-CHIP plane 1 is + and both are @
+    printf("Display hash: 0x%08X\n", display_hash(chip8));
+    const uint32_t width = chip8->display.hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    const uint32_t height = chip8->display.hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            putchar(".#+@"[display_pixel(&chip8->display, x, y)]);
         }
+        putchar('\n');
+    }
+}
 
-        case 0x09:
-            // 0x9XY0: Check if VX != VY
-            printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-            break;
+// Keypad state held from a frame on
+typedef struct {
+    uint32_t frame;
+    uint16_t keys; // Bit per key, 0x0-0xF
+} input_event_t;
+
+// Load an input script: "<frame> <keypad mask in hex>" per line, frames ascending, '#' comments.
+// Recorded logs also carry "seed <n>", "frames <n>", "ips <n>" and "quirks <name>" lines, handed back
+// when the pointers are set
+bool load_input_script(const char *path, std::vector<input_event_t> *events,
+                       uint32_t *seed = NULL, uint32_t *frames = NULL, uint32_t *ips = NULL,
+                       quirk_profile_t *quirks = NULL) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open input script %s\n", path);
+        return false;
+    }
 
-        case 0x0A:
-            // 0xANNN: Set index register I to NNN
-            printf("Set I to NNN (0x%04X)\n", chip8->inst.NNN);
+    char line[256];
+    uint32_t line_no = 0;
+    while (fgets(line, sizeof line, file)) {
+        line_no++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
 
-            break;
+        unsigned long frame;
+        unsigned int keys;
+        if (sscanf(line, "seed %lu", &frame) == 1) {
+            if (seed) *seed = (uint32_t)frame;
+            continue;
+        }
+        if (sscanf(line, "frames %lu", &frame) == 1) {
+            if (frames) *frames = (uint32_t)frame;
+            continue;
+        }
+        if (sscanf(line, "ips %lu", &frame) == 1) {
+            if (ips && frame) *ips = (uint32_t)frame;
+            continue;
+        }
+        char name[32];
+        if (sscanf(line, "quirks %31s", name) == 1) {
+            quirk_profile_t profile;
+            if (!parse_quirks(name, &profile)) {
+                fprintf(stderr, "%s:%u: unknown quirk profile %s\n", path, line_no, name);
+                fclose(file);
+                return false;
+            }
+            if (quirks) *quirks = profile;
+            continue;
+        }
+        if (sscanf(line, "%lu %x", &frame, &keys) != 2 || keys > 0xFFFF ||
+            (!events->empty() && frame < events->back().frame)) {
+            fprintf(stderr, "%s:%u: bad input event\n", path, line_no);
+            fclose(file);
+            return false;
+        }
+        events->push_back({(uint32_t)frame, (uint16_t)keys});
+    }
 
-        case 0x0B:
-            // Jump to V0 + NNN
-            printf("Set PC to V0 t(0x%02X) + NNN (0x%04X)\n", chip8->V[0], chip8->inst.NNN);
-            break;
+    fclose(file);
+    return true;
+}
 
-        case 0x0C:
-            // Sets reigster VX = rand() % 256 & NN
-            printf("Set V%X = rand() %% 256 & NN (0x%02X) \n", chip8->inst.X, chip8->inst.NN);
-            break;
+// Note the keypad at the start of a frame, only when it differs from the last event
+void record_input(std::vector<input_event_t> *events, const chip8_t *chip8, const uint32_t frame) {
+    const uint16_t keys = keypad_mask(chip8->keypad);
+    if (events->empty() || events->back().keys != keys) {
+        events->push_back({frame, keys});
+    }
+}
 
-        case 0x0D:
-            // Draw at N coords
-            printf("Draw N (%d) at height sprite at coords V%X (0x%02X), V%X (0x%02X) from memory location I (0x%04X)\n", 
-                chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I
-            );
-            break;
+// Write recorded events as an input script that --replay, or a batch job, can play back
+bool write_input_log(const char *path, const chip8_t *chip8, const uint32_t seed, const uint32_t frames,
+                     const uint32_t ips, const quirk_profile_t quirks, const std::vector<input_event_t> &events) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    fprintf(file, "# chip 8 input log for %s\n", chip8->rom_name);
+    fprintf(file, "seed %u\nframes %u\nips %u\nquirks %s\n", seed, frames, ips, quirk_table[quirks].name);
+    for (const input_event_t &event : events) {
+        fprintf(file, "%u %04x\n", event.frame, event.keys);
+    }
+    const bool ok = fclose(file) == 0;
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", path);
+    }
+    return ok;
+}
 
-        case 0x0E:
-            if (chip8->inst.NN == 0x9E) {
-                // Skip next instruction if key in VX is pressed
-                printf("Skip next instruction if key in V%X (0X%02X) is pressed; Key pad value: %d\n", 
-                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-                
-            }
-            else if (chip8->inst.NN == 0xA1) {
-                // Skip next instruction if key in VX is not pressed
-                printf("Skip next instruction if key in V%X (0X%02X) is NOT pressed; Key pad value: %d\n", 
-                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
-            }
-            break;
+// Load the rom in file rom_name into a machine
+static bool load_rom_file(chip8_instance_t *machine, const char rom_name[]) {
+    uint8_t image[ROM_IMAGE_SIZE];
+    size_t rom_size;
+    if (!read_rom(rom_name, image, &rom_size)) {
+        return false;
+    }
+    if (!chip8_load_rom(machine, image, rom_size, rom_name)) {
+        fprintf(stderr, "Too big of rom file\n");
+        return false;
+    }
+    return true;
+}
 
-    default:
-        printf("Unimplemented opcode. \n");
-        break; // Invalid opcode
+// How often each opcode run started and counter loops were worked out, only the block engine counts
+static void print_fusions(const block_cache_t *cache) {
+    uint64_t total = 0;
+    for (uint32_t i = 1; i < FUSE_COUNT; i++) {
+        total += cache->fused[i];
+    }
+    if (!total) {
+        return;
+    }
+
+    printf("Opcode runs:");
+    for (uint32_t i = 1; i < FUSE_COUNT; i++) {
+        if (cache->fused[i]) {
+            printf(" %s %llu", fuse_names[i], (unsigned long long)cache->fused[i]);
+        }
     }
+    printf("\n");
 }
-#endif
 
+// Run the core with no window and no frame pacing, then report throughput.
+// inputs, when there are any, set the keypad at the start of their frames
+void run_headless(chip8_instance_t *machine, const std::vector<input_event_t> &inputs) {
+    const chip8_t *chip8 = &machine->chip8;
+    const config_t &config = machine->config;
+    const uint64_t budget = config.max_insts > 0 ? config.max_insts
+                                                 : (uint64_t)config.max_frames * config.insts_per_sec / 60;
+    uint64_t executed = 0;
+    size_t next_input = 0;
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+
+    while (executed < budget) {
+        while (next_input < inputs.size() && inputs[next_input].frame <= machine->frame) {
+            chip8_set_keys(machine, inputs[next_input++].keys);
+        }
 
+        // Run one frame worth of instructions, or whatever is left of the budget
+        const uint32_t insts_per_frame = frame_insts(config.insts_per_sec, machine->frame);
+        const uint64_t remaining = budget - executed;
+        const uint32_t count = remaining < insts_per_frame ? (uint32_t)remaining : insts_per_frame;
 
-// Emulate 1 chip 8 instuctions
-void emulator_instructions(chip8_t *chip8, const config_t config) {
-    // Get the next opcode from RAM
-    chip8->inst.opcode = (chip8->ram[chip8 -> PC] << 8) | (chip8 -> ram[chip8->PC + 1]);
+        chip8_step(machine, count);
+        executed += count;
 
-    // Pre increment program counter
-    chip8->PC += 2; 
+        // Only a completed frame ticks the 60hz timers
+        if (count == insts_per_frame) {
+            chip8_tick(machine);
+        }
+    }
 
-    // Fill out cur instructionf format
-    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-    chip8->inst.NN = chip8->inst.opcode & 0x0FF;
-    chip8->inst.N = chip8->inst.opcode & 0x0F;
-    chip8->inst.X = (chip8->inst.opcode >> 8) & 0x0F;
-    chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x0F;
+    const uint64_t end = SDL_GetPerformanceCounter();
+    const double seconds = (double)(end - start) / SDL_GetPerformanceFrequency();
+
+    printf("Rom: %s\n", chip8->rom_name);
+    printf("Instructions: %llu  Frames: %llu  Time: %.6f s\n",
+        (unsigned long long)executed, (unsigned long long)machine->frame, seconds);
+    printf("Instructions/sec: %.0f (%.2f MIPS)\n",
+        seconds > 0 ? executed / seconds : 0.0, seconds > 0 ? executed / seconds / 1e6 : 0.0);
+    if (chip8->idle_insts) {
+        printf("Idle loops: %llu instructions fast-forwarded (%.1f%%)\n",
+            (unsigned long long)chip8->idle_insts, 100.0 * chip8->idle_insts / executed);
+    }
+    print_fusions(&machine->cache);
+    print_final_state(chip8);
+}
 
 
-    switch ((chip8->inst.opcode >> 12) & 0x0F)
-    {
-        case 0x00:
-            if (chip8->inst.NN == 0xE0) {
-                // clear screen 0x00E0
-                memset(chip8->display, 0, sizeof chip8->display);
-            }
-            else if (chip8->inst.NN == 0xEE) {
-                // Return from subroutine
-                chip8->PC = *--chip8->stack_ptr;
-            }
+#ifdef BENCHMARK
+// Benchmark suite, built by `make bench` in place of the emulator.
+// Every number is the best of BENCH_REPS runs on a fresh machine, so one slow run does not count
 
-            else {
-                // Unimplemented opcode
-                break;
-            }
-            break;
-        
-        case 0x01:
-            // 0x01: Jump to address NNN
-            chip8->PC = chip8->inst.NNN; // Set program counter 
-            break;
-            
-        case 0x02:
-            // call subroutine 0x2NNN at NNN
-            *chip8->stack_ptr++ = chip8->PC; // store current address to return on subroutine address
-            chip8->PC = chip8->inst.NNN; // set program ciunter to subroutine address
+#define BENCH_REPS 5
+#define BENCH_ROM_FRAMES 60000 // 1000 emulated seconds at the default speed
+#define BENCH_KERNEL_INSTS 4000000
+#define BENCH_KERNEL_CHUNK 10000 // Instructions between timer ticks in a kernel
+#define BENCH_VEC_ENVS 1024 // Vectorized environments, stepped like a training loop would
+#define BENCH_VEC_STEPS 500
+#define BENCH_VEC_SKIP 4 // Frames per step
+#define BENCH_VEC_STACK 4 // Observations per environment
 
-            break;
-        
-        case 0x03:
-            // 0x03XNN: Check if VX == NN, if so, skip to next instruction
-            if (chip8->V[chip8->inst.X] == chip8->inst.NN) {
-                chip8->PC += 2;
-            }
+// Synthetic kernel: setup code, then a body repeated to fill the loop, then a jump back to the loop.
+// All instructions are big endian opcodes, the rom starts at 0x200
+typedef struct {
+    const char *name;
+    const char *ops; // Opcodes it times
+    std::vector<uint16_t> setup;
+    std::vector<uint16_t> body;
+    std::vector<uint16_t> tail; // After the loop jump, for subroutines
+} bench_kernel_t;
+
+// One timed result
+typedef struct {
+    std::string name;
+    engine_t engine;
+    uint64_t frames;
+    uint64_t instructions;
+    double seconds;
+} bench_result_t;
+
+// One timed vectorized run, frames holds env steps
+typedef struct {
+    bench_result_t result;
+    bool compact;
+    size_t bytes; // chip8_vec_bytes
+} bench_vec_result_t;
+
+// Assemble a kernel into a rom image, the body repeats until the loop holds about 64 instructions.
+// In the body 0x1000 is a jump to the next instruction and 0x2000 a call to the tail
+static std::vector<uint8_t> bench_assemble(const bench_kernel_t &kernel) {
+    std::vector<uint16_t> code = kernel.setup;
+    const uint16_t loop = (uint16_t)(0x200 + 2 * code.size());
+    const size_t repeats = (64 + kernel.body.size() - 1) / kernel.body.size();
+    const uint16_t tail = (uint16_t)(loop + 2 * (repeats * kernel.body.size() + 1));
+    for (size_t r = 0; r < repeats; r++) {
+        for (const uint16_t op : kernel.body) {
+            if (op == 0x1000) code.push_back((uint16_t)(0x1000 | (0x200 + 2 * (code.size() + 1))));
+            else if (op == 0x2000) code.push_back((uint16_t)(0x2000 | tail));
+            else code.push_back(op);
+        }
+    }
+    code.push_back((uint16_t)(0x1000 | loop));
+    code.insert(code.end(), kernel.tail.begin(), kernel.tail.end());
 
-            break;
-        
-        case 0x04:
-            // 0x03XNN: check if VX != NN, if so, skip to next instruction
-            if (chip8->V[chip8->inst.X] != chip8->inst.NN) {
-                chip8->PC += 2;
-            }
-            break;
-        
-        case 0x05:
-            // 0x03XY0: Check if VX == VY,  if so, skip the next instruction
-            if (chip8->inst.N != 0) { // Wrong opcode
-                break;
-            } 
+    std::vector<uint8_t> image;
+    for (const uint16_t op : code) {
+        image.push_back(op >> 8);
+        image.push_back(op & 0xFF);
+    }
+    return image;
+}
 
-            // Skip to next instruction
-            if (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) {
-                chip8->PC += 2;
-            }
-            break;
-        
-        case 0x06:
-            // 0x6XNN: Set reigster VX to NN
-            chip8->V[chip8->inst.X] = chip8->inst.NN;
-            printf("DEBUG: V%X set to 0x%02X\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-            break;
-        
-        case 0x07:
-            // 0x7XNN: Set register VC += to NN
-            chip8->V[chip8->inst.X] += chip8->inst.NN;
-            break;
+// Seconds for a run of frames of insts_per_frame instructions each, timers ticking between frames.
+// insts_per_frame of 0 runs at the configured speed like a real session
+static double bench_time(const char *name, const std::vector<uint8_t> &image, const config_t config,
+                         const uint64_t frames, const uint32_t insts_per_frame) {
+    chip8_t *chip8 = new chip8_t();
+    block_cache_t *cache = new block_cache_t();
+    init_chip8_image(chip8, name, image.data(), image.size());
+    seed_rng(chip8, 1);
+    block_cache_reset(cache, chip8);
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint64_t frame = 0; frame < frames; frame++) {
+        engine_run(chip8, cache, config, insts_per_frame ? insts_per_frame : frame_insts(config.insts_per_sec, frame));
+        update_timers(chip8);
+    }
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-        case 0x08:{
-            switch(chip8 ->inst.N) {
-                // 0x8XY0: Set register VX = VY:
-                case 0:
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-                    break;
-                
-                case 1:
-                    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-                    break; 
-
-                case 2:
-                    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-                    break; 
-
-                case 3:
-                    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-                    break; 
-
-                case 4: // VX += VY, VF = carry
-                    chip8->V[0xF] = ((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255) ? 1 : 0;
-                    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-                    break;
-
-                case 5: // VX -= VY, VF = NOT borrow
-                    chip8->V[0xF] = (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]) ? 1 : 0;
-                    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-                    break;
-                
-                case 6:
-                    // 0x08XY6:
-                    chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
-                    chip8->V[chip8->inst.X] >>= 1;
-                    break;
-                
-                case 7:
-                    // 0x08XY7              
-                    chip8->V[0xF] = (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]) ? 1 : 0;
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-
-                    break;
-
-                case 8:
-                    // 0x08XY8
-                    chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-                    chip8->V[chip8->inst.X] <<= 1;
-                    break;
-
-                case 0xE:
-                    // 0x8XYE: VX <<= 1, VF = most-significant bit before shift
-                    chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-                    chip8->V[chip8->inst.X] <<= 1;
-                    break;
-
-                default:
-                    // Wrong opcode
-                    break;
-            }
+    block_cache_free(cache);
+    delete cache;
+    delete chip8;
+    return seconds;
+}
 
-            break;
+static bench_result_t bench_best(const char *name, const std::vector<uint8_t> &image, const config_t config,
+                                 const uint64_t frames, const uint32_t insts_per_frame) {
+    double best = 0;
+    for (uint32_t rep = 0; rep < BENCH_REPS; rep++) {
+        const double seconds = bench_time(name, image, config, frames, insts_per_frame);
+        if (rep == 0 || seconds < best) best = seconds;
+    }
+    const uint64_t instructions = insts_per_frame ? frames * insts_per_frame : frames * config.insts_per_sec / 60;
+    return {name, config.engine, frames, instructions, best};
+}
+
+static const char *bench_engine_name(const engine_t engine) {
+    return engine == ENGINE_JIT ? "jit" : engine == ENGINE_BLOCK ? "block" : "interp";
+}
+
+// Seconds for BENCH_VEC_STEPS steps of every vectorized environment, observations and a reward
+// hook included. Each environment presses one key or none per step, a different one per env.
+// bytes gets what the environments held
+static double bench_vec_time(const char *name, const std::vector<uint8_t> &image, const engine_t engine,
+                             const bool compact, size_t *bytes) {
+    const chip8_reward_t hook = {0x2F0, 1, 1.0f};
+    chip8_vec_options_t options = {};
+    options.machine.engine = bench_engine_name(engine);
+    options.machine.seed = 1;
+    options.num_envs = BENCH_VEC_ENVS;
+    options.frame_skip = BENCH_VEC_SKIP;
+    options.frame_stack = BENCH_VEC_STACK;
+    options.rewards = &hook;
+    options.num_rewards = 1;
+    options.compact = compact;
+    chip8_vec_env_t *envs = chip8_vec_create(&options, image.data(), image.size(), name);
+
+    std::vector<uint8_t> obs((size_t)BENCH_VEC_ENVS * BENCH_VEC_STACK * CHIP8_HEIGHT * CHIP8_WIDTH);
+    std::vector<float> rewards(BENCH_VEC_ENVS);
+    std::vector<uint16_t> actions(BENCH_VEC_ENVS);
+    chip8_vec_reset(envs, NULL, obs.data());
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint32_t step = 0; step < BENCH_VEC_STEPS; step++) {
+        for (uint32_t i = 0; i < BENCH_VEC_ENVS; i++) {
+            const uint32_t key = (i * 7 + step / 8) % 17;
+            actions[i] = key < 16 ? (uint16_t)(1 << key) : 0;
         }
+        chip8_vec_step(envs, actions.data(), obs.data(), rewards.data());
+    }
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-        case 0x09:
-            // 0x9XY0: Check if VX != VY
-            if (chip8 -> V[chip8->inst.X] != chip8->V[chip8->inst.Y]) {
-                chip8->PC += 2;
-            }    
-            break;
-        
-        case 0x0A:
-            // 0xANNN: Set index register I to NNN
-            chip8->I = chip8->inst.NNN;
-            break;
-        
-        case 0x0B:
-            // Jump to V0 + NNN
-            chip8->PC = chip8->V[0] + chip8->inst.NNN;
-            break;
-        
-        case 0x0C:
-            // Sets reigster VX = rand() % 256 & NN
-            chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
-            break;
-        
-        case 0x0D:
-            // 0xDXYN: Draw N height sprite at coords X and Y
-            // Read from memory location I
-            // VF (Carry Flag) is set if any
-            // Screen pixels are XOR with sprite bits
-            {uint8_t X_coord = chip8-> V[chip8->inst.X] % config.window_width;
-            uint8_t Y_coord = chip8-> V[chip8->inst.Y] % config.window_height;
-            uint8_t orig_X = X_coord;
-
-            chip8->V[0xF] = 0; // Init carry to 0
-
-            // Loop through instructions
-            for (uint8_t i = 0; i < chip8->inst.N; i++) {
-                // Get the next byte/row of sprite data
-                const uint8_t sprite_data = chip8->ram[chip8->I + i];
-                X_coord = orig_X; // Reset X for the next row
-
-
-                for (int j = 7; j >= 0; j --) {
-                    // If sprite pixil nits is on and display pixel is on, set carry flage
-                    uint8_t x = X_coord % config.window_width;
-                    uint8_t y = Y_coord % config.window_height;
-
-                    bool *pixel = &chip8->display[y * config.window_width + x];
-                    const bool sprite_bit = (sprite_data & (1 << j));
-
-                    if (sprite_bit && *pixel) {
-                        chip8->V[0xF] = 1;
-                    }
-
-                    *pixel ^= sprite_bit;
-                    X_coord++;
-
-                    // // Stop drawing if hit right edge
-                    // if (X_coord >= config.window_width) {
-                    //     break;
-                    // }
-                }
-                // Stop drawing when we hit the bottom edge
-                if (++Y_coord >= config.window_height) {
-                    break;
-                }
+    *bytes = chip8_vec_bytes(envs);
+    chip8_vec_destroy(envs);
+    return seconds;
+}
+
+// Run the suite, argv takes [--out bench.json] [--engine interp|block|jit] [--roms dir]
+bool run_benchmarks(const int argc, const char **argv) {
+    const char *out_path = "bench.json";
+    const char *rom_dir = "roms";
+    std::vector<engine_t> engines = {ENGINE_INTERP, ENGINE_BLOCK};
+    #ifdef CHIP8_JIT
+    engines.push_back(ENGINE_JIT);
+    #endif
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--roms") == 0 && i + 1 < argc) {
+            rom_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "interp") == 0) engines = {ENGINE_INTERP};
+            else if (strcmp(argv[i], "block") == 0) engines = {ENGINE_BLOCK};
+            #ifdef CHIP8_JIT
+            else if (strcmp(argv[i], "jit") == 0) engines = {ENGINE_JIT};
+            #endif
+            else {
+                fprintf(stderr, "Unknown engine: %s\n", argv[i]);
+                return false;
             }
-            break;
         }
-        case 0x0E:
-            if (chip8->inst.NN == 0x9E) {
-                // Skip next instruction if key in VX is pressed
-                if (chip8->keypad[chip8->V[chip8->inst.X]]) {
-                    chip8->PC += 2;
-                }
-                
+        else {
+            fprintf(stderr, "Usage: %s [--out bench.json] [--engine interp|block|jit] [--roms dir]\n", argv[0]);
+            return false;
+        }
+    }
+
+    // Default speed and pacing, only the engine changes between runs
+    config_t config;
+    const char *no_args[] = {argv[0]};
+    set_config(&config, 1, no_args);
+
+    // Register setup shared by the kernels: V0-V5 distinct, I at scratch RAM well away from code
+    const std::vector<uint16_t> regs = {0x6000, 0x6107, 0x6211, 0x631D, 0x6429, 0x6533, 0xAE00};
+    std::vector<uint16_t> glyph = regs;
+    glyph.push_back(0xF029); // I at the 0 glyph
+    const std::vector<bench_kernel_t> kernels = {
+        {"baseline", "7XNN", regs, {0x7001}, {}},
+        {"alu", "8XY1-8XYE", regs, {0x8014, 0x8125, 0x8231, 0x8342, 0x8413, 0x8506, 0x801E, 0x8127}, {}},
+        {"draw", "DXYN", glyph, {0xD015, 0xD235, 0xD455, 0xD125, 0xD345, 0xD505}, {}},
+        {"memory", "FX55 FX65", regs, {0xF755, 0xF765, 0xF355, 0xF365}, {}},
+        // SE no skip, SE skip over a jump that never runs, SNE no skip, call, ret, jump
+        {"branch", "3XNN 5XY0 9XY0 2NNN 00EE 1NNN", regs, {0x3001, 0x5000, 0x1200, 0x9000, 0x2000, 0x1000}, {0x00EE}},
+    };
+
+    std::vector<bench_result_t> roms;
+    std::vector<bench_result_t> timed_kernels;
+    std::vector<bench_vec_result_t> vec_envs;
+    const char *rom_names[] = {"pong", "tetris", "invaders", "tank"};
+
+    for (const engine_t engine : engines) {
+        config.engine = engine;
+
+        for (const char *rom : rom_names) {
+            const std::string path = std::string(rom_dir) + "/" + rom + ".rom";
+            FILE *file = fopen(path.c_str(), "rb");
+            if (!file) {
+                fprintf(stderr, "Skipping %s, could not open it\n", path.c_str());
+                continue;
             }
-            else if (chip8->inst.NN == 0xA1) {
-                // Skip next instruction if key in VX is not pressed
-                if (!chip8->keypad[chip8->V[chip8->inst.X]]) {
-                    chip8->PC += 2;
+            std::vector<uint8_t> image(4096);
+            image.resize(fread(image.data(), 1, image.size(), file));
+            fclose(file);
+
+            roms.push_back(bench_best(rom, image, config, BENCH_ROM_FRAMES, 0));
+            roms.back().name = path;
+
+            // Training throughput on one rom is enough, they all spend their time in the same places
+            // once with whole machines and once compact
+            for (int compact = 0; compact < 2 && strcmp(rom, "pong") == 0; compact++) {
+                double best = 0;
+                size_t bytes = 0;
+                for (uint32_t rep = 0; rep < BENCH_REPS; rep++) {
+                    const double seconds = bench_vec_time(rom, image, engine, compact, &bytes);
+                    if (rep == 0 || seconds < best) best = seconds;
                 }
+                const uint64_t steps = (uint64_t)BENCH_VEC_ENVS * BENCH_VEC_STEPS;
+                vec_envs.push_back({{path, engine, steps, steps * BENCH_VEC_SKIP * config.insts_per_sec / 60, best},
+                                    compact != 0, bytes});
             }
-            break;
-        
-        case 0x0F:{
-            switch (chip8->inst.NN)
-            {
-            case 0x0A:{
-                // Await until a key press, and store in VX
-                bool any_key = false;
-                for (uint8_t i = 0; i < sizeof chip8->keypad; i ++) {
-                    if (chip8->keypad[i]) {
-                        chip8->V[chip8->inst.X] = i;
-                        any_key = true;
-                        break;
-                    }
-                }
+        }
 
-                // Keep getting the current opcode and running this instruction when nothing have been pressed
-                if (!any_key) {
-                    chip8->PC -= 2;
-                    any_key = true;
-                }}
-                break;
-            
-            case 0X1E:
-                // I += VX, Add VX to register I.
-                chip8->I += chip8->V[chip8->inst.X];
-                break;
-            
+        for (const bench_kernel_t &kernel : kernels) {
+            const std::vector<uint8_t> image = bench_assemble(kernel);
+            timed_kernels.push_back(bench_best(kernel.name, image, config,
+                                               BENCH_KERNEL_INSTS / BENCH_KERNEL_CHUNK, BENCH_KERNEL_CHUNK));
+        }
+    }
 
-            case 0X07:
-                // VX = delay timer
-                chip8->V[chip8->inst.X] = chip8->delay_timer;
-                break;
+    // Human readable summary on stderr, JSON to the file
+    for (const bench_result_t &r : roms) {
+        fprintf(stderr, "%-20s %-6s %8.2f MIPS %9.1f ns/frame\n", r.name.c_str(), bench_engine_name(r.engine),
+                r.instructions / r.seconds / 1e6, r.seconds * 1e9 / r.frames);
+    }
+    for (const bench_result_t &r : timed_kernels) {
+        fprintf(stderr, "kernel %-13s %-6s %8.2f MIPS %9.2f ns/inst\n", r.name.c_str(), bench_engine_name(r.engine),
+                r.instructions / r.seconds / 1e6, r.seconds * 1e9 / r.instructions);
+    }
+    for (const bench_vec_result_t &v : vec_envs) {
+        const bench_result_t &r = v.result;
+        fprintf(stderr, "vec %-16s %-6s %8.0f env steps/s (%u envs%s, %zu bytes/env)\n", r.name.c_str(),
+                bench_engine_name(r.engine), r.frames / r.seconds, BENCH_VEC_ENVS, v.compact ? " compact" : "",
+                v.bytes / BENCH_VEC_ENVS);
+    }
 
-            
-            case 0x15:
-                // delay timer = VX
-                chip8->delay_timer = chip8->V[chip8->inst.X];
-                break;
-            
-            case 0x18:
-                // sound timer = VX
-                chip8->sound_timer = chip8->V[chip8->inst.X];
-                break;
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        fprintf(stderr, "Could not open %s\n", out_path);
+        return false;
+    }
+    fprintf(out, "{\n  \"build\": {\"compiler\": \"%s\", \"avx2\": %s, \"threaded_dispatch\": %s, \"reps\": %d},\n",
+            __VERSION__,
+            #if defined(__AVX2__)
+            "true",
+            #else
+            "false",
+            #endif
+            #if defined(THREADED_DISPATCH)
+            "true",
+            #else
+            "false",
+            #endif
+            BENCH_REPS);
+
+    fprintf(out, "  \"roms\": [\n");
+    for (size_t i = 0; i < roms.size(); i++) {
+        const bench_result_t &r = roms[i];
+        fprintf(out, "    {\"rom\": \"%s\", \"engine\": \"%s\", \"frames\": %llu, \"instructions\": %llu, "
+                     "\"seconds\": %.6f, \"mips\": %.3f, \"ns_per_frame\": %.1f}%s\n",
+                json_escape(r.name.c_str()).c_str(), bench_engine_name(r.engine), (unsigned long long)r.frames,
+                (unsigned long long)r.instructions, r.seconds, r.instructions / r.seconds / 1e6,
+                r.seconds * 1e9 / r.frames, i + 1 < roms.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"kernels\": [\n");
+    for (size_t i = 0; i < timed_kernels.size(); i++) {
+        const bench_result_t &r = timed_kernels[i];
+        const char *ops = "";
+        for (const bench_kernel_t &kernel : kernels) {
+            if (r.name == kernel.name) ops = kernel.ops;
+        }
+        fprintf(out, "    {\"kernel\": \"%s\", \"ops\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, "
+                     "\"seconds\": %.6f, \"mips\": %.3f, \"ns_per_inst\": %.3f}%s\n",
+                json_escape(r.name.c_str()).c_str(), ops, bench_engine_name(r.engine), (unsigned long long)r.instructions,
+                r.seconds, r.instructions / r.seconds / 1e6, r.seconds * 1e9 / r.instructions,
+                i + 1 < timed_kernels.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"vec_env\": [\n");
+    for (size_t i = 0; i < vec_envs.size(); i++) {
+        const bench_result_t &r = vec_envs[i].result;
+        fprintf(out, "    {\"rom\": \"%s\", \"engine\": \"%s\", \"compact\": %s, \"envs\": %d, \"frame_skip\": %d, "
+                     "\"frame_stack\": %d, \"env_steps\": %llu, \"seconds\": %.6f, \"env_steps_per_sec\": %.0f, "
+                     "\"bytes_per_env\": %zu}%s\n",
+                json_escape(r.name.c_str()).c_str(), bench_engine_name(r.engine), vec_envs[i].compact ? "true" : "false", BENCH_VEC_ENVS,
+                BENCH_VEC_SKIP, BENCH_VEC_STACK, (unsigned long long)r.frames, r.seconds, r.frames / r.seconds,
+                vec_envs[i].bytes / BENCH_VEC_ENVS, i + 1 < vec_envs.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+    fprintf(stderr, "Wrote %s\n", out_path);
+    return true;
+}
+#endif
 
-            
-            case 0x29:
-                // set register I to sprite location in memory in characters in VX
-                chip8->I = chip8->V[chip8->inst.X] * 5;
-                break;
-            
-            case 0x33:{
-                // store BCD of VX of memory offset from I
-                uint8_t value = chip8->V[chip8->inst.X];
 
-                chip8->ram[chip8->I]     = value / 100;        // hundreds
-                chip8->ram[chip8->I + 1] = (value / 10) % 10;  // tens
-                chip8->ram[chip8->I + 2] = value % 10;         // ones
-                break;
+// One manifest line
+typedef struct {
+    std::string rom;
+    uint32_t frames;
+    std::string input_script; // Empty for no input
+    uint32_t seed;
+    std::string state; // Save state to start from, empty for a fresh machine
+} batch_job_t;
+
+// What a finished job reports
+typedef struct {
+    bool ok;
+    uint64_t state_hash;
+    uint32_t display_hash;
+    uint32_t frames;
+    uint64_t instructions;
+    double seconds;
+} batch_result_t;
+
+// Load a manifest: "<rom> <frames> [input script or -] [seed] [save state or -]" per line, '#' comments
+bool load_manifest(const char *path, std::vector<batch_job_t> *jobs) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open manifest %s\n", path);
+        return false;
+    }
+
+    char line[1024];
+    uint32_t line_no = 0;
+    while (fgets(line, sizeof line, file)) {
+        line_no++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+
+        char rom[512];
+        char script[512] = "-";
+        char state[512] = "-";
+        unsigned long frames;
+        unsigned long seed = 1;
+        if (sscanf(line, "%511s %lu %511s %lu %511s", rom, &frames, script, &seed, state) < 2) {
+            fprintf(stderr, "%s:%u: expected <rom> <frames> [input script] [seed] [save state]\n", path, line_no);
+            fclose(file);
+            return false;
+        }
+        jobs->push_back({rom, (uint32_t)frames, strcmp(script, "-") == 0 ? "" : script, (uint32_t)seed,
+                         strcmp(state, "-") == 0 ? "" : state});
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Load a job's input script. Every job runs at the speed and with the quirks of the batch, and a
+// log recorded with others would run different instructions than it did, so it fails the job
+static bool load_job_inputs(const batch_job_t &job, const config_t config, std::vector<input_event_t> *inputs) {
+    const char *path = job.input_script.c_str();
+    uint32_t ips = config.insts_per_sec;
+    quirk_profile_t quirks = config.quirks;
+    if (!load_input_script(path, inputs, NULL, NULL, &ips, &quirks)) {
+        return false;
+    }
+    if (ips != config.insts_per_sec || quirks != config.quirks) {
+        fprintf(stderr, "%s was recorded with --ips %u --quirks %s, run the batch with those\n",
+                path, ips, quirk_table[quirks].name);
+        return false;
+    }
+    return true;
+}
+
+// Run one job on its own machine, nothing here is shared between threads
+static batch_result_t run_batch_job(const batch_job_t &job, const config_t config) {
+    batch_result_t result = {};
+
+    std::vector<input_event_t> inputs;
+    if (!job.input_script.empty() && !load_job_inputs(job, config, &inputs)) {
+        return result;
+    }
+    chip8_state_t *state = NULL;
+    if (!job.state.empty()) {
+        state = new chip8_state_t();
+        if (!read_state(job.state.c_str(), state)) {
+            delete state;
+            return result;
+        }
+    }
+
+    chip8_t *chip8 = new chip8_t();
+    block_cache_t *cache = new block_cache_t();
+    if (init_chip8(chip8, job.rom.c_str())) {
+        // The manifest seed wins over the one in the save state
+        if (state) {
+            restore_chip8(chip8, state);
+        }
+        block_cache_reset(cache, chip8);
+        seed_rng(chip8, job.seed);
+
+        size_t next_input = 0;
+        const uint64_t start = SDL_GetPerformanceCounter();
+
+        for (uint32_t frame = 0; frame < job.frames; frame++) {
+            while (next_input < inputs.size() && inputs[next_input].frame <= frame) {
+                set_keypad(chip8, inputs[next_input++].keys);
             }
+            engine_run(chip8, cache, config, frame_insts(config.insts_per_sec, frame));
+            update_timers(chip8);
+        }
 
-            case 0x55:
-                // Reguster dump V0-VX inclusive to memory offset from I
-                for (uint8_t i = 0; i <= chip8->inst.X; i ++) {
-                    chip8->ram[chip8->I + i] = chip8->V[i];
-                }
-                break;
+        result.seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+        result.ok = true;
+        result.frames = job.frames;
+        result.instructions = (uint64_t)job.frames * config.insts_per_sec / 60;
+        result.state_hash = state_hash(chip8);
+        result.display_hash = display_hash(chip8);
+    }
 
-            case 0x65:
-                // Load V0-VX inclusivb eto memory offset from I
-                for (uint8_t i = 0; i <= chip8->inst.X; i ++) {
-                    chip8->V[i] = chip8->ram[chip8->I + i];
-                }
-                break;
-            
-            default:
-                break;
-            }}
-    default:
-        break; // Invalid opcode
+    block_cache_free(cache);
+    delete cache;
+    delete chip8;
+    delete state;
+    return result;
+}
+
+// Work stealing queue per worker: the owner pops from the back, thieves take from the front
+typedef struct {
+    std::mutex lock;
+    std::deque<uint32_t> jobs;
+} work_queue_t;
+
+static bool pop_job(std::vector<work_queue_t> &queues, const uint32_t self, uint32_t *job) {
+    {
+        std::lock_guard<std::mutex> guard(queues[self].lock);
+        if (!queues[self].jobs.empty()) {
+            *job = queues[self].jobs.back();
+            queues[self].jobs.pop_back();
+            return true;
+        }
+    }
+
+    // Own queue is empty, steal from the others
+    for (uint32_t i = 1; i < queues.size(); i++) {
+        work_queue_t &victim = queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            *job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
     }
+    return false;
 }
 
+// Run every job as one machine of a lockstep_t, jobs differ only in input and seed
+static bool run_lockstep_batch(const std::vector<batch_job_t> &jobs, const config_t config,
+                               std::vector<batch_result_t> *results) {
+    for (const batch_job_t &job : jobs) {
+        if (job.rom != jobs[0].rom || job.frames != jobs[0].frames || job.state != jobs[0].state) {
+            fprintf(stderr, "Lockstep needs the same rom, frame count and save state for every job\n");
+            return false;
+        }
+    }
 
-// Handle chip 8 init
-bool init_chip8(chip8_t *chip8, const char rom_name[]) {
-    // Entry point
-    const uint32_t entry_point = 0x200;
-    const uint8_t font[] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0,		// 0
-        0x20, 0x60, 0x20, 0x20, 0x70,		// 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0,		// 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0,		// 3
-        0x90, 0x90, 0xF0, 0x10, 0x10,		// 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0,		// 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0,		// 6
-        0xF0, 0x10, 0x20, 0x40, 0x40,		// 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0,		// 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0,		// 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90,		// A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0,		// B
-        0xF0, 0x80, 0x80, 0x80, 0xF0,		// C
-        0xE0, 0x90, 0x90, 0x90, 0xE0,		// D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0,		// E
-        0xF0, 0x80, 0xF0, 0x80, 0x80		// F
-    }; 
-
-    // Load font
-    memcpy(&chip8->ram[0], font, sizeof(font));
-
-    // Load ROM to chip8
-    FILE *rom = fopen(rom_name, "rb");
-    if (!rom ) {
-        SDL_Log("Could not open rom file");
+    // Every machine starts at the entry point, or all at the save state
+    chip8_t *first = new chip8_t();
+    bool ready = init_chip8(first, jobs[0].rom.c_str());
+    if (ready && !jobs[0].state.empty()) {
+        chip8_state_t *state = new chip8_state_t();
+        ready = read_state(jobs[0].state.c_str(), state);
+        if (ready) {
+            restore_chip8(first, state);
+        }
+        delete state;
+    }
+
+    lockstep_t *ls = new lockstep_t();
+    ready = ready && lockstep_init(ls, first, (uint32_t)jobs.size());
+    delete first;
+    if (!ready) {
+        delete ls;
         return false;
     }
 
-    // Get/check rom size
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof chip8->ram - entry_point;
-    rewind(rom);
+    // A job whose input script is bad fails alone, its machine still runs with no input
+    std::vector<std::vector<input_event_t>> inputs(jobs.size());
+    std::vector<size_t> next_input(jobs.size(), 0);
+    std::vector<bool> ok(jobs.size());
+    for (uint32_t i = 0; i < jobs.size(); i++) {
+        ok[i] = jobs[i].input_script.empty() || load_job_inputs(jobs[i], config, &inputs[i]);
+        seed_rng(&ls->machines[i], jobs[i].seed);
+    }
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+
+    for (uint32_t frame = 0; frame < jobs[0].frames; frame++) {
+        for (uint32_t i = 0; i < jobs.size(); i++) {
+            while (next_input[i] < inputs[i].size() && inputs[i][next_input[i]].frame <= frame) {
+                lockstep_set_keys(ls, i, inputs[i][next_input[i]++].keys);
+            }
+        }
+        lockstep_run(ls, config, frame_insts(config.insts_per_sec, frame));
+        lockstep_update_timers(ls);
+    }
+
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    for (uint32_t i = 0; i < jobs.size(); i++) {
+        batch_result_t &r = (*results)[i];
+        if (!ok[i]) {
+            continue;
+        }
+        const chip8_t *chip8 = lockstep_machine(ls, i);
+        r.ok = true;
+        r.frames = jobs[i].frames;
+        r.instructions = (uint64_t)jobs[i].frames * config.insts_per_sec / 60;
+        r.state_hash = state_hash(chip8);
+        r.display_hash = display_hash(chip8);
+        r.seconds = seconds / jobs.size();
+    }
+
+    fprintf(stderr, "Lockstep: %u machines, %.3f groups per warp step (1 when no machine diverged)\n",
+            ls->count, ls->warp_steps ? (double)ls->groups / ls->warp_steps : 0.0);
+    delete ls;
+    return true;
+}
 
-    // Checking rom size
-    if (rom_size > max_size) {
-        SDL_Log("Too big of rom file");
+// Run every job in the manifest across all cores and write the results as JSON
+bool run_batch(const config_t config) {
+    std::vector<batch_job_t> jobs;
+    if (!load_manifest(config.batch_manifest, &jobs)) {
         return false;
     }
 
-    // Load Rom
-    if (fread(&chip8->ram[entry_point], rom_size, 1, rom) != 1) {
-        SDL_Log("Can not read rom file to chip 8 memory");
+    // Each job writes only its own slot
+    std::vector<batch_result_t> results(jobs.size());
+    const uint64_t start = SDL_GetPerformanceCounter();
+    uint32_t threads = 1;
+
+    if (config.engine == ENGINE_LOCKSTEP) {
+        if (!jobs.empty() && !run_lockstep_batch(jobs, config, &results)) {
+            return false;
+        }
+    }
+    else {
+        threads = config.threads ? config.threads : std::thread::hardware_concurrency();
+        if (threads == 0) {
+            threads = 1;
+        }
+        if (threads > jobs.size() && !jobs.empty()) {
+            threads = (uint32_t)jobs.size();
+        }
+
+        // Deal jobs round robin, stealing evens out roms that run long
+        std::vector<work_queue_t> queues(threads);
+        for (uint32_t i = 0; i < jobs.size(); i++) {
+            queues[i % threads].jobs.push_back(i);
+        }
+
+        std::vector<std::thread> workers;
+        for (uint32_t t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                uint32_t job;
+                while (pop_job(queues, t, &job)) {
+                    results[job] = run_batch_job(jobs[job], config);
+                }
+            });
+        }
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    const double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    FILE *out = config.out_path ? fopen(config.out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Could not open %s\n", config.out_path);
         return false;
-    };
+    }
 
-    fclose(rom);
+    uint64_t total_insts = 0;
+    uint32_t failed = 0;
+    fprintf(out, "[\n");
+    for (uint32_t i = 0; i < jobs.size(); i++) {
+        const batch_result_t &r = results[i];
+        total_insts += r.instructions;
+        failed += !r.ok;
+        fprintf(out, "  {\"job\": %u, \"rom\": \"%s\", \"ok\": %s, \"frames\": %u, \"instructions\": %llu, "
+                     "\"state_hash\": \"0x%016llX\", \"display_hash\": \"0x%08X\", \"seconds\": %.6f}%s\n",
+                i, json_escape(jobs[i].rom.c_str()).c_str(), r.ok ? "true" : "false", r.frames, (unsigned long long)r.instructions,
+                (unsigned long long)r.state_hash, r.display_hash, r.seconds, i + 1 < jobs.size() ? "," : "");
+    }
+    fprintf(out, "]\n");
+    if (out != stdout) {
+        fclose(out);
+    }
 
-    // Default as running
-    chip8->state = RUNNING; 
-    chip8->PC = entry_point;
-    chip8->rom_name = rom_name;
-    chip8->stack_ptr = chip8->stack;
+    fprintf(stderr, "Batch: %zu jobs (%u failed) on %u threads in %.3f s, %.2f MIPS total\n",
+            jobs.size(), failed, threads, seconds, seconds > 0 ? total_insts / seconds / 1e6 : 0.0);
+    return failed == 0;
+}
 
-    return true;
+
+// 60 Hz frame clock. Deadlines are start + n / 60 s worked out from the tick count, so rounding
+// never adds up to drift. Waits sleep until spin_ns before a deadline, then spin the rest, which
+// covers a late OS wakeup without burning a core. How late every tick woke up goes into a histogram
+#define SCHED_HZ 60
+#define SCHED_BUCKET_NS 10000 // Lateness histogram resolution
+#define SCHED_BUCKETS 1000 // Up to 10 ms, later than that lands in the last bucket
+#define SCHED_PAUSE_MS 10 // How often a paused emulation thread looks for commands
+
+typedef struct {
+    uint64_t spin_ns; // Spun rather than slept before each deadline
+    uint64_t start; // When tick 0 was due
+    uint64_t ticks; // Ticks since start
+    uint64_t waits; // Ticks waited for
+    uint64_t missed; // Ticks already a whole period late, the schedule restarted from then
+    uint64_t late_sum; // Nanoseconds
+    uint64_t late_max;
+    uint32_t late_hist[SCHED_BUCKETS];
+} frame_clock_t;
+
+void frame_clock_init(frame_clock_t *clock, const uint32_t spin_us) {
+    memset(clock, 0, sizeof *clock);
+    clock->spin_ns = spin_us * 1000ull;
+    clock->start = SDL_GetTicksNS();
 }
 
-// Update delay and timer for chip8 
-void update_timers(chip8_t *chip8) {
-    if (chip8->delay_timer > 0) {
-        chip8 ->delay_timer --;
+// Block until the next tick is due
+void frame_clock_wait(frame_clock_t *clock) {
+    clock->ticks++;
+    const uint64_t deadline = clock->start + clock->ticks * 1000000000ull / SCHED_HZ;
+
+    uint64_t now = SDL_GetTicksNS();
+    if (now < deadline) {
+        if (deadline - now > clock->spin_ns) {
+            SDL_DelayNS(deadline - now - clock->spin_ns);
+        }
+        while ((now = SDL_GetTicksNS()) < deadline) {
+        }
     }
 
-    if (chip8->sound_timer > 0) {
-        chip8->sound_timer -- ;
-        // TODO: play sound
+    const uint64_t late = now - deadline;
+    clock->waits++;
+    clock->late_sum += late;
+    if (late > clock->late_max) clock->late_max = late;
+    clock->late_hist[late / SCHED_BUCKET_NS < SCHED_BUCKETS ? late / SCHED_BUCKET_NS : SCHED_BUCKETS - 1]++;
+
+    // A whole frame behind, a stall or a debugger. Run from now instead of rushing to catch up
+    if (late >= 1000000000ull / SCHED_HZ) {
+        clock->missed++;
+        clock->start = now;
+        clock->ticks = 0;
     }
-    else {
-        // TODO: stop sound
+}
+
+// Lateness under which pct percent of the waits woke up, in microseconds
+double frame_clock_percentile(const frame_clock_t *clock, const double pct) {
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < SCHED_BUCKETS; i++) {
+        seen += clock->late_hist[i];
+        if (seen >= clock->waits * pct / 100) {
+            return (i + 1) * SCHED_BUCKET_NS / 1000.0;
+        }
     }
+    return SCHED_BUCKETS * SCHED_BUCKET_NS / 1000.0;
 }
 
+void frame_clock_report(const frame_clock_t *clock) {
+    if (clock->waits == 0) {
+        return;
+    }
+    fprintf(stderr, "Frame pacing: %llu ticks, woke late by avg %.1f us, p50 %.0f us, p99 %.0f us, "
+                    "max %.1f us, %llu missed\n",
+            (unsigned long long)clock->waits, clock->late_sum / 1000.0 / clock->waits,
+            frame_clock_percentile(clock, 50), frame_clock_percentile(clock, 99),
+            clock->late_max / 1000.0, (unsigned long long)clock->missed);
+}
 
+// Publish a frame and wake the SDL thread, which sleeps waiting for events between frames
+static void emu_publish(emu_link_t *link, const chip8_t *chip8) {
+    if (publish_frame(&link->frames, &chip8->display)) {
+        SDL_Event wake = {};
+        wake.type = SDL_EVENT_USER;
+        SDL_PushEvent(&wake);
+    }
+}
 
+// Windowed emulation, on its own thread so a slow present or a driver stall never slows the rom down.
+// Runs one frame per frame_clock_t tick and only talks to SDL through link
+void run_emulation(chip8_instance_t *machine, emu_link_t *link, rewind_t *rewind, audio_t *audio,
+                   std::vector<input_event_t> *recorded, uint32_t *frame) {
+    chip8_t *chip8 = &machine->chip8;
+    frame_clock_t clock;
+    frame_clock_init(&clock, machine->config.spin_us);
+    emu_publish(link, chip8);
+    bool paused = false;
+
+    while (link->state != QUIT) {
+        // Quick save and load, to <rom>.state
+        const uint32_t commands = link->commands.exchange(0);
+        if (commands) {
+            const std::string path = std::string(chip8->rom_name) + ".state";
+            chip8_state_t state;
+            if (commands & EMU_SAVE) {
+                snapshot_chip8(chip8, &state);
+                if (write_state(path.c_str(), &state)) {
+                    printf("Saved %s\n", path.c_str());
+                }
+            }
+            if ((commands & EMU_LOAD) && read_state(path.c_str(), &state)) {
+                restore_chip8(chip8, &state);
+                printf("Loaded %s\n", path.c_str());
+                emu_publish(link, chip8);
+            }
+        }
 
-// Main method
-int main(int argc, char **argv) {
-    // Default usage message for args
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <rom>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        // Step back one record per frame while backspace is held, paused or not
+        if (link->rewind) {
+            if (rewind_step(rewind, chip8)) {
+                emu_publish(link, chip8);
+            }
+        }
+        else if (link->state == RUNNING) {
+            chip8_set_keys(machine, link->keys);
+            if (recorded) {
+                record_input(recorded, chip8, *frame);
+            }
+
+            // Emulate instructions for frame
+            chip8_step(machine, frame_insts(machine->config.insts_per_sec, *frame));
+
+            // Print debug info
+            #ifdef DEBUG
+            print_debug_info(chip8);
+            #endif
+
+            // Beep for this frame, then update delay and sound timer
+            audio_frame(audio, chip8->sound_timer > 0);
+            chip8_tick(machine);
+
+            rewind_record(rewind, chip8);
+            (*frame)++;
+            emu_publish(link, chip8);
+        }
+        else {
+            // Paused: no frames to pace, just look for commands now and then
+            SDL_Delay(SCHED_PAUSE_MS);
+            paused = true;
+            continue;
+        }
+
+        // Pace afresh after a pause rather than counting it as missed frames
+        if (paused) {
+            clock.start = SDL_GetTicksNS();
+            clock.ticks = 0;
+            paused = false;
+        }
+        frame_clock_wait(&clock);
     }
 
-    (void)argc;
-    (void)argv;
+    frame_clock_report(&clock);
+}
+
+// Main method
+int main(int argc, char **argv) {
+    #ifdef BENCHMARK
+    // Benchmark build runs the suite instead of a rom
+    exit(run_benchmarks(argc, (const char**)argv) ? EXIT_SUCCESS : EXIT_FAILURE);
+    #endif
 
     sdl_t sdl = {};
     
@@ -933,69 +2091,189 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    // Init chip 8 machine
-    chip8_t chip8 = {};
-    const char *rom_name =  argv[1];
-    if (!init_chip8(&chip8, rom_name)) {
-        exit(EXIT_FAILURE);
+    // Trace build: decode a trace, or trace everything run from here on. Compiled blocks and
+    // lockstep groups leave no records
+    #ifdef TRACE
+    if (config.decode_trace) {
+        exit(decode_trace(config.decode_trace) ? EXIT_SUCCESS : EXIT_FAILURE);
     }
-
-    // Init SDL
-    if (!init_sdl(&sdl, config)) {
-        exit(EXIT_FAILURE);
+    if (config.engine == ENGINE_JIT || config.engine == ENGINE_AOT) {
+        fprintf(stderr, "Tracing runs on the block engine instead of compiled code\n");
+        config.engine = ENGINE_BLOCK;
+    }
+    if (config.engine == ENGINE_LOCKSTEP) {
+        fprintf(stderr, "Lockstep jobs are not traced\n");
     }
+    trace_start(config.trace_out);
+    #endif
 
-    // Init the function the clear screen / sdl window to background colour
-    clear_screen(config, sdl);
+    // Batch run, every job gets its own machine
+    if (config.batch_manifest) {
+        exit(run_batch(config) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-    // srand
-    srand(time(NULL));
+    if (config.engine == ENGINE_LOCKSTEP) {
+        fprintf(stderr, "Lockstep engine only runs --batch jobs, using the interpreter\n");
+        config.engine = ENGINE_INTERP;
+    }
 
+    // An ahead of time build carries the rom it was compiled from, run that when none is given
+    #ifdef AOT_SOURCE
+    const uint8_t *aot_image = NULL;
+    size_t aot_size = 0;
+    const bool embedded_rom = !config.rom_name;
+    if (embedded_rom) {
+        config.rom_name = aot_rom(&aot_image, &aot_size);
+    }
+    #endif
 
-    // Main emulator loop
-    while (chip8.state != QUIT) {
-        
-        handle_input(&chip8);
+    // Default usage message for args
+    if (!config.rom_name) {
+        fprintf(stderr, "Usage: %s <rom> [--headless] [--frames N] [--insts N] [--engine interp|block|jit|aot]\n"
+                        "              [--load-state file] [--save-state file] [--rewind-mb N] [--rewind-interval N]\n"
+                        "              [--seed N] [--record-input log] [--replay log] [--audio-buffer N] [--audio-latency ms]\n"
+                        "              [--ips N] [--no-idle-skip] [--quirks modern|vip|chip48|schip] [--aot-out file.cpp]\n"
+                        "              [--window WxH] [--spin-us N]\n"
+                        "       %s --batch <manifest> [--threads N] [--out results.json] [--engine interp|block|jit|lockstep]\n",
+                argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
-        // If the state is being paused, skip
-        if (chip8.state == PAUSE) {
-            continue;
+    // A replay brings its own seed and length, the command line still wins. It always runs at
+    // the speed and with the quirks it was recorded with, any other would run different instructions
+    std::vector<input_event_t> inputs;
+    if (config.replay_input) {
+        uint32_t log_seed = 0;
+        uint32_t log_frames = 0;
+        if (!load_input_script(config.replay_input, &inputs, &log_seed, &log_frames, &config.insts_per_sec,
+                               &config.quirks)) {
+            exit(EXIT_FAILURE);
         }
+        if (!config.seed) config.seed = log_seed;
+        if (log_frames && !config.max_insts) config.max_frames = log_frames;
+    }
+    if (!config.seed) config.seed = (uint32_t)time(NULL);
+
+    // Profile everything this rom runs. Blocks and JIT code skip the per instruction hook,
+    // so the interpreter runs it all
+    #ifdef PROFILE
+    if (config.engine != ENGINE_INTERP) {
+        fprintf(stderr, "Profiling runs on the interpreter\n");
+        config.engine = ENGINE_INTERP;
+    }
+    #endif
+
+    // Init chip 8 machine with the whole config, chip8_create only takes the options in chip8.h
+    chip8_instance_t *machine = instance_create(config);
+    chip8_t *chip8 = &machine->chip8;
+    #ifdef AOT_SOURCE
+    const bool loaded = embedded_rom ? chip8_load_rom(machine, aot_image, aot_size, config.rom_name)
+                                     : load_rom_file(machine, config.rom_name);
+    #else
+    const bool loaded = load_rom_file(machine, config.rom_name);
+    #endif
+    if (!loaded) {
+        exit(EXIT_FAILURE);
+    }
 
-        // Get time
-        const uint64_t prev_frame = SDL_GetPerformanceCounter();
+    // Write the rom out as C++ for make aot
+    if (config.aot_out) {
+        exit(aot_write(chip8, config.rom_name, config.quirks, config.aot_out) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-        // Emulate instructions for frame
-        for (uint32_t i = 0; i < config.insts_per_sec / 60; i ++) {
-            // Instruction for chip 8
-            emulator_instructions(&chip8, config);
+    // Pick up where a save state left off, RNG included
+    if (config.load_state) {
+        chip8_state_t state;
+        if (!read_state(config.load_state, &state)) {
+            exit(EXIT_FAILURE);
         }
+        restore_chip8(chip8, &state);
+        block_cache_reset(&machine->cache, chip8);
+    }
 
-        // Get time after running application
-        uint64_t after_frame = SDL_GetPerformanceCounter();
-
-        double time_elapsed = (double) ((after_frame - prev_frame) * 1000) / SDL_GetPerformanceFrequency();
+    #ifdef PROFILE
+    profile_start(config.profile_timed);
+    #endif
 
-        // Print debug info
-        #ifdef DEBUG
-        print_debug_info(&chip8);
+    // Headless run, no SDL window, renderer or delay
+    if (config.headless) {
+        run_headless(machine, inputs);
+        #ifdef PROFILE
+        write_profile(chip8, config.profile_out);
         #endif
+        if (config.save_state) {
+            chip8_state_t state;
+            snapshot_chip8(chip8, &state);
+            exit(write_state(config.save_state, &state) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
 
-        // Delay for 60fps
-        SDL_Delay(16.67f > time_elapsed ? 16.57f - time_elapsed : 0);
+    // Init SDL
+    if (!init_sdl(&sdl, config)) {
+        exit(EXIT_FAILURE);
+    }
 
-        // Clear screen
-        clear_screen(config, sdl);
+    // Rewind history, recorded as the emulator runs. Stepping back would leave holes in an
+    // input recording, so there is no rewind while recording
+    if (config.record_input && config.rewind_mb) {
+        puts("Rewind is off while recording input");
+        config.rewind_mb = 0;
+    }
+    static rewind_t rewind;
+    rewind_init(&rewind, (size_t)config.rewind_mb << 20, config.rewind_interval);
 
-        // Update the window with changes
-        update_screen(sdl, config, chip8);
+    // Init the function the clear screen / sdl window to background colour
+    clear_screen(config, &sdl);
+    SDL_RenderPresent(sdl.renderer);
 
-        // Update delay and sound timer
-        update_timers(&chip8);
+    // The emulation thread owns chip8 from here until it is joined
+    static emu_link_t link;
+    link.state = RUNNING;
+    link.frames.front = 0;
+    link.frames.middle = 1;
+    link.frames.back = 2;
+    uint32_t frame = 0; // Frames run, recorded keypad changes are numbered by it
+    static audio_t audio;
+    init_audio(&audio, config);
+    std::thread emulation(run_emulation, machine, &link, &rewind, &audio, config.record_input ? &inputs : NULL,
+                          &frame);
+
+    // Main loop: input goes over to the emulation thread, finished frames come back
+    bool audio_paused = false;
+    while (link.state != QUIT) {
+        if ((link.state == PAUSE) != audio_paused) {
+            audio_paused = !audio_paused;
+            pause_audio(&audio, audio_paused);
+        }
+
+        // Nothing to show: sleep until there is an event, the emulation thread pushes one
+        // when it has a new frame
+        if (!sdl.redraw && !(link.frames.middle.load(std::memory_order_acquire) & FRAME_FRESH)) {
+            SDL_WaitEvent(NULL);
+        }
+        handle_input(&link, &sdl);
+        link.keys = keypad_mask(sdl.keypad);
+        link.rewind = sdl.rewind;
+
+        // Update the window with the newest frame, no present at all when nothing changed
+        if (consume_frame(&link.frames) || sdl.redraw) {
+            update_screen(&sdl, config, &link.frames.display[link.frames.front]);
+        }
     }
+    emulation.join();
 
     // Final Cleanup
+    close_audio(&audio);
     final_cleanup(&sdl);
 
+    #ifdef PROFILE
+    write_profile(chip8, config.profile_out);
+    #endif
+
+    if (config.record_input && !write_input_log(config.record_input, chip8, config.seed, frame, config.insts_per_sec, config.quirks, inputs)) {
+        exit(EXIT_FAILURE);
+    }
+
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,153 @@
+// libchip8, the emulator core without SDL, for programs that want to run roms in process.
+// Build it with make lib (libchip8.a and libchip8.so).
+//
+//   chip8_instance_t *machine = chip8_create(NULL);
+//   chip8_load_rom(machine, rom, rom_size, "pong");
+//   chip8_set_keys(machine, 1 << 0x5);
+//   chip8_run_frames(machine, 60);
+//   const chip8_display_t *display = chip8_display(machine);
+//
+// Instances share nothing, each can run on its own thread. The views below point straight into
+// an instance: no copies, they change as it runs and stay valid until chip8_destroy
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library's entry points. make lib builds with -fvisibility=hidden, so these are all libchip8.so exports
+#if defined(__GNUC__) || defined(__clang__)
+#define CHIP8_API __attribute__((visibility("default")))
+#else
+#define CHIP8_API
+#endif
+
+#define CHIP8_WIDTH 64 // Original chip 8 resolution, one uint64_t per row
+#define CHIP8_HEIGHT 32
+#define CHIP8_HIRES_WIDTH 128 // SUPER-CHIP high resolution, two uint64_t per row
+#define CHIP8_HIRES_HEIGHT 64
+#define CHIP8_DISPLAY_PLANES 2 // XO-CHIP bit planes, plane 0 is all plain CHIP-8 ever draws to
+
+// What is on screen. Rows are packed a bit per pixel, bit 63 of a row's first word is its
+// leftmost pixel: row y is word y in low resolution and words 2y, 2y + 1 in high resolution,
+// so a plain CHIP-8 display is the first 32 words of plane 0 exactly as it always was
+typedef struct {
+    uint64_t plane[CHIP8_DISPLAY_PLANES][CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT / 64];
+    bool hires; // 128x64, from 00FF until 00FE
+} chip8_display_t;
+
+// A machine with its rom, engine and decoded code
+typedef struct chip8_instance chip8_instance_t;
+
+// How an instance runs, all zero is the defaults
+typedef struct {
+    const char *engine; // "interp", "block" or "jit" as for --engine, NULL for the interpreter
+    const char *quirks; // "modern", "vip", "chip48" or "schip" as for --quirks, NULL for modern
+    uint32_t insts_per_sec; // Instructions per 60 frames, 0 for 500
+    uint32_t seed; // CXNN seed, 0 for a fixed one
+    bool no_idle_skip; // Run idle loops instead of fast-forwarding through them
+} chip8_options_t;
+
+// Registers, read only
+typedef struct {
+    const uint8_t *V; // V0-VF
+    const uint16_t *I;
+    const uint16_t *PC;
+    const uint16_t *stack; // 16 return addresses
+    const uint8_t *stack_ptr; // Index of the next free entry, wraps at 16
+    const uint8_t *delay_timer;
+    const uint8_t *sound_timer;
+} chip8_registers_t;
+
+// NULL options for the defaults. NULL back when an option is not known. The library never prints
+// or exits, every failure comes back to the caller
+CHIP8_API chip8_instance_t *chip8_create(const chip8_options_t *options);
+CHIP8_API void chip8_destroy(chip8_instance_t *machine);
+
+// Reset the machine and load a rom image, copied in. name is only kept for messages. False when
+// the rom does not fit above 0x200
+CHIP8_API bool chip8_load_rom(chip8_instance_t *machine, const uint8_t *rom, size_t size, const char *name);
+
+// Run count instructions. Timers are left alone, see chip8_tick
+CHIP8_API void chip8_step(chip8_instance_t *machine, uint64_t count);
+
+// One 60 Hz tick of the delay and sound timers, the end of a frame
+CHIP8_API void chip8_tick(chip8_instance_t *machine);
+
+// Run whole frames: a 60th of insts_per_sec instructions, then a tick
+CHIP8_API void chip8_run_frames(chip8_instance_t *machine, uint32_t frames);
+
+// Keys held from now on, bit N is key N
+CHIP8_API void chip8_set_keys(chip8_instance_t *machine, uint16_t keys);
+
+CHIP8_API const uint8_t *chip8_ram(const chip8_instance_t *machine); // 4096 bytes
+CHIP8_API chip8_registers_t chip8_registers(const chip8_instance_t *machine);
+CHIP8_API const chip8_display_t *chip8_display(const chip8_instance_t *machine);
+
+// Vectorized environments for agent training: num_envs copies of one rom, stepped across worker
+// threads, with every observation written into one caller buffer.
+//
+//   chip8_vec_options_t options = {0};
+//   options.num_envs = 1024;
+//   options.frame_skip = 4;
+//   chip8_vec_env_t *envs = chip8_vec_create(&options, rom, rom_size, "pong");
+//   chip8_vec_reset(envs, NULL, obs); // obs is uint8_t[1024][32][64]
+//   chip8_vec_step(envs, actions, obs, rewards); // actions is uint16_t[1024], rewards float[1024]
+typedef struct chip8_vec_env chip8_vec_env_t;
+
+// Reward hook: scale times how much the value at address went up over a step
+typedef struct {
+    uint16_t address;
+    uint8_t bytes; // 1, or 2 for a big endian word
+    float scale;
+} chip8_reward_t;
+
+typedef struct {
+    chip8_options_t machine; // How every environment runs. Environment i seeds CXNN from machine.seed + i
+    uint32_t num_envs;
+    uint32_t frame_skip; // Frames per step, the action is held through all of them. 0 for 1
+    uint32_t frame_stack; // Observations per environment, oldest first. 0 for 1
+    const chip8_reward_t *rewards; // Summed into each reward, copied by chip8_vec_create
+    uint32_t num_rewards;
+    uint32_t threads; // Worker threads, 0 for one per core
+    bool compact; // Park environments in a few hundred bytes each, see chip8_vec_bytes
+} chip8_vec_options_t;
+
+// The rom is loaded once. NULL back on a bad option or rom
+CHIP8_API chip8_vec_env_t *chip8_vec_create(const chip8_vec_options_t *options, const uint8_t *rom, size_t size,
+                                            const char *name);
+CHIP8_API void chip8_vec_destroy(chip8_vec_env_t *envs);
+
+// Observations are uint8_t[num_envs][frame_stack][32][64], 1 where a pixel is lit on either plane.
+// A high resolution display is halved, lit where any of the 2x2 pixels is. obs and rewards can be NULL
+
+// Put back the machines reset[i] is set for, all of them when reset is NULL, then write every
+// observation. A reset restores the machine as it was after loading, a fresh stack holds that
+// frame repeated and episode n of environment i seeds CXNN from machine.seed + n * num_envs + i
+CHIP8_API void chip8_vec_reset(chip8_vec_env_t *envs, const bool *reset, uint8_t *obs);
+
+// Hold keypad mask actions[i] (bit N is key N) on environment i for frame_skip frames, then write
+// every observation and reward. actions NULL releases every key. False when the memory for a
+// compact environment's pages ran out: those environments are left as they were before the step,
+// with a reward of 0, and the rest stepped
+CHIP8_API bool chip8_vec_step(chip8_vec_env_t *envs, const uint16_t *actions, uint8_t *obs, float *rewards);
+
+// Environment i, to read with the calls above. Owned by envs, step and reset only through envs.
+// A compact environment is unpacked into a copy, valid until the next call
+CHIP8_API chip8_instance_t *chip8_vec_machine(chip8_vec_env_t *envs, uint32_t i);
+
+// Memory the environments hold, frame stacks included. A compact environment is an 88 byte header
+// plus a 64 byte page per RAM page it has written and per display page with lit pixels, all the
+// other RAM is shared with the loaded rom. Without compact each is a whole machine, 24 KB or so
+CHIP8_API size_t chip8_vec_bytes(const chip8_vec_env_t *envs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
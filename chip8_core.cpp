@@ -0,0 +1,4059 @@
+// The emulator core: machine, engines and the libchip8 API in chip8.h. No SDL, make lib builds
+// this file on its own
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <string>
+#include <atomic>
+#include <map>
+#include <set>
+#include <new>
+#include <algorithm>
+#include "chip8_core.h"
+
+// Wide sprite rows when the compiler is allowed to use them
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifdef CHIP8_JIT
+#include <stddef.h>
+#include <sys/mman.h>
+#endif
+
+// Keeps a big, rarely run path out of the handlers the engines inline, where it costs the hot ones
+#if defined(__GNUC__) || defined(__clang__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+// Profile by its --quirks name
+bool parse_quirks(const char *name, quirk_profile_t *profile) {
+    for (uint32_t i = 0; i < QUIRKS_COUNT; i++) {
+        if (strcmp(name, quirk_table[i].name) == 0) {
+            *profile = (quirk_profile_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Engine by its --engine name, the nearest this build has when it lacks that one
+bool parse_engine(const char *name, engine_t *engine) {
+    if (strcmp(name, "interp") == 0) {
+        *engine = ENGINE_INTERP;
+    }
+    else if (strcmp(name, "block") == 0) {
+        *engine = ENGINE_BLOCK;
+    }
+    else if (strcmp(name, "jit") == 0) {
+        #ifdef CHIP8_JIT
+        *engine = ENGINE_JIT;
+        #else
+        *engine = ENGINE_BLOCK;
+        #endif
+    }
+    else if (strcmp(name, "aot") == 0) {
+        #ifdef AOT_SOURCE
+        *engine = ENGINE_AOT;
+        #else
+        *engine = ENGINE_BLOCK;
+        #endif
+    }
+    else if (strcmp(name, "lockstep") == 0) {
+        *engine = ENGINE_LOCKSTEP;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Default config, what a run gets for every option it does not set
+void config_defaults(config_t *config) {
+    *config = config_t{
+        640, // 10 window pixels per low resolution pixel
+        320,
+        0xFFFFFFFF, // White
+        0x00000000, // Black
+        0xFF5555FF, // Red
+        0x555555FF, // Grey
+        true, // Draw pixel outlines by default
+        500,
+        false, // Windowed by default
+        3600, // 1 emulated minute of frames when headless
+        0, // No instruction budget, use frames
+        #ifdef AOT_SOURCE
+        ENGINE_AOT, // Run the rom this binary was built for
+        #else
+        ENGINE_INTERP,
+        #endif
+        QUIRKS_MODERN,
+        NULL, // Rom comes from the command line
+        NULL, // Not a batch run
+        0, // One batch worker per core
+        NULL, // Batch results to stdout
+        NULL, // Fresh machine
+        NULL, // No save state
+        16, // About an hour of frame by frame rewind for most roms
+        1, // Rewind frame by frame
+        0, // Seed from the clock
+        NULL, // Not recording input
+        NULL, // Not replaying
+        256, // 5 ms audio device buffer
+        8, // Then 8 ms of ring, the beep starts about 13 ms after sound_timer is set
+        200, // Sleep until 0.2 ms before each frame, then spin
+        true, // Skip idle loops, it never changes what a rom does
+        NULL, // Run the rom
+        #ifdef PROFILE
+        "profile", // profile.json, profile.csv and profile.folded
+        false, // Count only, the clock reads cost more than most instructions
+        #endif
+        #ifdef TRACE
+        "trace", // trace.0.c8t, one file per emulating thread
+        NULL, // Run a rom
+        #endif
+    };
+}
+
+// Copy the machine into a snapshot
+void snapshot_chip8(const chip8_t *chip8, chip8_state_t *state) {
+    memcpy(state->ram, chip8->ram, sizeof state->ram);
+    state->display = chip8->display;
+    state->planes = chip8->planes;
+    memcpy(state->stack, chip8->stack, sizeof state->stack);
+    memcpy(state->V, chip8->V, sizeof state->V);
+    memcpy(state->keypad, chip8->keypad, sizeof state->keypad);
+    state->stack_ptr = chip8->stack_ptr;
+    state->I = chip8->I;
+    state->PC = chip8->PC;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->rng = chip8->rng;
+}
+
+// Put a snapshot back, RAM changed under any cached code so all of it is marked written
+void restore_chip8(chip8_t *chip8, const chip8_state_t *state) {
+    memcpy(chip8->ram, state->ram, sizeof chip8->ram);
+    chip8->display = state->display;
+    chip8->planes = state->planes;
+    memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+    memcpy(chip8->V, state->V, sizeof chip8->V);
+    memcpy(chip8->keypad, state->keypad, sizeof chip8->keypad);
+    chip8->stack_ptr = state->stack_ptr;
+    chip8->I = state->I;
+    chip8->PC = state->PC;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    chip8->rng = state->rng;
+
+    if (chip8->code_pages) {
+        chip8->code_dirty_lo = 0;
+        chip8->code_dirty_hi = sizeof chip8->ram;
+    }
+}
+
+// Also used by the trace decoder, on a machine rebuilt from a trace record
+#if defined(DEBUG) || defined(TRACE)
+void print_debug_info(chip8_t *chip8) {
+    printf("Address: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC, chip8->inst.opcode);
+    switch ((chip8->inst.opcode >> 12) & 0x0F)
+    {
+        case 0x00:
+            if (chip8->inst.NN == 0xE0) {
+                // clear screen 0x00E0
+                printf("clear screen\n");
+                
+            }
+            else if (chip8->inst.NN == 0xEE) {
+                // Return from subroutine
+                printf("Return from subroutine from address 0x%04X\n", chip8->stack[(chip8->stack_ptr - 1) & 0xF]);
+            }
+            else if (chip8->inst.X == 0 && (chip8->inst.NN & 0xF0) == 0xC0) {
+                printf("Scroll down N (%d) rows\n", chip8->inst.N);
+            }
+            else if (chip8->inst.X == 0 && (chip8->inst.NN & 0xF0) == 0xD0) {
+                printf("Scroll up N (%d) rows\n", chip8->inst.N);
+            }
+            else if (chip8->inst.opcode == 0x00FB || chip8->inst.opcode == 0x00FC) {
+                printf("Scroll %s 4 pixels\n", chip8->inst.opcode == 0x00FB ? "right" : "left");
+            }
+            else if (chip8->inst.opcode == 0x00FE || chip8->inst.opcode == 0x00FF) {
+                printf("Switch to %s resolution and clear the screen\n", chip8->inst.opcode == 0x00FF ? "128x64" : "64x32");
+            }
+            else {
+                printf("Unimplemented opcode. \n");
+            }
+            break;
+        
+        case 0x01:
+            // 0x01: Jump to address NNN
+            printf("Jump to address NNN (0x%04X)\n", chip8->inst.NNN);
+            break;
+            
+        case 0x02:
+            // call subroutine 0x2NNN at NNN
+            printf("Called subroutine\n");
+
+            break;
+
+        case 0x03:
+            // 0x03XNN: Check if VX == NN, if so, skip to next instruction
+            printf("Check if V%X == NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+            break;
+
+        case 0x04:
+            // 0x03XNN: Check if VX == NN, if so, skip to next instruction
+            printf("Check if V%X != NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+            break;
+
+        case 0x05:
+            // 0x03XY0: Check if VX == VY,  if so, skip the next instruction
+            printf("Check if V%X == V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y);
+            break;
+        
+        case 0x06:
+            // 0x6XNN: Set reigster VX to NN
+            printf("Set register V%X = NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+            break;
+
+        case 0x07:
+            // 0x7XNN: Set register VC += to NN
+            printf("Set register V%X (0x%02X) += NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN);
+            break;
+
+        case 0x08: {
+            switch(chip8->inst.N) {
+                case 0: // 8XY0: Vx = Vy
+                    
+                    printf("Set V%X = V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
+                    break;
+
+                case 1: // 8XY1: Vx |= Vy
+                    
+                    printf("Set V%X |= V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
+                    break;
+
+                case 2: // 8XY2: Vx &= Vy
+                    
+                    printf("Set V%X &= V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
+                    break;
+
+                case 3: // 8XY3: Vx ^= Vy
+                    
+                    printf("Set V%X ^= V%X (0x%02X)\n", chip8->inst.X, chip8->inst.Y, chip8->V[chip8->inst.X]);
+                    break;
+
+                case 4: // 8XY4: Vx += Vy, VF = carry
+                    
+                    printf("V%X += V%X -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.Y, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
+                    break;
+
+                case 5: // 8XY5: Vx -= Vy, VF = NOT borrow
+                    
+                    printf("V%X -= V%X -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.Y, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
+                    break;
+
+                case 6: // 8XY6: Vx >>= 1, VF = LSB
+                    
+                    printf("V%X >>= 1 -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
+                    break;
+
+                case 7: // 8XY7: Vx = Vy - Vx, VF = NOT borrow
+                    
+                    printf("V%X = V%X - V%X -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.Y, chip8->inst.X, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
+                    break;
+
+                case 8: // 8XY8: Vx <<= 1, VF = MSB
+                    
+                    printf("V%X <<= 1 -> V%X = 0x%02X, VF = %d\n", chip8->inst.X, chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[0xF]);
+                    break;
+
+                default:
+                    printf("Unknown 0x8XYN opcode: 0x%X\n", chip8->inst.N);
+                    break;
+            }
+            break;
+        }
+
+        case 0x09:
+            // 0x9XY0: Check if VX != VY
+            printf("Check if V%X (0x%02X) != V%X (0x%02X), skip next instruction if true\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+            break;
+
+        case 0x0A:
+            // 0xANNN: Set index register I to NNN
+            printf("Set I to NNN (0x%04X)\n", chip8->inst.NNN);
+
+            break;
+
+        case 0x0B:
+            // Jump to V0 + NNN
+            printf("Set PC to V0 t(0x%02X) + NNN (0x%04X)\n", chip8->V[0], chip8->inst.NNN);
+            break;
+
+        case 0x0C:
+            // Sets reigster VX = rand() % 256 & NN
+            printf("Set V%X = rand() & NN (0x%02X) \n", chip8->inst.X, chip8->inst.NN);
+            break;
+
+        case 0x0D:
+            // Draw at N coords
+            printf("Draw N (%d) at height sprite at coords V%X (0x%02X), V%X (0x%02X) from memory location I (0x%04X)\n", 
+                chip8->inst.N, chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->I
+            );
+            break;
+
+        case 0x0E:
+            if (chip8->inst.NN == 0x9E) {
+                // Skip next instruction if key in VX is pressed
+                printf("Skip next instruction if key in V%X (0X%02X) is pressed; Key pad value: %d\n", 
+                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
+                
+            }
+            else if (chip8->inst.NN == 0xA1) {
+                // Skip next instruction if key in VX is not pressed
+                printf("Skip next instruction if key in V%X (0X%02X) is NOT pressed; Key pad value: %d\n", 
+                    chip8->inst.X, chip8->V[chip8->inst.X], chip8->keypad[chip8->V[chip8->inst.X]]);
+            }
+            break;
+
+        case 0x0F:
+            switch (chip8->inst.NN) {
+                case 0x01: // FN01: select planes
+                    printf("Draw to planes N (0x%X)\n", chip8->inst.X);
+                    break;
+                case 0x07: // FX07: VX = delay timer
+                    printf("Set V%X = delay timer (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                case 0x0A: // FX0A: wait for a key
+                    printf("Wait for a key press, store it in V%X\n", chip8->inst.X);
+                    break;
+                case 0x15: // FX15: delay timer = VX
+                    printf("Set delay timer = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                case 0x18: // FX18: sound timer = VX
+                    printf("Set sound timer = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                case 0x1E: // FX1E: I += VX
+                    printf("I += V%X (0x%02X) -> I = 0x%04X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+                    break;
+                case 0x29: // FX29: I = font sprite for VX
+                    printf("Set I to sprite for character in V%X (0x%02X) -> I = 0x%04X\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+                    break;
+                case 0x33: // FX33: BCD of VX at I
+                    printf("Store BCD of V%X (%d) at I (0x%04X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
+                    break;
+                case 0x55: // FX55: store V0 to VX at I
+                    printf("Store V0 to V%X at I (0x%04X)\n", chip8->inst.X, chip8->I);
+                    break;
+                case 0x65: // FX65: load V0 to VX from I
+                    printf("Load V0 to V%X from I (0x%04X)\n", chip8->inst.X, chip8->I);
+                    break;
+                default:
+                    printf("Unimplemented opcode. \n");
+                    break;
+            }
+            break;
+
+    default:
+        printf("Unimplemented opcode. \n");
+        break; // Invalid opcode
+    }
+}
+#endif
+
+
+
+// Every decoded opcode class: enum name and handler
+#define CHIP8_OPS(X) \
+    X(INVALID,  op_invalid)  /* Unimplemented opcode */ \
+    X(CLS,      op_cls)      /* 00E0 */ \
+    X(RET,      op_ret)      /* 00EE */ \
+    X(JP,       op_jp)       /* 1NNN */ \
+    X(CALL,     op_call)     /* 2NNN */ \
+    X(SE_NN,    op_se_nn)    /* 3XNN */ \
+    X(SNE_NN,   op_sne_nn)   /* 4XNN */ \
+    X(SE_VY,    op_se_vy)    /* 5XY0 */ \
+    X(LD_NN,    op_ld_nn)    /* 6XNN */ \
+    X(ADD_NN,   op_add_nn)   /* 7XNN */ \
+    X(LD_VY,    op_ld_vy)    /* 8XY0 */ \
+    X(OR,       op_or)       /* 8XY1 */ \
+    X(AND,      op_and)      /* 8XY2 */ \
+    X(XOR,      op_xor)      /* 8XY3 */ \
+    X(ADD_VY,   op_add_vy)   /* 8XY4 */ \
+    X(SUB,      op_sub)      /* 8XY5 */ \
+    X(SHR,      op_shr)      /* 8XY6 */ \
+    X(SUBN,     op_subn)     /* 8XY7 */ \
+    X(SHL,      op_shl)      /* 8XY8, 8XYE */ \
+    X(SNE_VY,   op_sne_vy)   /* 9XY0 */ \
+    X(LD_I,     op_ld_i)     /* ANNN */ \
+    X(JP_V0,    op_jp_v0)    /* BNNN */ \
+    X(RND,      op_rnd)      /* CXNN */ \
+    X(DRW,      op_drw)      /* DXYN */ \
+    X(SKP,      op_skp)      /* EX9E */ \
+    X(SKNP,     op_sknp)     /* EXA1 */ \
+    X(LD_VX_DT, op_ld_vx_dt) /* FX07 */ \
+    X(WAIT_KEY, op_wait_key) /* FX0A */ \
+    X(LD_DT,    op_ld_dt)    /* FX15 */ \
+    X(LD_ST,    op_ld_st)    /* FX18 */ \
+    X(ADD_I,    op_add_i)    /* FX1E */ \
+    X(LD_F,     op_ld_f)     /* FX29 */ \
+    X(BCD,      op_bcd)      /* FX33 */ \
+    X(STORE,    op_store)    /* FX55 */ \
+    X(LOAD,     op_load)     /* FX65 */ \
+    X(SCD,      op_scd)      /* 00CN, SUPER-CHIP */ \
+    X(SCU,      op_scu)      /* 00DN, XO-CHIP */ \
+    X(SCR,      op_scr)      /* 00FB, SUPER-CHIP */ \
+    X(SCL,      op_scl)      /* 00FC, SUPER-CHIP */ \
+    X(LOW,      op_low)      /* 00FE, SUPER-CHIP */ \
+    X(HIGH,     op_high)     /* 00FF, SUPER-CHIP */ \
+    X(PLANE,    op_plane)    /* FN01, XO-CHIP */
+
+// Decoded opcode class, index into the handler tables
+#define OP_ENUM(name, fn) OP_##name,
+typedef enum {
+    CHIP8_OPS(OP_ENUM)
+    OP_COUNT
+} op_class_t;
+#undef OP_ENUM
+
+// Map a raw opcode to its class, same rules the old nested switch used
+constexpr uint8_t decode_op_class(const uint16_t opcode) {
+    const uint8_t N = opcode & 0x0F;
+    const uint8_t NN = opcode & 0xFF;
+
+    switch ((opcode >> 12) & 0x0F) {
+        case 0x00:
+            if (NN == 0xE0) return OP_CLS;
+            if (NN == 0xEE) return OP_RET;
+            // The display extensions are only 00XX, 0NNN with N != 0 stays a machine code call
+            if ((opcode & 0x0F00) != 0) return OP_INVALID;
+            if ((NN & 0xF0) == 0xC0) return OP_SCD;
+            if ((NN & 0xF0) == 0xD0) return OP_SCU;
+            if (NN == 0xFB) return OP_SCR;
+            if (NN == 0xFC) return OP_SCL;
+            if (NN == 0xFE) return OP_LOW;
+            if (NN == 0xFF) return OP_HIGH;
+            return OP_INVALID;
+        case 0x01: return OP_JP;
+        case 0x02: return OP_CALL;
+        case 0x03: return OP_SE_NN;
+        case 0x04: return OP_SNE_NN;
+        case 0x05: return N == 0 ? OP_SE_VY : OP_INVALID;
+        case 0x06: return OP_LD_NN;
+        case 0x07: return OP_ADD_NN;
+        case 0x08:
+            switch (N) {
+                case 0x0: return OP_LD_VY;
+                case 0x1: return OP_OR;
+                case 0x2: return OP_AND;
+                case 0x3: return OP_XOR;
+                case 0x4: return OP_ADD_VY;
+                case 0x5: return OP_SUB;
+                case 0x6: return OP_SHR;
+                case 0x7: return OP_SUBN;
+                case 0x8: return OP_SHL;
+                case 0xE: return OP_SHL;
+                default: return OP_INVALID;
+            }
+        case 0x09: return OP_SNE_VY;
+        case 0x0A: return OP_LD_I;
+        case 0x0B: return OP_JP_V0;
+        case 0x0C: return OP_RND;
+        case 0x0D: return OP_DRW;
+        case 0x0E:
+            if (NN == 0x9E) return OP_SKP;
+            if (NN == 0xA1) return OP_SKNP;
+            return OP_INVALID;
+        default:
+            switch (NN) {
+                case 0x01: return OP_PLANE;
+                case 0x07: return OP_LD_VX_DT;
+                case 0x0A: return OP_WAIT_KEY;
+                case 0x15: return OP_LD_DT;
+                case 0x18: return OP_LD_ST;
+                case 0x1E: return OP_ADD_I;
+                case 0x29: return OP_LD_F;
+                case 0x33: return OP_BCD;
+                case 0x55: return OP_STORE;
+                case 0x65: return OP_LOAD;
+                default: return OP_INVALID;
+            }
+    }
+}
+
+// Handler class for every one of the 64K opcodes, built at compile time
+typedef struct {
+    uint8_t op[0x10000];
+} decode_table_t;
+
+constexpr decode_table_t build_decode_table() {
+    decode_table_t table = {};
+    for (uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+        table.op[opcode] = decode_op_class((uint16_t)opcode);
+    }
+    return table;
+}
+
+static constexpr decode_table_t decode_table = build_decode_table();
+
+// Fetch the opcode at PC, pre increment PC and split out the operands
+static inline instruction_t fetch_instruction(chip8_t *chip8) {
+    instruction_t inst;
+    inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[(chip8->PC + 1) & 0xFFF];
+    chip8->PC += 2;
+
+    // Handlers are inlined, so fields a handler does not read are never computed
+    inst.NNN = inst.opcode & 0x0FFF;
+    inst.NN = inst.opcode & 0x0FF;
+    inst.N = inst.opcode & 0x0F;
+    inst.X = (inst.opcode >> 8) & 0x0F;
+    inst.Y = (inst.opcode >> 4) & 0x0F;
+
+    #ifdef DEBUG
+    chip8->inst = inst; // print_debug_info() reads the last instruction
+    #endif
+    return inst;
+}
+
+// Record a RAM write so engines holding decoded copies of that RAM can drop them
+static inline void mark_ram_written(chip8_t *chip8, const uint16_t addr, const uint16_t len) {
+    const uint64_t pages = (1ull << ((addr >> 6) & 63)) | (1ull << (((addr + len - 1) >> 6) & 63));
+    chip8->ram_written |= pages;
+    if (!(chip8->code_pages & pages)) {
+        return;
+    }
+
+    if (chip8->code_dirty_lo >= chip8->code_dirty_hi) {
+        chip8->code_dirty_lo = addr;
+        chip8->code_dirty_hi = addr + len;
+    }
+    else {
+        if (addr < chip8->code_dirty_lo) chip8->code_dirty_lo = addr;
+        if (addr + len > chip8->code_dirty_hi) chip8->code_dirty_hi = addr + len;
+    }
+}
+
+// Every handler shares one signature so they can be tabled. Q is the quirk profile: handlers the
+// quirks change read quirk_table[Q] as constants, so each profile gets its own branch free copy
+#define OP_HANDLER(fn) \
+    template <quirk_profile_t Q> \
+    static inline void fn([[maybe_unused]] chip8_t *chip8, \
+                          [[maybe_unused]] const config_t *config, \
+                          [[maybe_unused]] const instruction_t inst)
+
+typedef void (*op_handler_t)(chip8_t *chip8, const config_t *config, const instruction_t inst);
+
+OP_HANDLER(op_invalid) {
+    // Unimplemented opcode
+}
+
+// Blank the selected planes. Outside high resolution only the first 32 words of a plane are ever lit
+static inline void display_clear(chip8_display_t *display, const uint8_t planes) {
+    const size_t size = display->hires ? sizeof display->plane[0] : CHIP8_HEIGHT * sizeof(uint64_t);
+    for (uint8_t p = 0; p < CHIP8_DISPLAY_PLANES; p++) {
+        if (planes & (1 << p)) {
+            memset(display->plane[p], 0, size);
+        }
+    }
+}
+
+OP_HANDLER(op_cls) {
+    // clear screen 0x00E0
+    display_clear(&chip8->display, chip8->planes);
+}
+
+OP_HANDLER(op_ret) {
+    // Return from subroutine
+    chip8->PC = chip8->stack[--chip8->stack_ptr & 0xF];
+}
+
+OP_HANDLER(op_jp) {
+    // 0x01: Jump to address NNN
+    chip8->PC = inst.NNN; // Set program counter
+}
+
+OP_HANDLER(op_call) {
+    // call subroutine 0x2NNN at NNN
+    chip8->stack[chip8->stack_ptr++ & 0xF] = chip8->PC; // store current address to return on subroutine address
+    chip8->PC = inst.NNN; // set program ciunter to subroutine address
+}
+
+OP_HANDLER(op_se_nn) {
+    // 0x03XNN: Check if VX == NN, if so, skip to next instruction
+    if (chip8->V[inst.X] == inst.NN) {
+        chip8->PC += 2;
+    }
+}
+
+OP_HANDLER(op_sne_nn) {
+    // 0x04XNN: check if VX != NN, if so, skip to next instruction
+    if (chip8->V[inst.X] != inst.NN) {
+        chip8->PC += 2;
+    }
+}
+
+OP_HANDLER(op_se_vy) {
+    // 0x05XY0: Check if VX == VY,  if so, skip the next instruction
+    if (chip8->V[inst.X] == chip8->V[inst.Y]) {
+        chip8->PC += 2;
+    }
+}
+
+OP_HANDLER(op_ld_nn) {
+    // 0x6XNN: Set reigster VX to NN
+    chip8->V[inst.X] = inst.NN;
+}
+
+OP_HANDLER(op_add_nn) {
+    // 0x7XNN: Set register VC += to NN
+    chip8->V[inst.X] += inst.NN;
+}
+
+OP_HANDLER(op_ld_vy) {
+    // 0x8XY0: Set register VX = VY
+    chip8->V[inst.X] = chip8->V[inst.Y];
+}
+
+OP_HANDLER(op_or) {
+    // 0x8XY1: VX |= VY
+    chip8->V[inst.X] |= chip8->V[inst.Y];
+}
+
+OP_HANDLER(op_and) {
+    // 0x8XY2: VX &= VY
+    chip8->V[inst.X] &= chip8->V[inst.Y];
+}
+
+OP_HANDLER(op_xor) {
+    // 0x8XY3: VX ^= VY
+    chip8->V[inst.X] ^= chip8->V[inst.Y];
+}
+
+OP_HANDLER(op_add_vy) {
+    // 0x8XY4: VX += VY, VF = carry
+    chip8->V[0xF] = ((uint16_t)(chip8->V[inst.X] + chip8->V[inst.Y]) > 255) ? 1 : 0;
+    chip8->V[inst.X] += chip8->V[inst.Y];
+}
+
+OP_HANDLER(op_sub) {
+    // 0x8XY5: VX -= VY, VF = NOT borrow
+    chip8->V[0xF] = (chip8->V[inst.Y] <= chip8->V[inst.X]) ? 1 : 0;
+    chip8->V[inst.X] -= chip8->V[inst.Y];
+}
+
+OP_HANDLER(op_shr) {
+    // 0x8XY6: VX = VX >> 1 (VY >> 1 on the VIP), VF = least-significant bit before shift.
+    // Read before VF is written, 8XF6 shifts VF as it was
+    const uint8_t v = chip8->V[quirk_table[Q].shift_vy ? inst.Y : inst.X];
+    chip8->V[0xF] = v & 1;
+    chip8->V[inst.X] = v >> 1;
+}
+
+OP_HANDLER(op_subn) {
+    // 0x8XY7: VX = VY - VX, VF = NOT borrow
+    chip8->V[0xF] = (chip8->V[inst.X] <= chip8->V[inst.Y]) ? 1 : 0;
+    chip8->V[inst.X] = chip8->V[inst.Y] - chip8->V[inst.X];
+}
+
+OP_HANDLER(op_shl) {
+    // 0x8XYE: VX = VX << 1 (VY << 1 on the VIP), VF = most-significant bit before shift
+    const uint8_t v = chip8->V[quirk_table[Q].shift_vy ? inst.Y : inst.X];
+    chip8->V[0xF] = v >> 7;
+    chip8->V[inst.X] = v << 1;
+}
+
+OP_HANDLER(op_sne_vy) {
+    // 0x9XY0: Check if VX != VY
+    if (chip8->V[inst.X] != chip8->V[inst.Y]) {
+        chip8->PC += 2;
+    }
+}
+
+OP_HANDLER(op_ld_i) {
+    // 0xANNN: Set index register I to NNN
+    chip8->I = inst.NNN;
+}
+
+OP_HANDLER(op_jp_v0) {
+    // Jump to V0 + NNN, CHIP-48 and SUPER-CHIP read it as BXNN and jump to VX + XNN
+    chip8->PC = chip8->V[quirk_table[Q].jump_vx ? inst.X : 0] + inst.NNN;
+}
+
+OP_HANDLER(op_rnd) {
+    // Sets reigster VX = rand() & NN, xorshift32 kept in the machine
+    uint32_t rng = chip8->rng;
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    chip8->rng = rng;
+    chip8->V[inst.X] = (rng >> 24) & inst.NN;
+}
+
+// XOR an n row sprite into a display at (vx, vy), true when a lit pixel was turned off.
+// A sprite row is shifted into place, rotated for DRAW_WRAP_X so it wraps at the right edge,
+// then XOR'd into the display row a whole word at a time
+template <quirk_draw_t Draw>
+static inline bool draw_sprite(uint64_t *display, const uint8_t *sprite, const uint8_t vx, const uint8_t vy, const uint8_t n) {
+    const uint32_t X_coord = vx % CHIP8_WIDTH;
+    const uint32_t Y_coord = vy % CHIP8_HEIGHT;
+
+    // Stop drawing when we hit the bottom edge
+    const uint32_t rows = n < CHIP8_HEIGHT - Y_coord ? n : CHIP8_HEIGHT - Y_coord;
+
+    uint64_t *row = &display[Y_coord];
+    uint64_t hit = 0; // Display bits the sprite turned off
+    uint32_t i = 0;
+
+#if defined(__AVX2__)
+    // 4 rows per step
+    const __m128i shift_r = _mm_cvtsi32_si128(X_coord);
+    [[maybe_unused]] const __m128i shift_l = _mm_cvtsi32_si128(CHIP8_WIDTH - X_coord); // 64 shifts to 0
+    __m256i hits = _mm256_setzero_si256();
+    for (; i + 4 <= rows; i += 4) {
+        uint32_t bytes;
+        memcpy(&bytes, &sprite[i], sizeof bytes);
+        const __m256i bits = _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes)), 56);
+        __m256i mask = _mm256_srl_epi64(bits, shift_r);
+        if constexpr (Draw == DRAW_WRAP_X) {
+            mask = _mm256_or_si256(mask, _mm256_sll_epi64(bits, shift_l));
+        }
+        const __m256i pixels = _mm256_loadu_si256((const __m256i *)&row[i]);
+        hits = _mm256_or_si256(hits, _mm256_and_si256(pixels, mask));
+        _mm256_storeu_si256((__m256i *)&row[i], _mm256_xor_si256(pixels, mask));
+    }
+    hit |= !_mm256_testz_si256(hits, hits);
+#elif defined(__SSE2__)
+    // 2 rows per step
+    const __m128i shift_r = _mm_cvtsi32_si128(X_coord);
+    [[maybe_unused]] const __m128i shift_l = _mm_cvtsi32_si128(CHIP8_WIDTH - X_coord); // 64 shifts to 0
+    __m128i hits = _mm_setzero_si128();
+    for (; i + 2 <= rows; i += 2) {
+        const __m128i bits = _mm_set_epi64x((int64_t)((uint64_t)sprite[i + 1] << 56),
+                                            (int64_t)((uint64_t)sprite[i] << 56));
+        __m128i mask = _mm_srl_epi64(bits, shift_r);
+        if constexpr (Draw == DRAW_WRAP_X) {
+            mask = _mm_or_si128(mask, _mm_sll_epi64(bits, shift_l));
+        }
+        const __m128i pixels = _mm_loadu_si128((const __m128i *)&row[i]);
+        hits = _mm_or_si128(hits, _mm_and_si128(pixels, mask));
+        _mm_storeu_si128((__m128i *)&row[i], _mm_xor_si128(pixels, mask));
+    }
+    hit |= _mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) != 0xFFFF;
+#endif
+
+    for (; i < rows; i++) {
+        const uint64_t bits = (uint64_t)sprite[i] << 56;
+        const uint64_t mask = Draw == DRAW_WRAP_X ? (bits >> X_coord) | (bits << ((CHIP8_WIDTH - X_coord) & 63))
+                                                  : bits >> X_coord;
+        hit |= row[i] & mask;
+        row[i] ^= mask;
+    }
+
+    return hit != 0;
+}
+
+// Bytes of sprite DXYN reads per plane, DXY0 is 16x16 at two bytes a row
+static inline uint32_t sprite_size(const uint8_t n) {
+    return n ? n : 32;
+}
+
+// draw_sprite for everything but plain CHIP-8: high resolution, where a row is two words, DXY0's
+// 16 pixel wide sprites and XO-CHIP planes. Same idea a row at a time, the sprite row starts at the
+// left of a 128 bit row, is shifted (or rotated) into place and XOR'd in a word at a time
+template <quirk_draw_t Draw>
+static bool draw_sprite_wide(uint64_t *display, const bool hires, const uint8_t *sprite,
+                             const uint8_t vx, const uint8_t vy, const uint8_t n) {
+    const uint32_t width = hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    const uint32_t height = hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    const uint32_t X_coord = vx % width;
+    const uint32_t Y_coord = vy % height;
+    const uint32_t tall = n ? n : 16;
+    const uint32_t rows = tall < height - Y_coord ? tall : height - Y_coord;
+
+    uint64_t hit = 0;
+    for (uint32_t i = 0; i < rows; i++) {
+        const uint64_t bits = n ? (uint64_t)sprite[i] << 56
+                                : (uint64_t)(sprite[2 * i] << 8 | sprite[2 * i + 1]) << 48;
+        if (hires) {
+            const unsigned __int128 line = (unsigned __int128)bits << 64;
+            unsigned __int128 mask = line >> X_coord;
+            if (Draw == DRAW_WRAP_X && X_coord) {
+                mask |= line << (CHIP8_HIRES_WIDTH - X_coord);
+            }
+            uint64_t *row = &display[(Y_coord + i) * 2];
+            const uint64_t left = (uint64_t)(mask >> 64);
+            const uint64_t right = (uint64_t)mask;
+            hit |= (row[0] & left) | (row[1] & right);
+            row[0] ^= left;
+            row[1] ^= right;
+        }
+        else {
+            const uint64_t mask = Draw == DRAW_WRAP_X ? (bits >> X_coord) | (bits << ((CHIP8_WIDTH - X_coord) & 63))
+                                                      : bits >> X_coord;
+            hit |= display[Y_coord + i] & mask;
+            display[Y_coord + i] ^= mask;
+        }
+    }
+    return hit != 0;
+}
+
+// DXYN on every selected plane, each plane's sprite straight after the last one's. True when
+// any plane had a lit pixel turned off
+NOINLINE static bool display_draw_planes(chip8_display_t *display, const uint8_t planes, const uint8_t *sprite,
+                                const uint8_t vx, const uint8_t vy, const uint8_t n, const quirk_draw_t draw) {
+    bool hit = false;
+    for (uint8_t p = 0; p < CHIP8_DISPLAY_PLANES; p++) {
+        if (!(planes & (1 << p))) {
+            continue;
+        }
+        hit |= draw == DRAW_WRAP_X ? draw_sprite_wide<DRAW_WRAP_X>(display->plane[p], display->hires, sprite, vx, vy, n)
+                                   : draw_sprite_wide<DRAW_CLIP>(display->plane[p], display->hires, sprite, vx, vy, n);
+        sprite += sprite_size(n);
+    }
+    return hit;
+}
+
+// DXYN, plain CHIP-8 straight to draw_sprite
+template <quirk_draw_t Draw>
+static inline bool display_draw(chip8_display_t *display, const uint8_t planes, const uint8_t *sprite,
+                                const uint8_t vx, const uint8_t vy, const uint8_t n) {
+    if (planes == 1 && !display->hires && n) {
+        return draw_sprite<Draw>(display->plane[0], sprite, vx, vy, n);
+    }
+    return display_draw_planes(display, planes, sprite, vx, vy, n, Draw);
+}
+
+OP_HANDLER(op_drw) {
+    // 0xDXYN: Draw N height sprite at coords X and Y
+    // Read from memory location I
+    // VF (Carry Flag) is set if any
+    // Screen pixels are XOR with sprite bits
+    chip8->V[0xF] = display_draw<quirk_table[Q].draw>(&chip8->display, chip8->planes, &chip8->ram[chip8->I],
+                                                      chip8->V[inst.X], chip8->V[inst.Y], inst.N);
+}
+
+OP_HANDLER(op_skp) {
+    // Skip next instruction if key in VX is pressed
+    if (chip8->keypad[chip8->V[inst.X]]) {
+        chip8->PC += 2;
+    }
+}
+
+OP_HANDLER(op_sknp) {
+    // Skip next instruction if key in VX is not pressed
+    if (!chip8->keypad[chip8->V[inst.X]]) {
+        chip8->PC += 2;
+    }
+}
+
+OP_HANDLER(op_ld_vx_dt) {
+    // VX = delay timer
+    chip8->V[inst.X] = chip8->delay_timer;
+}
+
+OP_HANDLER(op_wait_key) {
+    // Await until a key press, and store in VX
+    for (uint8_t i = 0; i < sizeof chip8->keypad; i ++) {
+        if (chip8->keypad[i]) {
+            chip8->V[inst.X] = i;
+            return;
+        }
+    }
+
+    // Keep getting the current opcode and running this instruction when nothing have been pressed
+    chip8->PC -= 2;
+}
+
+OP_HANDLER(op_ld_dt) {
+    // delay timer = VX
+    chip8->delay_timer = chip8->V[inst.X];
+}
+
+OP_HANDLER(op_ld_st) {
+    // sound timer = VX
+    chip8->sound_timer = chip8->V[inst.X];
+}
+
+OP_HANDLER(op_add_i) {
+    // I += VX, Add VX to register I.
+    chip8->I += chip8->V[inst.X];
+}
+
+OP_HANDLER(op_ld_f) {
+    // set register I to sprite location in memory in characters in VX
+    chip8->I = chip8->V[inst.X] * 5;
+}
+
+OP_HANDLER(op_bcd) {
+    // store BCD of VX of memory offset from I
+    uint8_t value = chip8->V[inst.X];
+
+    chip8->ram[chip8->I]     = value / 100;        // hundreds
+    chip8->ram[chip8->I + 1] = (value / 10) % 10;  // tens
+    chip8->ram[chip8->I + 2] = value % 10;         // ones
+    mark_ram_written(chip8, chip8->I, 3);
+}
+
+OP_HANDLER(op_store) {
+    // Reguster dump V0-VX inclusive to memory offset from I
+    for (uint8_t i = 0; i <= inst.X; i ++) {
+        chip8->ram[chip8->I + i] = chip8->V[i];
+    }
+    mark_ram_written(chip8, chip8->I, inst.X + 1);
+    if constexpr (quirk_table[Q].memory != MEM_I_KEEP) {
+        chip8->I += inst.X + (quirk_table[Q].memory == MEM_I_X1);
+    }
+}
+
+OP_HANDLER(op_load) {
+    // Load V0-VX inclusivb eto memory offset from I
+    for (uint8_t i = 0; i <= inst.X; i ++) {
+        chip8->V[i] = chip8->ram[chip8->I + i];
+    }
+    if constexpr (quirk_table[Q].memory != MEM_I_KEEP) {
+        chip8->I += inst.X + (quirk_table[Q].memory == MEM_I_X1);
+    }
+}
+
+// Scroll the selected planes n rows down, up when n is negative. Whole rows move with one memmove
+// and the rows scrolled in are blank
+NOINLINE static void display_scroll_y(chip8_display_t *display, const uint8_t planes, const int32_t n) {
+    const uint32_t words = display->hires ? 2 : 1;
+    const uint32_t height = display->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    const uint32_t count = (uint32_t)(n < 0 ? -n : n);
+    const size_t moved = (height - count) * words * sizeof(uint64_t);
+    const size_t cleared = count * words * sizeof(uint64_t);
+
+    for (uint8_t p = 0; p < CHIP8_DISPLAY_PLANES; p++) {
+        if (!(planes & (1 << p))) {
+            continue;
+        }
+        uint64_t *rows = display->plane[p];
+        if (n > 0) {
+            memmove(&rows[count * words], rows, moved);
+            memset(rows, 0, cleared);
+        }
+        else {
+            memmove(rows, &rows[count * words], moved);
+            memset(&rows[(height - count) * words], 0, cleared);
+        }
+    }
+}
+
+// Scroll the selected planes 4 pixels right or left, a word shift per row. Pixels shifted off
+// the edge are gone
+NOINLINE static void display_scroll_x(chip8_display_t *display, const uint8_t planes, const bool right) {
+    for (uint8_t p = 0; p < CHIP8_DISPLAY_PLANES; p++) {
+        if (!(planes & (1 << p))) {
+            continue;
+        }
+        uint64_t *rows = display->plane[p];
+        if (!display->hires) {
+            for (uint32_t y = 0; y < CHIP8_HEIGHT; y++) {
+                rows[y] = right ? rows[y] >> 4 : rows[y] << 4;
+            }
+            continue;
+        }
+        for (uint32_t y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+            uint64_t *row = &rows[y * 2];
+            if (right) {
+                row[1] = (row[1] >> 4) | (row[0] << 60);
+                row[0] >>= 4;
+            }
+            else {
+                row[0] = (row[0] << 4) | (row[1] >> 60);
+                row[1] <<= 4;
+            }
+        }
+    }
+}
+
+OP_HANDLER(op_scd) {
+    // 00CN: scroll down N rows
+    display_scroll_y(&chip8->display, chip8->planes, inst.N);
+}
+
+OP_HANDLER(op_scu) {
+    // 00DN: scroll up N rows
+    display_scroll_y(&chip8->display, chip8->planes, -(int32_t)inst.N);
+}
+
+OP_HANDLER(op_scr) {
+    // 00FB: scroll right 4 pixels
+    display_scroll_x(&chip8->display, chip8->planes, true);
+}
+
+OP_HANDLER(op_scl) {
+    // 00FC: scroll left 4 pixels
+    display_scroll_x(&chip8->display, chip8->planes, false);
+}
+
+OP_HANDLER(op_low) {
+    // 00FE: back to 64x32, a resolution change clears every plane
+    memset(chip8->display.plane, 0, sizeof chip8->display.plane);
+    chip8->display.hires = false;
+}
+
+OP_HANDLER(op_high) {
+    // 00FF: 128x64
+    memset(chip8->display.plane, 0, sizeof chip8->display.plane);
+    chip8->display.hires = true;
+}
+
+OP_HANDLER(op_plane) {
+    // FN01: draw, clear and scroll planes N from here on, bit 0 is plane 0
+    chip8->planes = inst.X & 3;
+}
+
+// Handler per opcode class, for engines that dispatch through a pointer
+#define OP_TABLE_ENTRY(name, fn) fn<Q>,
+template <quirk_profile_t Q>
+static const op_handler_t op_handlers[OP_COUNT] = {
+    CHIP8_OPS(OP_TABLE_ENTRY)
+};
+#undef OP_TABLE_ENTRY
+
+
+#ifdef PROFILE
+// Hot path profiler, built with make profile. Counts every instruction the interpreter runs per
+// opcode class, per PC and per call stack, and optionally the time spent in each. Nothing of it
+// is compiled into other builds
+
+// Opcode class names, for the reports
+#define OP_NAME(name, fn) #name,
+static const char *const op_names[OP_COUNT] = {
+    CHIP8_OPS(OP_NAME)
+};
+#undef OP_NAME
+
+// Call stack, as the return addresses in chip8->stack, and what ran under it
+typedef struct {
+    std::vector<uint16_t> frames;
+    uint64_t count;
+    uint64_t ticks;
+} profile_stack_t;
+
+typedef struct {
+    bool timed; // Read the clock around every instruction
+    uint64_t clock_cost; // Ticks two back to back clock reads take, taken off every sample
+    uint64_t total;
+    uint64_t op_count[OP_COUNT];
+    uint64_t op_ticks[OP_COUNT];
+    uint64_t pc_count[4096];
+    uint64_t pc_ticks[4096];
+    uint16_t pc_opcode[4096]; // Last opcode run at that address
+    std::vector<profile_stack_t> stacks;
+    std::map<std::vector<uint16_t>, uint32_t> stack_index;
+    uint32_t stack; // Index of the current call stack in stacks
+} profile_t;
+
+// Only the rom run from main is profiled, batch workers leave this NULL
+static profile_t *profiler = NULL;
+
+// TSC cycles on x86, nanoseconds elsewhere
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_TICK_UNIT "cycles"
+static inline uint64_t profile_clock(void) {
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define PROFILE_TICK_UNIT "ns"
+static inline uint64_t profile_clock(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+// Cheapest of many back to back clock reads, so timed samples count the handler and not the clock
+static uint64_t profile_clock_cost(void) {
+    uint64_t best = UINT64_MAX;
+    for (uint32_t i = 0; i < 10000; i++) {
+        const uint64_t start = profile_clock();
+        const uint64_t ticks = profile_clock() - start;
+        if (ticks < best) best = ticks;
+    }
+    return best;
+}
+
+// Profile everything run from here on, main starts it for the one rom it runs
+void profile_start(const bool timed) {
+    static profile_t profile;
+    profile.timed = timed;
+    profile.clock_cost = timed ? profile_clock_cost() : 0;
+    profiler = &profile;
+}
+
+// Look up the call stack the machine is in now. Only 2NNN and 00EE change it, so this runs
+// after those and whenever something outside the interpreter may have (a load, rewind)
+static void profile_enter_stack(profile_t *prof, const chip8_t *chip8) {
+    std::vector<uint16_t> frames(chip8->stack, chip8->stack + (chip8->stack_ptr & 0xF));
+    auto it = prof->stack_index.find(frames);
+    if (it == prof->stack_index.end()) {
+        it = prof->stack_index.emplace(frames, (uint32_t)prof->stacks.size()).first;
+        prof->stacks.push_back(profile_stack_t{frames, 0, 0});
+    }
+    prof->stack = it->second;
+}
+
+static inline void profile_count(profile_t *prof, const chip8_t *chip8, const uint16_t pc,
+                                 const uint16_t opcode, const uint8_t op, const uint64_t ticks) {
+    const uint16_t at = pc & 0xFFF;
+    prof->total++;
+    prof->op_count[op]++;
+    prof->op_ticks[op] += ticks;
+    prof->pc_count[at]++;
+    prof->pc_ticks[at] += ticks;
+    prof->pc_opcode[at] = opcode;
+    prof->stacks[prof->stack].count++;
+    prof->stacks[prof->stack].ticks += ticks;
+
+    if (op == OP_CALL || op == OP_RET) {
+        profile_enter_stack(prof, chip8);
+    }
+}
+
+// Broad groups, the same split as the benchmark kernels
+static const char *profile_group(const uint8_t op) {
+    switch (op) {
+        case OP_CLS: case OP_DRW: case OP_SCD: case OP_SCU: case OP_SCR: case OP_SCL:
+        case OP_LOW: case OP_HIGH: case OP_PLANE:
+            return "draw";
+        case OP_LD_NN: case OP_ADD_NN: case OP_LD_VY: case OP_OR: case OP_AND: case OP_XOR:
+        case OP_ADD_VY: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL: case OP_RND:
+            return "alu";
+        case OP_LD_I: case OP_ADD_I: case OP_LD_F: case OP_BCD: case OP_STORE: case OP_LOAD:
+            return "memory";
+        case OP_RET: case OP_JP: case OP_CALL: case OP_SE_NN: case OP_SNE_NN: case OP_SE_VY:
+        case OP_SNE_VY: case OP_JP_V0: case OP_SKP: case OP_SKNP:
+            return "branch";
+        case OP_LD_VX_DT: case OP_WAIT_KEY: case OP_LD_DT: case OP_LD_ST:
+            return "timer";
+        default:
+            return "invalid";
+    }
+}
+
+// Name a stack frame by the subroutine it called, read back from the 2NNN before the return address
+static std::string profile_frame_name(const chip8_t *chip8, const uint16_t ret) {
+    const uint16_t call = (ret - 2) & 0xFFF;
+    const uint16_t opcode = (chip8->ram[call] << 8) | chip8->ram[(call + 1) & 0xFFF];
+    char name[16];
+    if ((opcode & 0xF000) == 0x2000) {
+        snprintf(name, sizeof name, "sub_%03X", opcode & 0x0FFF);
+    }
+    else {
+        snprintf(name, sizeof name, "call_%03X", call);
+    }
+    return name;
+}
+
+// Write <prefix>.json (per class and group, hottest PCs), <prefix>.csv (every PC run)
+// and <prefix>.folded (collapsed stacks for flamegraph.pl or speedscope)
+bool write_profile(const chip8_t *chip8, const char *prefix) {
+    const profile_t *prof = profiler;
+    const std::string base = prefix;
+    const double total = prof->total ? (double)prof->total : 1.0;
+
+    std::vector<uint16_t> pcs;
+    for (uint16_t pc = 0; pc < 4096; pc++) {
+        if (prof->pc_count[pc]) pcs.push_back(pc);
+    }
+    std::sort(pcs.begin(), pcs.end(), [prof](const uint16_t a, const uint16_t b) {
+        return prof->pc_count[a] > prof->pc_count[b];
+    });
+
+    std::vector<uint8_t> ops;
+    for (uint8_t op = 0; op < OP_COUNT; op++) {
+        if (prof->op_count[op]) ops.push_back(op);
+    }
+    std::sort(ops.begin(), ops.end(), [prof](const uint8_t a, const uint8_t b) {
+        return prof->op_count[a] > prof->op_count[b];
+    });
+
+    std::vector<std::pair<const char *, std::pair<uint64_t, uint64_t>>> groups;
+    for (const uint8_t op : ops) {
+        const char *group = profile_group(op);
+        size_t g = 0;
+        while (g < groups.size() && strcmp(groups[g].first, group) != 0) g++;
+        if (g == groups.size()) groups.push_back({group, {0, 0}});
+        groups[g].second.first += prof->op_count[op];
+        groups[g].second.second += prof->op_ticks[op];
+    }
+    std::sort(groups.begin(), groups.end(), [](const auto &a, const auto &b) {
+        return a.second.first > b.second.first;
+    });
+
+    FILE *out = fopen((base + ".json").c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "Could not open %s.json\n", prefix);
+        return false;
+    }
+    fprintf(out, "{\n  \"rom\": \"%s\", \"instructions\": %llu, \"timed\": %s, \"tick_unit\": \"%s\",\n",
+            json_escape(chip8->rom_name).c_str(), (unsigned long long)prof->total, prof->timed ? "true" : "false", PROFILE_TICK_UNIT);
+    fprintf(out, "  \"groups\": [\n");
+    for (size_t i = 0; i < groups.size(); i++) {
+        fprintf(out, "    {\"group\": \"%s\", \"count\": %llu, \"share\": %.4f, \"ticks\": %llu}%s\n",
+                groups[i].first, (unsigned long long)groups[i].second.first, groups[i].second.first / total,
+                (unsigned long long)groups[i].second.second, i + 1 < groups.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"ops\": [\n");
+    for (size_t i = 0; i < ops.size(); i++) {
+        const uint8_t op = ops[i];
+        fprintf(out, "    {\"op\": \"%s\", \"group\": \"%s\", \"count\": %llu, \"share\": %.4f, "
+                     "\"ticks\": %llu, \"ticks_per_op\": %.2f}%s\n",
+                op_names[op], profile_group(op), (unsigned long long)prof->op_count[op], prof->op_count[op] / total,
+                (unsigned long long)prof->op_ticks[op], (double)prof->op_ticks[op] / prof->op_count[op],
+                i + 1 < ops.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"hot_pcs\": [\n");
+    const size_t hot = pcs.size() < 64 ? pcs.size() : 64;
+    for (size_t i = 0; i < hot; i++) {
+        const uint16_t pc = pcs[i];
+        fprintf(out, "    {\"pc\": \"0x%03X\", \"opcode\": \"%04X\", \"op\": \"%s\", \"count\": %llu, "
+                     "\"share\": %.4f, \"ticks\": %llu}%s\n",
+                pc, prof->pc_opcode[pc], op_names[decode_table.op[prof->pc_opcode[pc]]],
+                (unsigned long long)prof->pc_count[pc], prof->pc_count[pc] / total,
+                (unsigned long long)prof->pc_ticks[pc], i + 1 < hot ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+
+    out = fopen((base + ".csv").c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "Could not open %s.csv\n", prefix);
+        return false;
+    }
+    fprintf(out, "pc,opcode,op,group,count,ticks\n");
+    for (const uint16_t pc : pcs) {
+        const uint8_t op = decode_table.op[prof->pc_opcode[pc]];
+        fprintf(out, "0x%03X,%04X,%s,%s,%llu,%llu\n", pc, prof->pc_opcode[pc], op_names[op], profile_group(op),
+                (unsigned long long)prof->pc_count[pc], (unsigned long long)prof->pc_ticks[pc]);
+    }
+    fclose(out);
+
+    // One line per call stack, weighted by instructions, or by time when timed. Calls to the
+    // same subroutine from different places fold into one line
+    std::map<std::string, uint64_t> folded;
+    for (const profile_stack_t &stack : prof->stacks) {
+        std::string line = "main";
+        for (const uint16_t ret : stack.frames) {
+            line += ";" + profile_frame_name(chip8, ret);
+        }
+        folded[line] += prof->timed ? stack.ticks : stack.count;
+    }
+
+    out = fopen((base + ".folded").c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "Could not open %s.folded\n", prefix);
+        return false;
+    }
+    for (const auto &line : folded) {
+        if (line.second) {
+            fprintf(out, "%s %llu\n", line.first.c_str(), (unsigned long long)line.second);
+        }
+    }
+    fclose(out);
+
+    // Where the time went, in short
+    fprintf(stderr, "Profile: %llu instructions", (unsigned long long)prof->total);
+    for (const auto &group : groups) {
+        fprintf(stderr, ", %s %.1f%%", group.first, 100.0 * group.second.first / total);
+    }
+    fprintf(stderr, "\nWrote %s.json, %s.csv and %s.folded\n", prefix, prefix, prefix);
+    return true;
+}
+#endif
+
+
+#ifdef TRACE
+// Instruction tracing, built with make trace. Every instruction the interpreter or the block
+// engine runs leaves a 16 byte record in a ring owned by the thread that ran it. A writer thread
+// drains the rings to <prefix>.<n>.c8t files, so the emulator never waits on the disk. When a
+// ring is full the newest records are dropped, and a gap record says how many
+#define TRACE_RING 65536 // Records per thread, a power of two
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION 1
+#define TRACE_GAP 0xFFFF // pc of a gap record, its frame field holds the number dropped
+
+typedef struct {
+    uint16_t pc; // Address the instruction was fetched from
+    uint16_t opcode;
+    uint16_t I; // After the instruction
+    uint16_t aux; // Depends on the op: I before, stack top, V0 or the key state
+    uint8_t vx_before;
+    uint8_t vx; // VX, VY and VF after
+    uint8_t vy;
+    uint8_t vf;
+    uint32_t frame; // Timer ticks this thread had run
+} trace_record_t;
+static_assert(sizeof(trace_record_t) == 16, "trace records are written as is");
+
+typedef struct {
+    trace_record_t records[TRACE_RING];
+    std::atomic<uint64_t> head; // Written by the emulating thread
+    std::atomic<uint64_t> tail; // Written by the writer thread
+    uint64_t gap; // Dropped since the last gap record, emulating thread only
+    std::atomic<uint64_t> dropped;
+    uint32_t frame;
+    uint32_t id;
+    FILE *file; // Writer thread only
+} trace_ring_t;
+
+static std::mutex trace_lock; // Guards trace_rings, never taken per instruction
+static std::vector<trace_ring_t *> trace_rings;
+static std::thread trace_thread;
+static std::atomic<bool> trace_stopping{false};
+static const char *trace_prefix = "trace";
+static thread_local trace_ring_t *trace_ring = NULL;
+
+// This thread's ring, made on first use. Rings outlive their threads so the writer can finish them
+static trace_ring_t *trace_thread_ring(void) {
+    if (!trace_ring) {
+        trace_ring_t *ring = new trace_ring_t();
+        std::lock_guard<std::mutex> lock(trace_lock);
+        ring->id = (uint32_t)trace_rings.size();
+        trace_rings.push_back(ring);
+        trace_ring = ring;
+    }
+    return trace_ring;
+}
+
+static inline void trace_push(trace_ring_t *ring, const trace_record_t &record) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t used = head - ring->tail.load(std::memory_order_acquire);
+
+    // Room for the gap record as well, or nothing goes in
+    if (used + (ring->gap ? 2 : 1) > TRACE_RING) {
+        ring->gap++;
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (ring->gap) {
+        trace_record_t gap = {};
+        gap.pc = TRACE_GAP;
+        gap.frame = ring->gap > UINT32_MAX ? UINT32_MAX : (uint32_t)ring->gap;
+        ring->records[head++ & (TRACE_RING - 1)] = gap;
+        ring->gap = 0;
+    }
+    ring->records[head++ & (TRACE_RING - 1)] = record;
+    ring->head.store(head, std::memory_order_release);
+}
+
+// aux holds I from before the instruction, for every op but these
+static inline bool trace_aux_is_i(const uint8_t op) {
+    return op != OP_RET && op != OP_CALL && op != OP_JP_V0 && op != OP_SKP && op != OP_SKNP;
+}
+
+// Record an instruction that just ran, vx_before and i_before were read before its handler
+static inline void trace_op(trace_ring_t *ring, const chip8_t *chip8, const uint16_t pc, const instruction_t inst,
+                            const uint8_t vx_before, const uint16_t i_before) {
+    trace_record_t record;
+    record.pc = pc;
+    record.opcode = inst.opcode;
+    record.I = chip8->I;
+    record.vx_before = vx_before;
+    record.vx = chip8->V[inst.X];
+    record.vy = chip8->V[inst.Y];
+    record.vf = chip8->V[0xF];
+    record.frame = ring->frame;
+
+    const uint8_t op = decode_table.op[inst.opcode];
+    if (trace_aux_is_i(op)) {
+        record.aux = i_before;
+    }
+    else if (op == OP_JP_V0) {
+        record.aux = chip8->V[0];
+    }
+    else if (op == OP_SKP || op == OP_SKNP) {
+        record.aux = chip8->keypad[chip8->V[inst.X] & 0xF];
+    }
+    else {
+        record.aux = chip8->stack[(chip8->stack_ptr - 1) & 0xF];
+    }
+    trace_push(ring, record);
+}
+
+// Write out whatever the rings hold, on the writer thread
+static void trace_drain(void) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    for (trace_ring_t *ring : trace_rings) {
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        if (head == tail) {
+            continue;
+        }
+
+        if (!ring->file) {
+            const std::string path = std::string(trace_prefix) + "." + std::to_string(ring->id) + ".c8t";
+            ring->file = fopen(path.c_str(), "wb");
+            if (!ring->file) {
+                fprintf(stderr, "Could not open %s, tracing stops\n", path.c_str());
+                trace_stopping = true;
+                return;
+            }
+            const uint16_t header[2] = {TRACE_VERSION, sizeof(trace_record_t)};
+            fwrite(TRACE_MAGIC, 1, 4, ring->file);
+            fwrite(header, sizeof header, 1, ring->file);
+        }
+
+        // At most two pieces, the end of the buffer and then its start
+        while (tail != head) {
+            const uint64_t at = tail & (TRACE_RING - 1);
+            const uint64_t n = head - tail < TRACE_RING - at ? head - tail : TRACE_RING - at;
+            fwrite(&ring->records[at], sizeof(trace_record_t), n, ring->file);
+            tail += n;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+}
+
+static void trace_writer(void) {
+    while (!trace_stopping) {
+        trace_drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Drain the last records and close every file, registered with atexit by trace_start
+static void trace_stop(void) {
+    trace_stopping = true;
+    if (trace_thread.joinable()) {
+        trace_thread.join();
+    }
+    trace_drain();
+
+    uint64_t records = 0;
+    uint64_t dropped = 0;
+    for (trace_ring_t *ring : trace_rings) {
+        records += ring->tail;
+        dropped += ring->dropped;
+        if (ring->file) {
+            fclose(ring->file);
+            ring->file = NULL;
+        }
+    }
+    fprintf(stderr, "Trace: %llu records to %s.*.c8t, %llu dropped\n",
+            (unsigned long long)records, trace_prefix, (unsigned long long)dropped);
+}
+
+void trace_start(const char *prefix) {
+    trace_prefix = prefix;
+    trace_thread = std::thread(trace_writer);
+    atexit(trace_stop);
+}
+
+// Print a trace file with the debug build's descriptions, plus what each instruction changed
+bool decode_trace(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    char magic[4];
+    uint16_t header[2];
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+        fread(header, sizeof header, 1, file) != 1 || header[0] != TRACE_VERSION ||
+        header[1] != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s is not a version %d trace\n", path, TRACE_VERSION);
+        fclose(file);
+        return false;
+    }
+
+    // Machine rebuilt per record with just what print_debug_info reads
+    static chip8_t chip8;
+    trace_record_t record;
+    while (fread(&record, sizeof record, 1, file) == 1) {
+        if (record.pc == TRACE_GAP) {
+            printf("... %u records dropped\n", record.frame);
+            continue;
+        }
+
+        instruction_t inst;
+        inst.opcode = record.opcode;
+        inst.NNN = inst.opcode & 0x0FFF;
+        inst.NN = inst.opcode & 0x0FF;
+        inst.N = inst.opcode & 0x0F;
+        inst.X = (inst.opcode >> 8) & 0x0F;
+        inst.Y = (inst.opcode >> 4) & 0x0F;
+        chip8.inst = inst;
+        chip8.PC = record.pc;
+        chip8.I = record.I;
+        chip8.V[0] = record.aux;
+        chip8.V[inst.Y] = record.vy;
+        chip8.V[inst.X] = record.vx;
+        chip8.V[0xF] = record.vf;
+        chip8.stack_ptr = 1;
+        chip8.stack[0] = record.aux;
+        chip8.keypad[record.vx & 0xF] = record.aux != 0;
+
+        printf("[%u] ", record.frame);
+        print_debug_info(&chip8);
+        if (record.vx != record.vx_before) {
+            printf("    V%X: 0x%02X -> 0x%02X\n", inst.X, record.vx_before, record.vx);
+        }
+        if (trace_aux_is_i(decode_table.op[inst.opcode]) && record.I != record.aux) {
+            printf("    I: 0x%03X -> 0x%03X\n", record.aux, record.I);
+        }
+    }
+    fclose(file);
+    return true;
+}
+#endif
+
+
+// Emulate count chip 8 instuctions, with the handlers for quirk profile Q
+template <quirk_profile_t Q>
+static void emulator_core(chip8_t *chip8, const config_t config, uint32_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    #ifdef PROFILE
+    // The stack may have been changed by a load or rewind since the last run
+    profile_t *prof = profiler;
+    if (prof) {
+        profile_enter_stack(prof, chip8);
+    }
+    #endif
+
+    #ifdef TRACE
+    trace_ring_t *ring = trace_thread_ring();
+    #endif
+
+#if defined(THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__)) && !defined(PROFILE) && !defined(TRACE)
+    // Threaded code: every handler jumps straight to the next handler
+    // through a label table, no shared switch and bounds check
+    #define OP_LABEL_ADDR(name, fn) &&label_##name,
+    static void *const labels[OP_COUNT] = {
+        CHIP8_OPS(OP_LABEL_ADDR)
+    };
+    #undef OP_LABEL_ADDR
+
+    instruction_t inst = fetch_instruction(chip8);
+    goto *labels[decode_table.op[inst.opcode]];
+
+    #define OP_LABEL(name, fn) \
+        label_##name: \
+            fn<Q>(chip8, &config, inst); \
+            if (--count == 0) return; \
+            inst = fetch_instruction(chip8); \
+            goto *labels[decode_table.op[inst.opcode]];
+    CHIP8_OPS(OP_LABEL)
+    #undef OP_LABEL
+#else
+    // Precomputed class per opcode, one flat switch instead of nested ones
+    #define OP_CASE(name, fn) case OP_##name: fn<Q>(chip8, &config, inst); break;
+    for (uint32_t i = 0; i < count; i++) {
+        #ifdef PROFILE
+        const uint16_t pc = chip8->PC;
+        const uint64_t start = prof && prof->timed ? profile_clock() : 0;
+        #endif
+
+        const instruction_t inst = fetch_instruction(chip8);
+        #ifdef TRACE
+        const uint16_t trace_pc = chip8->PC - 2;
+        const uint8_t trace_vx = chip8->V[inst.X];
+        const uint16_t trace_i = chip8->I;
+        #endif
+
+        switch (decode_table.op[inst.opcode]) {
+            CHIP8_OPS(OP_CASE)
+            default:
+                break;
+        }
+
+        #ifdef TRACE
+        trace_op(ring, chip8, trace_pc, inst, trace_vx, trace_i);
+        #endif
+
+        #ifdef PROFILE
+        if (prof) {
+            uint64_t ticks = 0;
+            if (prof->timed) {
+                ticks = profile_clock() - start;
+                ticks = ticks > prof->clock_cost ? ticks - prof->clock_cost : 0;
+            }
+            profile_count(prof, chip8, pc, inst.opcode, decode_table.op[inst.opcode], ticks);
+        }
+        #endif
+    }
+    #undef OP_CASE
+#endif
+}
+
+// Emulate count chip 8 instuctions on the core for the configured quirks
+void emulator_run(chip8_t *chip8, const config_t config, const uint32_t count) {
+    #define QUIRKS_CASE(name, ...) case QUIRKS_##name: emulator_core<QUIRKS_##name>(chip8, config, count); break;
+    switch (config.quirks) {
+        CHIP8_QUIRKS(QUIRKS_CASE)
+        default:
+            break;
+    }
+    #undef QUIRKS_CASE
+}
+
+// Emulate 1 chip 8 instuctions
+void emulator_instructions(chip8_t *chip8, const config_t config) {
+    emulator_run(chip8, config, 1);
+}
+
+// Run names, for the fusion counts headless runs print
+#define FUSE_NAME(name, first) #name,
+const char *const fuse_names[FUSE_COUNT] = {
+    "NONE",
+    CHIP8_FUSIONS(FUSE_NAME)
+    "LOOP",
+};
+#undef FUSE_NAME
+
+#ifndef TRACE
+// The run starting at uops[0], looking at no more than left uops
+static uint8_t fuse_match(const uop_t *uops, const uint32_t left) {
+    if (left >= 3 && uops[0].op == OP_LD_NN && uops[1].op == OP_LD_NN && uops[2].op == OP_DRW) {
+        return FUSE_LD_LD_DRW;
+    }
+    if (left < 2) {
+        return FUSE_NONE;
+    }
+    switch (uops[0].op) {
+        case OP_LD_I:
+            return uops[1].op == OP_DRW ? FUSE_LD_I_DRW : FUSE_NONE;
+        case OP_ADD_NN:
+            return uops[1].op == OP_SE_NN ? FUSE_ADD_SE : uops[1].op == OP_SNE_NN ? FUSE_ADD_SNE : FUSE_NONE;
+        case OP_LD_VX_DT:
+            return uops[1].op == OP_SE_NN ? FUSE_DT_SE : uops[1].op == OP_SNE_NN ? FUSE_DT_SNE : FUSE_NONE;
+        default:
+            return FUSE_NONE;
+    }
+}
+#endif
+
+// Empty the cache, for a new rom or after the pool limit is hit
+void block_cache_reset(block_cache_t *cache, chip8_t *chip8) {
+    memset(cache->block_at, 0xFF, sizeof cache->block_at);
+    cache->blocks.clear();
+    cache->uops.clear();
+    cache->code_used = 0;
+    chip8->code_pages = 0;
+    chip8->code_dirty_lo = chip8->code_dirty_hi = 0;
+    #ifdef AOT_SOURCE
+    cache->aot_valid.clear();
+    #endif
+}
+
+// Opcodes that end a block: anything that changes PC, plus the RAM
+// writes (the block may have just overwritten itself)
+static inline bool ends_block(const uint8_t op) {
+    switch (op) {
+        case OP_RET: case OP_JP: case OP_CALL: case OP_JP_V0:
+        case OP_SE_NN: case OP_SNE_NN: case OP_SE_VY: case OP_SNE_VY:
+        case OP_SKP: case OP_SKNP: case OP_WAIT_KEY:
+        case OP_BCD: case OP_STORE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Decode the block starting at pc and add it to the cache
+static block_t *block_build(block_cache_t *cache, chip8_t *chip8, const uint16_t pc) {
+    if (cache->uops.size() > BLOCK_POOL_LIMIT) {
+        block_cache_reset(cache, chip8);
+    }
+
+    block_t block = {};
+    block.start = pc;
+    block.first = (uint32_t)cache->uops.size();
+
+    uint16_t addr = pc;
+    while (block.count < BLOCK_MAX_UOPS && addr <= sizeof chip8->ram - 2) {
+        uop_t uop;
+        uop.inst.opcode = (chip8->ram[addr] << 8) | chip8->ram[addr + 1];
+        uop.inst.NNN = uop.inst.opcode & 0x0FFF;
+        uop.inst.NN = uop.inst.opcode & 0x0FF;
+        uop.inst.N = uop.inst.opcode & 0x0F;
+        uop.inst.X = (uop.inst.opcode >> 8) & 0x0F;
+        uop.inst.Y = (uop.inst.opcode >> 4) & 0x0F;
+        uop.op = decode_table.op[uop.inst.opcode];
+        uop.exec = uop.op;
+
+        cache->uops.push_back(uop);
+        block.count++;
+        addr += 2;
+
+        if (ends_block(uop.op)) {
+            break;
+        }
+    }
+    block.end = addr;
+    block.valid = true;
+
+    // Tag where every counted run starts, and counter loops. Traced builds leave them be
+    #ifndef TRACE
+    uop_t *uops = &cache->uops[block.first];
+    for (uint32_t i = 0; i < block.count; i++) {
+        const uint8_t fuse = fuse_match(&uops[i], block.count - i);
+        if (fuse != FUSE_NONE) {
+            uops[i].exec = OP_COUNT + fuse;
+        }
+    }
+    block.loop = block.count == 2 && uops[0].op == OP_ADD_NN && uops[1].op == OP_SE_NN &&
+                 uops[0].inst.X == uops[1].inst.X;
+    #endif
+
+    // Watch every page the block was decoded from
+    for (uint32_t page = block.start >> 6; page <= (uint32_t)(block.end - 1) >> 6; page++) {
+        chip8->code_pages |= 1ull << page;
+    }
+
+    cache->block_at[pc] = (int32_t)cache->blocks.size();
+    cache->blocks.push_back(block);
+    return &cache->blocks.back();
+}
+
+// Drop every block decoded from RAM written since the last check
+static void block_invalidate_dirty(block_cache_t *cache, chip8_t *chip8) {
+    const uint16_t lo = chip8->code_dirty_lo;
+    const uint16_t hi = chip8->code_dirty_hi;
+    chip8->code_dirty_lo = chip8->code_dirty_hi = 0;
+    chip8->code_pages = 0;
+
+    for (block_t &block : cache->blocks) {
+        if (!block.valid) {
+            continue;
+        }
+
+        if (block.start < hi && lo < block.end) {
+            block.valid = false;
+            cache->block_at[block.start] = -1;
+            continue;
+        }
+
+        for (uint32_t page = block.start >> 6; page <= (uint32_t)(block.end - 1) >> 6; page++) {
+            chip8->code_pages |= 1ull << page;
+        }
+    }
+}
+
+#ifdef CHIP8_JIT
+//
+// x86-64 JIT: hot blocks are translated to native code
+//
+// rbx holds the chip8_t pointer, r12d the instructions left in the budget
+// and [rsp] the config pointer. The most used V registers of a block live
+// in rbp/r13/r14/r15 for its whole length. PC is a constant inside a block
+// and is only stored on the way out, either at the end or at an early exit
+// when the budget runs out. ALU, immediate and branch opcodes are emitted
+// inline; anything else calls the same handler the interpreter uses.
+//
+
+#define JIT_CODE_SIZE (1 << 20) // Executable code cache per machine
+#define JIT_MAX_BLOCK_CODE 16384 // Worst case native size of one block
+#define JIT_HOT_THRESHOLD 2 // Visits before a block is compiled
+
+typedef void (*jit_block_fn_t)(chip8_t *chip8, const config_t *config, uint32_t count);
+
+// Code emitter state for one block
+typedef struct {
+    uint8_t *code;
+    uint32_t size;
+    int8_t v_host[16]; // Host register caching each V register, -1 if in memory
+    quirk_profile_t quirks; // Profile the block is compiled for
+    const op_handler_t *handlers; // Its handlers
+} jit_t;
+
+// Handler tables per quirk profile, compiled code calls the ones for the rom's profile
+#define QUIRKS_HANDLERS(name, ...) op_handlers<QUIRKS_##name>,
+static const op_handler_t *const jit_handlers[QUIRKS_COUNT] = {
+    CHIP8_QUIRKS(QUIRKS_HANDLERS)
+};
+#undef QUIRKS_HANDLERS
+
+static const uint8_t jit_cache_regs[] = {5, 13, 14, 15}; // rbp, r13, r14, r15
+
+#define JIT_V_OFF ((uint32_t)offsetof(chip8_t, V))
+#define JIT_I_OFF ((uint32_t)offsetof(chip8_t, I))
+#define JIT_PC_OFF ((uint32_t)offsetof(chip8_t, PC))
+#define JIT_DT_OFF ((uint32_t)offsetof(chip8_t, delay_timer))
+#define JIT_ST_OFF ((uint32_t)offsetof(chip8_t, sound_timer))
+
+static inline void jit_emit8(jit_t *j, const uint8_t byte) {
+    j->code[j->size++] = byte;
+}
+
+static inline void jit_emit16(jit_t *j, const uint16_t value) {
+    memcpy(&j->code[j->size], &value, 2);
+    j->size += 2;
+}
+
+static inline void jit_emit32(jit_t *j, const uint32_t value) {
+    memcpy(&j->code[j->size], &value, 4);
+    j->size += 4;
+}
+
+static inline void jit_emit64(jit_t *j, const uint64_t value) {
+    memcpy(&j->code[j->size], &value, 8);
+    j->size += 8;
+}
+
+// Emit a byte sized opcode whose r/m operand is register V[v], reg is the ModRM reg field
+static void jit_op_v(jit_t *j, const uint8_t op0, const int op1, const uint8_t reg, const uint8_t v) {
+    const int8_t host = j->v_host[v];
+
+    // Always emit REX so host registers 4-7 are spl..dil, never ah..bh
+    uint8_t rex = 0x40 | ((reg & 8) ? 0x04 : 0);
+    if (host >= 0 && (host & 8)) {
+        rex |= 0x01;
+    }
+    jit_emit8(j, rex);
+    jit_emit8(j, op0);
+    if (op1 >= 0) {
+        jit_emit8(j, (uint8_t)op1);
+    }
+
+    if (host >= 0) {
+        jit_emit8(j, 0xC0 | ((reg & 7) << 3) | (host & 7));
+    }
+    else {
+        jit_emit8(j, 0x80 | ((reg & 7) << 3) | 3); // [rbx + disp32]
+        jit_emit32(j, JIT_V_OFF + v);
+    }
+}
+
+// Emit an opcode on the chip8_t field at offset, [rbx + disp32]
+static void jit_op_mem(jit_t *j, const bool word, const uint8_t op, const uint8_t reg, const uint32_t offset) {
+    if (word) {
+        jit_emit8(j, 0x66);
+    }
+    jit_emit8(j, op);
+    jit_emit8(j, 0x80 | ((reg & 7) << 3) | 3);
+    jit_emit32(j, offset);
+}
+
+static void jit_store_pc(jit_t *j, const uint16_t pc) {
+    jit_op_mem(j, true, 0xC7, 0, JIT_PC_OFF); // mov word [PC], imm16
+    jit_emit16(j, pc);
+}
+
+// Write cached V registers back to chip8_t
+static void jit_flush_regs(jit_t *j) {
+    for (uint8_t v = 0; v < 16; v++) {
+        const int8_t host = j->v_host[v];
+        if (host >= 0) {
+            jit_emit8(j, 0x40 | ((host & 8) ? 0x04 : 0)); // mov byte [V], host8
+            jit_emit8(j, 0x88);
+            jit_emit8(j, 0x80 | ((host & 7) << 3) | 3);
+            jit_emit32(j, JIT_V_OFF + v);
+        }
+    }
+}
+
+// Load cached V registers from chip8_t
+static void jit_reload_regs(jit_t *j) {
+    for (uint8_t v = 0; v < 16; v++) {
+        const int8_t host = j->v_host[v];
+        if (host >= 0) {
+            jit_emit8(j, 0x40 | ((host & 8) ? 0x04 : 0)); // movzx host32, byte [V]
+            jit_emit8(j, 0x0F);
+            jit_emit8(j, 0xB6);
+            jit_emit8(j, 0x80 | ((host & 7) << 3) | 3);
+            jit_emit32(j, JIT_V_OFF + v);
+        }
+    }
+}
+
+// Call the interpreter handler for inst, registers are spilled around it
+static void jit_call_handler(jit_t *j, const uop_t *uop, const bool reload) {
+    uint64_t inst_bits;
+    static_assert(sizeof(instruction_t) == sizeof inst_bits, "instruction_t must pass in one register");
+    memcpy(&inst_bits, &uop->inst, sizeof inst_bits);
+
+    jit_flush_regs(j);
+    jit_emit8(j, 0x48); jit_emit8(j, 0x89); jit_emit8(j, 0xDF); // mov rdi, rbx
+    jit_emit8(j, 0x48); jit_emit8(j, 0x8B); jit_emit8(j, 0x34); jit_emit8(j, 0x24); // mov rsi, [rsp]
+    jit_emit8(j, 0x48); jit_emit8(j, 0xBA); jit_emit64(j, inst_bits); // mov rdx, inst
+    jit_emit8(j, 0x48); jit_emit8(j, 0xB8); jit_emit64(j, (uint64_t)(uintptr_t)j->handlers[uop->op]); // mov rax, fn
+    jit_emit8(j, 0xFF); jit_emit8(j, 0xD0); // call rax
+    if (reload) {
+        jit_reload_regs(j);
+    }
+}
+
+// Skip the next instruction when the flags match cc: PC = next + 2 * cc
+static void jit_skip_on(jit_t *j, const uint8_t setcc, const uint16_t next_pc) {
+    jit_emit8(j, 0x0F); jit_emit8(j, setcc); jit_emit8(j, 0xC1); // setcc cl
+    jit_emit8(j, 0x8D); jit_emit8(j, 0x04); jit_emit8(j, 0x4D); jit_emit32(j, next_pc); // lea eax, [rcx*2 + next]
+    jit_op_mem(j, true, 0x89, 0, JIT_PC_OFF); // mov word [PC], ax
+}
+
+// 8XYN ops that read and write VF in the same instruction keep the interpreter's ordering
+static inline bool jit_touches_vf(const instruction_t inst) {
+    return inst.X == 0xF || inst.Y == 0xF;
+}
+
+// Early exit once the budget is used up: dec r12d, jz to a stub storing PC
+static void jit_check_budget(jit_t *j, std::vector<std::pair<uint32_t, uint16_t>> *exits, const uint16_t pc) {
+    jit_emit8(j, 0x41); jit_emit8(j, 0xFF); jit_emit8(j, 0xCC); // dec r12d
+    jit_emit8(j, 0x0F); jit_emit8(j, 0x84); // jz rel32, patched once the stub exists
+    exits->push_back({j->size, pc});
+    jit_emit32(j, 0);
+}
+
+// Pick host registers for the V registers the block uses most
+static void jit_alloc_regs(jit_t *j, const uop_t *uops, const uint16_t count) {
+    uint32_t uses[16] = {};
+    for (uint16_t i = 0; i < count; i++) {
+        const uop_t *uop = &uops[i];
+        switch (uop->op) {
+            case OP_ADD_VY: case OP_SUB: case OP_SUBN: case OP_SHR: case OP_SHL:
+                uses[0xF]++;
+                [[fallthrough]];
+            case OP_LD_VY: case OP_OR: case OP_AND: case OP_XOR: case OP_SE_VY: case OP_SNE_VY:
+                uses[uop->inst.X]++;
+                uses[uop->inst.Y]++;
+                break;
+            case OP_ADD_NN: case OP_SE_NN: case OP_SNE_NN: case OP_LD_VX_DT: case OP_LD_DT:
+            case OP_LD_ST: case OP_ADD_I: case OP_LD_F:
+                uses[uop->inst.X]++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    memset(j->v_host, -1, sizeof j->v_host);
+    for (uint8_t reg = 0; reg < sizeof jit_cache_regs; reg++) {
+        int best = -1;
+        for (uint8_t v = 0; v < 16; v++) {
+            if (j->v_host[v] < 0 && uses[v] >= 2 && (best < 0 || uses[v] > uses[best])) {
+                best = v;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        j->v_host[best] = (int8_t)jit_cache_regs[reg];
+    }
+}
+
+// Translate one block into code, returns its entry point and native size
+static jit_block_fn_t jit_compile(uint8_t *code, const uop_t *uops, const block_t *block,
+                                  const quirk_profile_t quirks, uint32_t *size) {
+    jit_t jit = {};
+    jit_t *j = &jit;
+    j->code = code;
+    j->quirks = quirks;
+    j->handlers = jit_handlers[quirks];
+    jit_alloc_regs(j, uops, block->count);
+
+    // Prologue: save callee saved registers, keep rsp 16 byte aligned for calls
+    jit_emit8(j, 0x53); // push rbx
+    jit_emit8(j, 0x55); // push rbp
+    jit_emit8(j, 0x41); jit_emit8(j, 0x54); // push r12
+    jit_emit8(j, 0x41); jit_emit8(j, 0x55); // push r13
+    jit_emit8(j, 0x41); jit_emit8(j, 0x56); // push r14
+    jit_emit8(j, 0x41); jit_emit8(j, 0x57); // push r15
+    jit_emit8(j, 0x48); jit_emit8(j, 0x83); jit_emit8(j, 0xEC); jit_emit8(j, 0x08); // sub rsp, 8
+    jit_emit8(j, 0x48); jit_emit8(j, 0x89); jit_emit8(j, 0xFB); // mov rbx, rdi
+    jit_emit8(j, 0x48); jit_emit8(j, 0x89); jit_emit8(j, 0x34); jit_emit8(j, 0x24); // mov [rsp], rsi
+    jit_emit8(j, 0x41); jit_emit8(j, 0x89); jit_emit8(j, 0xD4); // mov r12d, edx
+    jit_reload_regs(j);
+
+    int8_t alloc[16];
+    memcpy(alloc, j->v_host, sizeof alloc);
+    std::vector<std::pair<uint32_t, uint16_t>> exits; // jz rel32 offset, PC to resume at
+
+    bool pc_stored = false;
+    for (uint16_t i = 0; i < block->count; i++) {
+        const uop_t *uop = &uops[i];
+        const instruction_t inst = uop->inst;
+        const uint16_t next_pc = block->start + (i + 1) * 2;
+
+        switch (uop->op) {
+            case OP_INVALID:
+                break;
+
+            case OP_LD_NN:
+                jit_op_v(j, 0xC6, -1, 0, inst.X); // mov VX, imm8
+                jit_emit8(j, inst.NN);
+                break;
+
+            case OP_ADD_NN:
+                jit_op_v(j, 0x80, -1, 0, inst.X); // add VX, imm8
+                jit_emit8(j, inst.NN);
+                break;
+
+            case OP_LD_VY:
+                jit_op_v(j, 0x8A, -1, 1, inst.Y); // mov cl, VY
+                jit_op_v(j, 0x88, -1, 1, inst.X); // mov VX, cl
+                break;
+
+            case OP_OR:
+            case OP_AND:
+            case OP_XOR:
+                jit_op_v(j, 0x8A, -1, 1, inst.Y); // mov cl, VY
+                jit_op_v(j, uop->op == OP_OR ? 0x08 : uop->op == OP_AND ? 0x20 : 0x30, -1, 1, inst.X); // op VX, cl
+                break;
+
+            case OP_ADD_VY:
+            case OP_SUB:
+                if (jit_touches_vf(inst)) {
+                    jit_call_handler(j, uop, true);
+                    break;
+                }
+                jit_op_v(j, 0x8A, -1, 1, inst.Y); // mov cl, VY
+                jit_op_v(j, uop->op == OP_ADD_VY ? 0x00 : 0x28, -1, 1, inst.X); // add/sub VX, cl
+                jit_op_v(j, 0x0F, uop->op == OP_ADD_VY ? 0x92 : 0x93, 0, 0xF); // setc / setnc VF
+                break;
+
+            case OP_SUBN:
+                if (jit_touches_vf(inst)) {
+                    jit_call_handler(j, uop, true);
+                    break;
+                }
+                jit_op_v(j, 0x8A, -1, 0, inst.Y); // mov al, VY
+                jit_op_v(j, 0x8A, -1, 1, inst.X); // mov cl, VX
+                jit_emit8(j, 0x28); jit_emit8(j, 0xC8); // sub al, cl
+                jit_op_v(j, 0x0F, 0x93, 0, 0xF); // setnc VF
+                jit_op_v(j, 0x88, -1, 0, inst.X); // mov VX, al
+                break;
+
+            case OP_SHR:
+            case OP_SHL:
+                if (jit_touches_vf(inst)) {
+                    jit_call_handler(j, uop, true);
+                    break;
+                }
+                if (quirk_table[j->quirks].shift_vy) {
+                    jit_op_v(j, 0x8A, -1, 0, inst.Y); // mov al, VY
+                    jit_emit8(j, 0xD0); jit_emit8(j, uop->op == OP_SHR ? 0xE8 : 0xE0); // shr/shl al, 1
+                    jit_op_v(j, 0x0F, 0x92, 0, 0xF); // setc VF
+                    jit_op_v(j, 0x88, -1, 0, inst.X); // mov VX, al
+                    break;
+                }
+                jit_op_v(j, 0xD0, -1, uop->op == OP_SHR ? 5 : 4, inst.X); // shr/shl VX, 1
+                jit_op_v(j, 0x0F, 0x92, 0, 0xF); // setc VF
+                break;
+
+            case OP_LD_I:
+                jit_op_mem(j, true, 0xC7, 0, JIT_I_OFF); // mov word [I], imm16
+                jit_emit16(j, inst.NNN);
+                break;
+
+            case OP_ADD_I:
+                jit_op_v(j, 0x0F, 0xB6, 0, inst.X); // movzx eax, VX
+                jit_op_mem(j, true, 0x01, 0, JIT_I_OFF); // add word [I], ax
+                break;
+
+            case OP_LD_F:
+                jit_op_v(j, 0x0F, 0xB6, 0, inst.X); // movzx eax, VX
+                jit_emit8(j, 0x8D); jit_emit8(j, 0x04); jit_emit8(j, 0x80); // lea eax, [rax + rax * 4]
+                jit_op_mem(j, true, 0x89, 0, JIT_I_OFF); // mov word [I], ax
+                break;
+
+            case OP_LD_VX_DT:
+                jit_op_mem(j, false, 0x8A, 0, JIT_DT_OFF); // mov al, [delay_timer]
+                jit_op_v(j, 0x88, -1, 0, inst.X); // mov VX, al
+                break;
+
+            case OP_LD_DT:
+            case OP_LD_ST:
+                jit_op_v(j, 0x8A, -1, 0, inst.X); // mov al, VX
+                jit_op_mem(j, false, 0x88, 0, uop->op == OP_LD_DT ? JIT_DT_OFF : JIT_ST_OFF); // mov [timer], al
+                break;
+
+            case OP_JP:
+                jit_store_pc(j, inst.NNN);
+                pc_stored = true;
+                break;
+
+            case OP_SE_NN:
+            case OP_SNE_NN:
+                jit_emit8(j, 0x31); jit_emit8(j, 0xC9); // xor ecx, ecx
+                jit_op_v(j, 0x80, -1, 7, inst.X); // cmp VX, imm8
+                jit_emit8(j, inst.NN);
+                jit_skip_on(j, uop->op == OP_SE_NN ? 0x94 : 0x95, next_pc); // sete / setne
+                pc_stored = true;
+                break;
+
+            case OP_SE_VY:
+            case OP_SNE_VY:
+                jit_emit8(j, 0x31); jit_emit8(j, 0xC9); // xor ecx, ecx
+                jit_op_v(j, 0x8A, -1, 2, inst.Y); // mov dl, VY
+                jit_op_v(j, 0x38, -1, 2, inst.X); // cmp VX, dl
+                jit_skip_on(j, uop->op == OP_SE_VY ? 0x94 : 0x95, next_pc);
+                pc_stored = true;
+                break;
+
+            default:
+                // Control flow and RAM writes end the block, they see PC as the interpreter would
+                if (ends_block(uop->op)) {
+                    jit_store_pc(j, next_pc);
+                    jit_call_handler(j, uop, false);
+                    pc_stored = true;
+                    memset(j->v_host, -1, sizeof j->v_host); // Handler owns V now, nothing to write back
+                }
+                else {
+                    jit_call_handler(j, uop, true);
+                }
+                break;
+        }
+
+        if (i + 1 < block->count) {
+            jit_check_budget(j, &exits, next_pc);
+        }
+    }
+
+    if (!pc_stored) {
+        jit_store_pc(j, block->end);
+    }
+
+    // Epilogue
+    jit_flush_regs(j);
+    const uint32_t ret_label = j->size;
+    jit_emit8(j, 0x48); jit_emit8(j, 0x83); jit_emit8(j, 0xC4); jit_emit8(j, 0x08); // add rsp, 8
+    jit_emit8(j, 0x41); jit_emit8(j, 0x5F); // pop r15
+    jit_emit8(j, 0x41); jit_emit8(j, 0x5E); // pop r14
+    jit_emit8(j, 0x41); jit_emit8(j, 0x5D); // pop r13
+    jit_emit8(j, 0x41); jit_emit8(j, 0x5C); // pop r12
+    jit_emit8(j, 0x5D); // pop rbp
+    jit_emit8(j, 0x5B); // pop rbx
+    jit_emit8(j, 0xC3); // ret
+
+    // Early exit stubs, every cached register is still live here
+    memcpy(j->v_host, alloc, sizeof alloc);
+    for (const auto &exit : exits) {
+        const uint32_t rel = j->size - (exit.first + 4);
+        memcpy(&j->code[exit.first], &rel, 4);
+        jit_store_pc(j, exit.second);
+        jit_flush_regs(j);
+        jit_emit8(j, 0xE9); // jmp ret_label
+        jit_emit32(j, ret_label - (j->size + 4));
+    }
+
+    *size = j->size;
+    return (jit_block_fn_t)(void *)code;
+}
+
+// Compile a hot block into the machine's code cache
+static void jit_compile_block(block_cache_t *cache, block_t *block, const quirk_profile_t quirks) {
+    if (!cache->code) {
+        void *mem = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            block->hits = 0; // Try again later, the block engine keeps running it
+            return;
+        }
+        cache->code = (uint8_t *)mem;
+        cache->code_used = 0;
+    }
+
+    // Full cache: drop all compiled code, blocks get hot again and recompile
+    if (cache->code_used + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE) {
+        for (block_t &other : cache->blocks) {
+            other.code = NULL;
+            other.hits = 0;
+        }
+        cache->code_used = 0;
+    }
+
+    uint32_t size = 0;
+    block->code = (void *)jit_compile(cache->code + cache->code_used, &cache->uops[block->first], block, quirks, &size);
+    cache->code_used += size;
+}
+#endif
+
+// Release the JIT code cache, reset the cache before using it again
+void block_cache_free(block_cache_t *cache) {
+    #ifdef CHIP8_JIT
+    if (cache->code) {
+        munmap(cache->code, JIT_CODE_SIZE);
+        cache->code = NULL;
+    }
+    #endif
+    cache->blocks.clear();
+    cache->uops.clear();
+    cache->code_used = 0;
+}
+
+#ifndef TRACE
+// Counter loop at PC: 7XNN, 3XMM, then 1NNN back to the 7XNN. Every pass adds NN and the one that
+// reaches MM skips out of the loop, so the passes are worked out rather than run. Returns the
+// instructions they stand for: through the exit when it fits in count, else the whole passes
+// that do. 0 when the jump is not there or not even one pass fits
+static uint32_t fuse_loop(chip8_t *chip8, const uop_t *uops, const uint32_t count) {
+    const uint16_t pc = chip8->PC;
+    if (pc > sizeof chip8->ram - 6 || ((chip8->ram[pc + 4] << 8) | chip8->ram[pc + 5]) != (0x1000 | pc)) {
+        return 0;
+    }
+
+    const uint8_t nn = uops[0].inst.NN;
+    const uint8_t mm = uops[1].inst.NN;
+    uint8_t *vx = &chip8->V[uops[0].inst.X];
+
+    // Passes through the one that leaves, 0 if VX never reaches MM
+    uint32_t passes = 0;
+    uint8_t v = *vx;
+    for (uint32_t k = 1; k <= 256 && 3 * k - 1 <= count; k++) {
+        v += nn;
+        if (v == mm) {
+            passes = k;
+            break;
+        }
+    }
+    if (passes) {
+        *vx = mm;
+        chip8->PC = pc + 6;
+        return 3 * passes - 1;
+    }
+
+    // Still looping when the budget runs out, any instructions left over run as usual
+    passes = count / 3;
+    *vx += (uint8_t)(passes * nn);
+    return 3 * passes;
+}
+#endif
+
+// Emulate count chip 8 instuctions from cached blocks, compiling hot ones with the JIT engine
+template <quirk_profile_t Q>
+static void block_core(chip8_t *chip8, block_cache_t *cache, const config_t config, uint32_t count) {
+    #ifdef CHIP8_JIT
+    const bool jit = config.engine == ENGINE_JIT;
+    #endif
+
+    #define OP_CASE(name, fn) case OP_##name: fn<Q>(chip8, &config, uop->inst); break;
+    #define FUSE_CASE(name, first) \
+        case OP_COUNT + FUSE_##name: \
+            cache->fused[FUSE_##name]++; \
+            first<Q>(chip8, &config, uop->inst); \
+            break;
+
+    #ifdef TRACE
+    trace_ring_t *ring = trace_thread_ring();
+    #endif
+
+    while (count > 0) {
+        if (chip8->code_dirty_lo < chip8->code_dirty_hi) {
+            block_invalidate_dirty(cache, chip8);
+        }
+
+        // Out of range PC, leave it to the interpreter
+        const uint16_t pc = chip8->PC;
+        if (pc > sizeof chip8->ram - 2) {
+            emulator_run(chip8, config, 1);
+            count--;
+            continue;
+        }
+
+        const int32_t index = cache->block_at[pc];
+        block_t *block = index >= 0 ? &cache->blocks[index] : block_build(cache, chip8, pc);
+
+        // Counter loops go in one step, budget permitting
+        #ifndef TRACE
+        if (block->loop) {
+            const uint32_t ran = fuse_loop(chip8, &cache->uops[block->first], count);
+            if (ran) {
+                cache->fused[FUSE_LOOP]++;
+                count -= ran;
+                continue;
+            }
+        }
+        #endif
+
+        // Never run past the budget, so timers tick on the same instruction as the interpreter
+        const uint32_t n = block->count < count ? block->count : count;
+
+        #ifdef CHIP8_JIT
+        if (jit) {
+            if (!block->code && ++block->hits >= JIT_HOT_THRESHOLD) {
+                jit_compile_block(cache, block, Q);
+            }
+            if (block->code) {
+                ((jit_block_fn_t)block->code)(chip8, &config, n);
+                count -= n;
+                continue;
+            }
+        }
+        #endif
+
+        const uop_t *uop = &cache->uops[block->first];
+        const uop_t *last = uop + n - 1;
+
+        #ifdef TRACE
+        uint16_t trace_pc = pc;
+        uint8_t trace_vx;
+        uint16_t trace_i;
+        #endif
+
+        // Only the last uop of a block can read or write PC, so it is set past the run up front
+        chip8->PC = pc + n * 2;
+
+        for (; uop <= last; uop++) {
+            #ifdef TRACE
+            trace_vx = chip8->V[uop->inst.X];
+            trace_i = chip8->I;
+            #endif
+            switch (uop->exec) {
+                CHIP8_OPS(OP_CASE)
+                CHIP8_FUSIONS(FUSE_CASE)
+                default:
+                    break;
+            }
+            #ifdef DEBUG
+            chip8->inst = uop->inst;
+            #endif
+            #ifdef TRACE
+            trace_op(ring, chip8, trace_pc, uop->inst, trace_vx, trace_i);
+            trace_pc += 2;
+            #endif
+        }
+
+        count -= n;
+    }
+
+    #undef OP_CASE
+    #undef FUSE_CASE
+}
+
+// Run count instructions through the block cache, on the core for the configured quirks
+void block_run(chip8_t *chip8, block_cache_t *cache, const config_t config, const uint32_t count) {
+    #define QUIRKS_CASE(name, ...) case QUIRKS_##name: block_core<QUIRKS_##name>(chip8, cache, config, count); break;
+    switch (config.quirks) {
+        CHIP8_QUIRKS(QUIRKS_CASE)
+        default:
+            break;
+    }
+    #undef QUIRKS_CASE
+}
+
+//
+// Ahead of time compiler: --aot-out writes a rom out as C++, one function per basic block,
+// and make aot builds that into a binary for the one rom
+//
+
+// Decode the block at start the way block_build does, returns where it ends
+static uint16_t aot_decode(const chip8_t *chip8, const uint16_t start, std::vector<uint16_t> *opcodes) {
+    uint16_t addr = start;
+    opcodes->clear();
+    while (opcodes->size() < BLOCK_MAX_UOPS && addr <= sizeof chip8->ram - 2) {
+        const uint16_t opcode = (chip8->ram[addr] << 8) | chip8->ram[addr + 1];
+        opcodes->push_back(opcode);
+        addr += 2;
+
+        if (ends_block(decode_table.op[opcode])) {
+            break;
+        }
+    }
+    return addr;
+}
+
+// Start of every block the rom reaches from 0x200 through jumps, calls, the returns from them
+// and skips. BNNN lands wherever V0 says at run time, its targets are left to the interpreter
+static std::vector<uint16_t> aot_find_blocks(const chip8_t *chip8) {
+    std::vector<bool> seen(sizeof chip8->ram, false);
+    std::vector<uint16_t> work = {0x200};
+    std::vector<uint16_t> starts;
+    std::vector<uint16_t> opcodes;
+
+    while (!work.empty()) {
+        const uint16_t start = work.back();
+        work.pop_back();
+        if (start < 0x200 || start > sizeof chip8->ram - 2 || seen[start]) {
+            continue;
+        }
+        seen[start] = true;
+        starts.push_back(start);
+
+        const uint16_t end = aot_decode(chip8, start, &opcodes);
+        const uint16_t opcode = opcodes.back();
+        switch (decode_table.op[opcode]) {
+            case OP_JP:
+                work.push_back(opcode & 0x0FFF);
+                break;
+            case OP_CALL:
+                work.push_back(opcode & 0x0FFF);
+                work.push_back(end);
+                break;
+            case OP_SE_NN: case OP_SNE_NN: case OP_SE_VY: case OP_SNE_VY:
+            case OP_SKP: case OP_SKNP:
+                work.push_back(end);
+                work.push_back(end + 2);
+                break;
+            case OP_WAIT_KEY:
+                work.push_back(end - 2); // Runs again until a key is down
+                work.push_back(end);
+                break;
+            case OP_RET: case OP_JP_V0:
+                break;
+            default:
+                work.push_back(end); // FX33, FX55, or a block split for length
+                break;
+        }
+    }
+
+    std::sort(starts.begin(), starts.end());
+    return starts;
+}
+
+// Write the rom in chip8's RAM out as C++ source for make aot, compiled for one quirk profile
+bool aot_write(const chip8_t *chip8, const char *rom_name, const quirk_profile_t quirks, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+
+    #define OP_FN_NAME(name, fn) #fn,
+    static const char *const op_fns[OP_COUNT] = {
+        CHIP8_OPS(OP_FN_NAME)
+    };
+    #undef OP_FN_NAME
+
+    const std::vector<uint16_t> starts = aot_find_blocks(chip8);
+    std::vector<uint16_t> opcodes;
+
+    // RAM from 0x200 to the end of the rom or the last block, whichever is further
+    uint32_t code_end = sizeof chip8->ram;
+    while (code_end > 0x200 && !chip8->ram[code_end - 1]) {
+        code_end--;
+    }
+    for (const uint16_t start : starts) {
+        const uint16_t end = aot_decode(chip8, start, &opcodes);
+        if (end > code_end) code_end = end;
+    }
+
+    fprintf(out, "// Generated by chip8 --aot-out from %s, do not edit\n", rom_name);
+    fprintf(out, "// Build with: make aot AOT=%s\n\n", path);
+
+    fprintf(out, "static const char aot_rom_name[] = \"");
+    for (const char *c = rom_name; *c; c++) {
+        fprintf(out, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    }
+    fprintf(out, "\";\n\n");
+
+    #define QUIRKS_NAME(name, ...) "QUIRKS_" #name,
+    static const char *const quirk_enums[QUIRKS_COUNT] = {
+        CHIP8_QUIRKS(QUIRKS_NAME)
+    };
+    #undef QUIRKS_NAME
+    fprintf(out, "// Handlers are the ones for --quirks %s\n", quirk_table[quirks].name);
+    fprintf(out, "static constexpr quirk_profile_t aot_quirks = %s;\n\n", quirk_enums[quirks]);
+
+    fprintf(out, "// RAM from 0x200 the blocks were compiled from\n");
+    fprintf(out, "static const uint8_t aot_code[] = {");
+    for (uint32_t addr = 0x200; addr < code_end; addr++) {
+        fprintf(out, "%s0x%02X,", (addr - 0x200) % 16 ? " " : "\n    ", chip8->ram[addr]);
+    }
+    fprintf(out, "\n};\n");
+
+    for (const uint16_t start : starts) {
+        const uint16_t end = aot_decode(chip8, start, &opcodes);
+        fprintf(out, "\nstatic void aot_%03X(chip8_t *chip8, const config_t *config) {\n", start);
+        for (size_t i = 0; i < opcodes.size(); i++) {
+            // Only the last opcode of a block can read or write PC
+            if (i == opcodes.size() - 1) {
+                fprintf(out, "    chip8->PC = 0x%03X;\n", end);
+            }
+            fprintf(out, "    %s<aot_quirks>(chip8, config, aot_inst(0x%04X)); // %03X\n",
+                op_fns[decode_table.op[opcodes[i]]], opcodes[i], (unsigned)(start + i * 2));
+        }
+        fprintf(out, "}\n");
+    }
+
+    fprintf(out, "\nstatic const aot_block_t aot_blocks[] = {\n");
+    for (const uint16_t start : starts) {
+        const uint16_t end = aot_decode(chip8, start, &opcodes);
+        fprintf(out, "    {0x%03X, 0x%03X, %u, aot_%03X},\n", start, end, (unsigned)opcodes.size(), start);
+    }
+    fprintf(out, "};\n");
+
+    const bool ok = !ferror(out);
+    fclose(out);
+    if (ok) {
+        printf("Wrote %zu blocks from %s to %s\n", starts.size(), rom_name, path);
+    }
+    return ok;
+}
+
+#ifdef AOT_SOURCE
+// A compiled block. It only runs while RAM still holds the bytes it was compiled from
+typedef void (*aot_block_fn_t)(chip8_t *chip8, const config_t *config);
+
+typedef struct {
+    uint16_t start;
+    uint16_t end; // One past the last opcode
+    uint32_t count;
+    aot_block_fn_t fn;
+} aot_block_t;
+
+// Opcodes as constants, so each handler folds down to just its work
+static constexpr instruction_t aot_inst(const uint16_t opcode) {
+    return {
+        opcode,
+        (uint16_t)(opcode & 0x0FFF),
+        (uint8_t)(opcode & 0x0FF),
+        (uint8_t)(opcode & 0x0F),
+        (uint8_t)((opcode >> 8) & 0x0F),
+        (uint8_t)((opcode >> 4) & 0x0F),
+    };
+}
+
+#include AOT_SOURCE
+
+static const uint32_t aot_block_count = sizeof aot_blocks / sizeof aot_blocks[0];
+
+// Index into aot_blocks of the block starting at each address, -1 for none
+static const std::vector<int16_t> &aot_index() {
+    static const std::vector<int16_t> index = [] {
+        std::vector<int16_t> at(4096, -1);
+        for (uint32_t i = 0; i < aot_block_count; i++) {
+            at[aot_blocks[i].start] = (int16_t)i;
+        }
+        return at;
+    }();
+    return index;
+}
+
+static inline bool aot_block_matches(const chip8_t *chip8, const aot_block_t *block) {
+    return memcmp(&chip8->ram[block->start], &aot_code[block->start - 0x200], block->end - block->start) == 0;
+}
+
+// Compare every block with RAM and watch the pages they came from. Compiled code has its quirks
+// built in, under any other profile the interpreter runs everything
+static void aot_init(block_cache_t *cache, chip8_t *chip8, const quirk_profile_t quirks) {
+    cache->aot_valid.assign(aot_block_count, 0);
+    if (quirks != aot_quirks) {
+        fprintf(stderr, "%s was compiled with --quirks %s, the interpreter runs it with %s\n",
+            aot_rom_name, quirk_table[aot_quirks].name, quirk_table[quirks].name);
+        return;
+    }
+
+    uint32_t stale = 0;
+    for (uint32_t i = 0; i < aot_block_count; i++) {
+        const aot_block_t *block = &aot_blocks[i];
+        cache->aot_valid[i] = aot_block_matches(chip8, block);
+        stale += !cache->aot_valid[i];
+        for (uint32_t page = block->start >> 6; page <= (uint32_t)(block->end - 1) >> 6; page++) {
+            chip8->code_pages |= 1ull << page;
+        }
+    }
+    chip8->code_dirty_lo = chip8->code_dirty_hi = 0;
+
+    if (stale) {
+        fprintf(stderr, "%u of %u blocks compiled from %s do not match %s, the interpreter runs them\n",
+            stale, aot_block_count, aot_rom_name, chip8->rom_name);
+    }
+}
+
+// Check blocks on RAM written since the last check. A block written back to its old bytes,
+// by loading a save state say, runs compiled again
+static void aot_check_dirty(block_cache_t *cache, chip8_t *chip8) {
+    const uint16_t lo = chip8->code_dirty_lo;
+    const uint16_t hi = chip8->code_dirty_hi;
+    chip8->code_dirty_lo = chip8->code_dirty_hi = 0;
+
+    for (uint32_t i = 0; i < aot_block_count; i++) {
+        if (aot_blocks[i].start < hi && lo < aot_blocks[i].end) {
+            cache->aot_valid[i] = aot_block_matches(chip8, &aot_blocks[i]);
+        }
+    }
+}
+
+// Run count instructions, compiled blocks where there is one that fits the budget
+void aot_run(chip8_t *chip8, block_cache_t *cache, const config_t config, uint32_t count) {
+    if (cache->aot_valid.empty()) {
+        aot_init(cache, chip8, config.quirks);
+    }
+    const int16_t *index = aot_index().data();
+
+    while (count > 0) {
+        if (chip8->code_dirty_lo < chip8->code_dirty_hi) {
+            aot_check_dirty(cache, chip8);
+        }
+
+        // Computed jump targets, rewritten code and the tail of a budget run on the interpreter
+        const uint16_t pc = chip8->PC;
+        const int32_t i = pc <= sizeof chip8->ram - 2 ? index[pc] : -1;
+        if (i < 0 || !cache->aot_valid[i] || aot_blocks[i].count > count) {
+            emulator_run(chip8, config, 1);
+            count--;
+            continue;
+        }
+
+        aot_blocks[i].fn(chip8, &config);
+        count -= aot_blocks[i].count;
+    }
+}
+
+// The rom compiled into this build and its name, main runs it when it is given none
+const char *aot_rom(const uint8_t **code, size_t *size) {
+    *code = aot_code;
+    *size = sizeof aot_code;
+    return aot_rom_name;
+}
+#endif
+
+#define IDLE_CHECK_INSTS 64 // Fewest instructions run between checks for an idle loop that found none
+#define IDLE_BACKOFF_INSTS 1024 // Most instructions run between checks while none find a loop
+#define IDLE_MAX_LOOP 32 // Longest loop idle_skip follows
+
+// Profiled and traced builds run every instruction
+#if !defined(PROFILE) && !defined(TRACE)
+// Follow one pass of a loop from PC on copies of V and I. Only ops that touch nothing but V, I
+// and PC are followed. Returns the pass length once PC comes back round, 0 for anything else
+static uint32_t idle_pass(const chip8_t *chip8, uint8_t *V, uint16_t *I) {
+    uint16_t pc = chip8->PC;
+    for (uint32_t n = 1; n <= IDLE_MAX_LOOP; n++) {
+        if (pc > sizeof chip8->ram - 2) {
+            return 0;
+        }
+        const uint16_t op = (chip8->ram[pc] << 8) | chip8->ram[pc + 1];
+        const uint8_t X = (op >> 8) & 0x0F;
+        const uint8_t Y = (op >> 4) & 0x0F;
+        const uint8_t NN = op & 0xFF;
+
+        switch (op >> 12) {
+            case 0x1: pc = op & 0x0FFF; break;
+            case 0x3: pc += V[X] == NN ? 4 : 2; break;
+            case 0x4: pc += V[X] != NN ? 4 : 2; break;
+            case 0x5:
+                if (op & 0x0F) return 0;
+                pc += V[X] == V[Y] ? 4 : 2;
+                break;
+            case 0x6: V[X] = NN; pc += 2; break;
+            case 0x8:
+                if (op & 0x0F) return 0;
+                V[X] = V[Y];
+                pc += 2;
+                break;
+            case 0x9: pc += V[X] != V[Y] ? 4 : 2; break;
+            case 0xA: *I = op & 0x0FFF; pc += 2; break;
+            case 0xE:
+                if (V[X] > 15 || (NN != 0x9E && NN != 0xA1)) return 0;
+                pc += chip8->keypad[V[X]] == (NN == 0x9E) ? 4 : 2;
+                break;
+            case 0xF:
+                if (NN == 0x07) {
+                    V[X] = chip8->delay_timer;
+                    pc += 2;
+                }
+                else if (NN != 0x0A || keypad_mask(chip8->keypad)) {
+                    return 0; // FX0A with no key down runs again, anything else is work
+                }
+                break;
+            default:
+                return 0;
+        }
+
+        if (pc == chip8->PC) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+// Whole passes of an idle loop at PC that fit in count, 0 when PC is not in one. Roms wait for
+// the delay timer or a key by spinning through jumps, skips, FX07 and FX0A, and timers and keys
+// only change between frames. When a second pass leaves V and I just as the first did, every
+// pass until the next frame does the same, so they are skipped and the registers set to what
+// the first pass left. What the rom sees is exactly what running them would have done
+static uint32_t idle_skip(chip8_t *chip8, const uint32_t count) {
+    uint8_t V[16];
+    memcpy(V, chip8->V, sizeof V);
+    uint16_t I = chip8->I;
+    const uint32_t n = idle_pass(chip8, V, &I);
+    if (n == 0 || n > count) {
+        return 0;
+    }
+
+    uint8_t again[16];
+    memcpy(again, V, sizeof again);
+    uint16_t again_I = I;
+    if (idle_pass(chip8, again, &again_I) != n || memcmp(again, V, sizeof V) != 0 || again_I != I) {
+        return 0;
+    }
+
+    const uint32_t skip = count - count % n;
+    memcpy(chip8->V, V, sizeof V);
+    chip8->I = I;
+    chip8->idle_insts += skip;
+    return skip;
+}
+#endif
+
+// Emulate count chip 8 instructions on the configured engine
+void engine_run(chip8_t *chip8, block_cache_t *cache, const config_t config, uint32_t count) {
+    while (count > 0) {
+        // With nothing to skip the whole count goes in one call
+        uint32_t n = count;
+
+        // Every instruction is traced or profiled in those builds, idle or not. The wait between
+        // checks runs on from one call to the next, so frames of a few instructions get checked too
+        #if !defined(PROFILE) && !defined(TRACE)
+        if (config.idle_skip) {
+            if (chip8->idle_wait == 0) {
+                const uint32_t skipped = idle_skip(chip8, count);
+                count -= skipped;
+                n = count;
+                if (count == 0) {
+                    break;
+                }
+
+                // Less than a pass is left after a skip, so the next call checks again. Busy code
+                // is checked less often until it goes idle
+                const uint32_t chunk = chip8->idle_chunk;
+                chip8->idle_chunk = skipped ? 0 : chunk == 0 ? IDLE_CHECK_INSTS
+                                  : chunk * 2 < IDLE_BACKOFF_INSTS ? chunk * 2 : IDLE_BACKOFF_INSTS;
+                chip8->idle_wait = chip8->idle_chunk;
+            }
+            if (chip8->idle_wait) {
+                n = count < chip8->idle_wait ? count : chip8->idle_wait;
+                chip8->idle_wait -= n;
+            }
+        }
+        #endif
+
+        switch (config.engine) {
+            case ENGINE_BLOCK:
+            case ENGINE_JIT:
+                block_run(chip8, cache, config, n);
+                break;
+
+            #ifdef AOT_SOURCE
+            case ENGINE_AOT:
+                aot_run(chip8, cache, config, n);
+                break;
+            #endif
+
+            default:
+                emulator_run(chip8, config, n);
+                break;
+        }
+        count -= n;
+    }
+}
+
+
+// Handle chip 8 init, from a rom image already in memory. rom_name is kept for messages and save states
+bool init_chip8_image(chip8_t *chip8, const char rom_name[], const uint8_t *rom, const size_t rom_size) {
+    // Entry point
+    const uint32_t entry_point = 0x200;
+    const uint8_t font[] = {
+        0xF0, 0x90, 0x90, 0x90, 0xF0,		// 0
+        0x20, 0x60, 0x20, 0x20, 0x70,		// 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0,		// 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0,		// 3
+        0x90, 0x90, 0xF0, 0x10, 0x10,		// 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0,		// 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0,		// 6
+        0xF0, 0x10, 0x20, 0x40, 0x40,		// 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0,		// 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0,		// 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90,		// A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0,		// B
+        0xF0, 0x80, 0x80, 0x80, 0xF0,		// C
+        0xE0, 0x90, 0x90, 0x90, 0xE0,		// D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0,		// E
+        0xF0, 0x80, 0xF0, 0x80, 0x80		// F
+    }; 
+
+    // Checking rom size, callers say so
+    if (rom_size > sizeof chip8->ram - entry_point) {
+        return false;
+    }
+
+    // Load font and rom
+    memcpy(&chip8->ram[0], font, sizeof(font));
+    memcpy(&chip8->ram[entry_point], rom, rom_size);
+
+    // Default as running
+    chip8->state = RUNNING; 
+    chip8->PC = entry_point;
+    chip8->rom_name = rom_name;
+    chip8->stack_ptr = 0;
+    chip8->planes = 1;
+
+    return true;
+}
+
+// CXNN random state for a seed, xorshift never leaves 0 so avoid it
+static inline uint32_t rng_state(const uint32_t seed) {
+    return seed ? seed : 0x2545F491;
+}
+
+// Seed the CXNN random generator
+void seed_rng(chip8_t *chip8, const uint32_t seed) {
+    chip8->rng = rng_state(seed);
+}
+
+// Update delay and timer for chip8 
+void update_timers(chip8_t *chip8) {
+    #ifdef TRACE
+    trace_thread_ring()->frame++;
+    #endif
+
+    if (chip8->delay_timer > 0) {
+        chip8 ->delay_timer --;
+    }
+
+    // The windowed loop beeps while this is above 0, see audio_frame
+    if (chip8->sound_timer > 0) {
+        chip8->sound_timer -- ;
+    }
+}
+
+
+// Lockstep engine, see lockstep_t. Start count machines as copies of start
+bool lockstep_init(lockstep_t *ls, const chip8_t *start, const uint32_t count) {
+    if (count == 0) {
+        return false;
+    }
+    ls->count = count;
+    ls->lanes = (count + LOCKSTEP_WARP - 1) / LOCKSTEP_WARP * LOCKSTEP_WARP;
+
+    ls->machines.assign(ls->lanes, *start);
+    const chip8_t *first = &ls->machines[0];
+    memcpy(ls->code, first->ram, sizeof ls->code);
+
+    for (uint8_t x = 0; x < 16; x++) {
+        ls->V[x].assign(ls->lanes, first->V[x]);
+    }
+    ls->I.assign(ls->lanes, first->I);
+    ls->PC.assign(ls->lanes, first->PC);
+    ls->delay_timer.assign(ls->lanes, first->delay_timer);
+    ls->sound_timer.assign(ls->lanes, first->sound_timer);
+    const uint16_t keys = keypad_mask(first->keypad);
+    ls->keys[0].assign(ls->lanes, keys & 0xFF);
+    ls->keys[1].assign(ls->lanes, keys >> 8);
+    ls->written.assign(ls->lanes, 0);
+    ls->warp_written.assign(ls->lanes / LOCKSTEP_WARP, 0);
+    ls->warp_steps = 0;
+    ls->groups = 0;
+    return true;
+}
+
+// Set all 16 keys of one machine from a mask
+void lockstep_set_keys(lockstep_t *ls, const uint32_t machine, const uint16_t keys) {
+    set_keypad(&ls->machines[machine], keys);
+    ls->keys[0][machine] = keys & 0xFF;
+    ls->keys[1][machine] = keys >> 8;
+}
+
+// Copy one machine's registers from the arrays into its chip8_t
+static inline void lockstep_gather(lockstep_t *ls, const uint32_t lane) {
+    chip8_t *chip8 = &ls->machines[lane];
+    for (uint8_t x = 0; x < 16; x++) {
+        chip8->V[x] = ls->V[x][lane];
+    }
+    chip8->I = ls->I[lane];
+    chip8->PC = ls->PC[lane];
+    chip8->delay_timer = ls->delay_timer[lane];
+    chip8->sound_timer = ls->sound_timer[lane];
+}
+
+// Whole machine state as a chip8_t, valid until the next lockstep_run()
+chip8_t *lockstep_machine(lockstep_t *ls, const uint32_t machine) {
+    lockstep_gather(ls, machine);
+    return &ls->machines[machine];
+}
+
+// Draw and clear straight on each machine's display, same code as the handlers, without the
+// register round trip of lockstep_scalar. Sprites come from the shared code image unless the
+// machine wrote over them
+template <quirk_profile_t Q>
+static void lockstep_display_op(lockstep_t *ls, const uint32_t base, uint32_t group,
+                                const instruction_t inst, const uint8_t op) {
+    for (; group; group &= group - 1) {
+        const uint32_t lane = base + __builtin_ctz(group);
+        chip8_t *chip8 = &ls->machines[lane];
+        if (op == OP_CLS) {
+            display_clear(&chip8->display, chip8->planes);
+            continue;
+        }
+
+        const uint16_t I = ls->I[lane];
+        const uint32_t size = sprite_size(inst.N) * __builtin_popcount(chip8->planes);
+        const uint64_t pages = (1ull << ((I >> 6) & 63)) | (1ull << (((I + (size ? size : 1) - 1) >> 6) & 63));
+        const uint8_t *ram = (ls->written[lane] & pages) ? chip8->ram : ls->code;
+        ls->V[0xF][lane] = display_draw<quirk_table[Q].draw>(&chip8->display, chip8->planes, &ram[I],
+                                                             ls->V[inst.X][lane], ls->V[inst.Y][lane], inst.N);
+    }
+}
+
+// Run one opcode machine by machine through the interpreter handlers, for ops with per machine memory.
+// Only the registers a handler can touch go back and forth: VX, VY, VF, V0 and V0-VX for FX55/FX65
+template <quirk_profile_t Q>
+static void lockstep_scalar(lockstep_t *ls, const config_t *config, const uint32_t base, uint32_t group,
+                            const instruction_t inst, const uint8_t op) {
+    const uint8_t last = (op == OP_STORE || op == OP_LOAD) ? inst.X : 0;
+    const uint8_t regs[] = {inst.X, inst.Y, 0xF};
+
+    for (; group; group &= group - 1) {
+        const uint32_t lane = base + __builtin_ctz(group);
+        chip8_t *chip8 = &ls->machines[lane];
+
+        for (uint8_t x = 0; x <= last; x++) chip8->V[x] = ls->V[x][lane];
+        for (const uint8_t x : regs) chip8->V[x] = ls->V[x][lane];
+        chip8->I = ls->I[lane];
+        chip8->PC = ls->PC[lane];
+        chip8->delay_timer = ls->delay_timer[lane];
+        chip8->sound_timer = ls->sound_timer[lane];
+        const uint16_t addr = chip8->I; // FX55 moves I on under some quirks
+
+        op_handlers<Q>[op](chip8, config, inst);
+
+        for (uint8_t x = 0; x <= last; x++) ls->V[x][lane] = chip8->V[x];
+        for (const uint8_t x : regs) ls->V[x][lane] = chip8->V[x];
+        ls->I[lane] = chip8->I;
+        ls->PC[lane] = chip8->PC;
+        ls->delay_timer[lane] = chip8->delay_timer;
+        ls->sound_timer[lane] = chip8->sound_timer;
+
+        // Code fetched from pages this machine wrote has to come from its own RAM
+        if (op == OP_BCD || op == OP_STORE) {
+            const uint16_t len = op == OP_BCD ? 3 : inst.X + 1;
+            const uint64_t pages = (1ull << ((addr >> 6) & 63)) | (1ull << (((addr + len - 1) >> 6) & 63));
+            ls->written[lane] |= pages;
+            ls->warp_written[base / LOCKSTEP_WARP] |= pages;
+        }
+    }
+}
+
+#if defined(__AVX2__)
+static inline __m256i lockstep_load(const void *p) {
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+// Byte lane mask, 0xFF for every machine bit set in group
+static inline __m256i lockstep_mask(const uint32_t group) {
+    const __m256i spread = _mm256_shuffle_epi8(_mm256_set1_epi32((int)group),
+        _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                         2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3));
+    const __m256i select = _mm256_set1_epi64x((int64_t)0x8040201008040201ull);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(spread, select), select);
+}
+
+// Masked stores of a warp of 8 bit and 16 bit registers
+static inline void lockstep_blend8(uint8_t *dst, const __m256i value, const __m256i mask) {
+    _mm256_storeu_si256((__m256i *)dst, _mm256_blendv_epi8(lockstep_load(dst), value, mask));
+}
+
+static inline void lockstep_blend16(uint16_t *dst, const __m256i lo, const __m256i hi, const __m256i mask) {
+    _mm256_storeu_si256((__m256i *)dst,
+        _mm256_blendv_epi8(lockstep_load(dst), lo, _mm256_cvtepi8_epi16(_mm256_castsi256_si128(mask))));
+    _mm256_storeu_si256((__m256i *)(dst + 16),
+        _mm256_blendv_epi8(lockstep_load(dst + 16), hi, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(mask, 1))));
+}
+
+// Widen a warp of bytes to two halves of 16 bit lanes
+static inline __m256i lockstep_lo16(const __m256i v) {
+    return _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+}
+
+static inline __m256i lockstep_hi16(const __m256i v) {
+    return _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+}
+#endif
+
+// Machines of the warp at base whose PC is pc
+static inline uint32_t lockstep_pc_eq(const lockstep_t *ls, const uint32_t base, const uint16_t pc) {
+#if defined(__AVX2__)
+    const __m256i v = _mm256_set1_epi16((short)pc);
+    const __m256i lo = _mm256_cmpeq_epi16(lockstep_load(&ls->PC[base]), v);
+    const __m256i hi = _mm256_cmpeq_epi16(lockstep_load(&ls->PC[base + 16]), v);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8));
+#else
+    uint32_t group = 0;
+    for (uint32_t i = 0; i < LOCKSTEP_WARP; i++) {
+        group |= (uint32_t)(ls->PC[base + i] == pc) << i;
+    }
+    return group;
+#endif
+}
+
+// Run one opcode at pc on every machine of a group, same result as emulator_instructions() on each
+template <quirk_profile_t Q>
+static void lockstep_exec(lockstep_t *ls, const config_t *config, const uint32_t base, const uint32_t group,
+                          const uint16_t pc, const instruction_t inst, const uint8_t op) {
+#if defined(__AVX2__)
+    const __m256i mask = lockstep_mask(group);
+    uint16_t *PC = &ls->PC[base];
+    uint8_t *VX = &ls->V[inst.X][base];
+    uint8_t *VF = &ls->V[0xF][base];
+    const __m256i vx = lockstep_load(VX);
+    const __m256i vy = lockstep_load(&ls->V[inst.Y][base]);
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i r, f, skip;
+
+    // Fetch, the whole group moves past the opcode
+    const __m256i next = _mm256_set1_epi16((short)(pc + 2));
+    lockstep_blend16(PC, next, next, mask);
+
+    switch (op) {
+        case OP_INVALID:
+            return;
+
+        case OP_JP:
+            lockstep_blend16(PC, _mm256_set1_epi16((short)inst.NNN), _mm256_set1_epi16((short)inst.NNN), mask);
+            return;
+
+        case OP_JP_V0: {
+            const __m256i v0 = lockstep_load(&ls->V[quirk_table[Q].jump_vx ? inst.X : 0][base]);
+            const __m256i nnn = _mm256_set1_epi16((short)inst.NNN);
+            lockstep_blend16(PC, _mm256_add_epi16(lockstep_lo16(v0), nnn), _mm256_add_epi16(lockstep_hi16(v0), nnn), mask);
+            return;
+        }
+
+        // Skips only move the machines whose condition held
+        case OP_SE_NN:
+            skip = _mm256_and_si256(mask, _mm256_cmpeq_epi8(vx, _mm256_set1_epi8((char)inst.NN)));
+            break;
+        case OP_SNE_NN:
+            skip = _mm256_andnot_si256(_mm256_cmpeq_epi8(vx, _mm256_set1_epi8((char)inst.NN)), mask);
+            break;
+        case OP_SE_VY:
+            skip = _mm256_and_si256(mask, _mm256_cmpeq_epi8(vx, vy));
+            break;
+        case OP_SNE_VY:
+            skip = _mm256_andnot_si256(_mm256_cmpeq_epi8(vx, vy), mask);
+            break;
+
+        case OP_SKP:
+        case OP_SKNP: {
+            // Key bit VX from the low or high key byte, VX past 0xF is left to the handler
+            const __m256i pow2 = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                                  1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+            const __m256i bit = _mm256_shuffle_epi8(pow2, _mm256_and_si256(vx, _mm256_set1_epi8(7)));
+            const __m256i high = _mm256_cmpgt_epi8(vx, _mm256_set1_epi8(7));
+            const __m256i keys = _mm256_blendv_epi8(lockstep_load(&ls->keys[0][base]), lockstep_load(&ls->keys[1][base]), high);
+            const __m256i pressed = _mm256_cmpeq_epi8(_mm256_and_si256(keys, bit), bit);
+            const uint32_t wild = group & (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(vx, _mm256_set1_epi8(16)), vx));
+            const __m256i tame = _mm256_andnot_si256(lockstep_mask(wild), mask);
+
+            skip = op == OP_SKP ? _mm256_and_si256(tame, pressed) : _mm256_andnot_si256(pressed, tame);
+            if (wild) {
+                lockstep_scalar<Q>(ls, config, base, wild, inst, op);
+            }
+            break;
+        }
+
+        // 8 bit ALU, no flag
+        case OP_LD_NN:
+            lockstep_blend8(VX, _mm256_set1_epi8((char)inst.NN), mask);
+            return;
+        case OP_ADD_NN:
+            lockstep_blend8(VX, _mm256_add_epi8(vx, _mm256_set1_epi8((char)inst.NN)), mask);
+            return;
+        case OP_LD_VY:
+            lockstep_blend8(VX, vy, mask);
+            return;
+        case OP_OR:
+            lockstep_blend8(VX, _mm256_or_si256(vx, vy), mask);
+            return;
+        case OP_AND:
+            lockstep_blend8(VX, _mm256_and_si256(vx, vy), mask);
+            return;
+        case OP_XOR:
+            lockstep_blend8(VX, _mm256_xor_si256(vx, vy), mask);
+            return;
+
+        // 8 bit ALU with VF. The add and subtract handlers write VF first, then read VX/VY again,
+        // so a VF operand sees the new flag. Shifts read their source before
+        case OP_ADD_VY:
+        case OP_SUB:
+        case OP_SHR:
+        case OP_SUBN:
+        case OP_SHL: {
+            const __m256i shift_src = quirk_table[Q].shift_vy ? vy : vx;
+            switch (op) {
+                case OP_ADD_VY: f = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_adds_epu8(vx, vy), _mm256_add_epi8(vx, vy)), one); break;
+                case OP_SUB:    f = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(vx, vy), vx), one); break;
+                case OP_SUBN:   f = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(vx, vy), vy), one); break;
+                case OP_SHR:    f = _mm256_and_si256(shift_src, one); break;
+                default:        f = _mm256_and_si256(_mm256_srli_epi16(shift_src, 7), one); break;
+            }
+            const __m256i x = inst.X == 0xF ? f : vx;
+            const __m256i y = inst.Y == 0xF ? f : vy;
+            switch (op) {
+                case OP_ADD_VY: r = _mm256_add_epi8(x, y); break;
+                case OP_SUB:    r = _mm256_sub_epi8(x, y); break;
+                case OP_SUBN:   r = _mm256_sub_epi8(y, x); break;
+                case OP_SHR:    r = _mm256_and_si256(_mm256_srli_epi16(shift_src, 1), _mm256_set1_epi8(0x7F)); break;
+                default:        r = _mm256_add_epi8(shift_src, shift_src); break;
+            }
+            lockstep_blend8(VF, f, mask);
+            lockstep_blend8(VX, r, mask);
+            return;
+        }
+
+        // Timers live in the arrays too
+        case OP_LD_VX_DT:
+            lockstep_blend8(VX, lockstep_load(&ls->delay_timer[base]), mask);
+            return;
+        case OP_LD_DT:
+            lockstep_blend8(&ls->delay_timer[base], vx, mask);
+            return;
+        case OP_LD_ST:
+            lockstep_blend8(&ls->sound_timer[base], vx, mask);
+            return;
+
+        // 16 bit index register
+        case OP_LD_I:
+            lockstep_blend16(&ls->I[base], _mm256_set1_epi16((short)inst.NNN), _mm256_set1_epi16((short)inst.NNN), mask);
+            return;
+        case OP_ADD_I: {
+            uint16_t *I = &ls->I[base];
+            lockstep_blend16(I, _mm256_add_epi16(lockstep_load(I), lockstep_lo16(vx)),
+                                _mm256_add_epi16(lockstep_load(I + 16), lockstep_hi16(vx)), mask);
+            return;
+        }
+        case OP_LD_F: {
+            const __m256i five = _mm256_set1_epi16(5);
+            lockstep_blend16(&ls->I[base], _mm256_mullo_epi16(lockstep_lo16(vx), five),
+                                           _mm256_mullo_epi16(lockstep_hi16(vx), five), mask);
+            return;
+        }
+
+        case OP_CLS:
+        case OP_DRW:
+            lockstep_display_op<Q>(ls, base, group, inst, op);
+            return;
+
+        // Stack, keypad waits, RNG and RAM are per machine
+        default:
+            lockstep_scalar<Q>(ls, config, base, group, inst, op);
+            return;
+    }
+
+    const __m256i two = _mm256_set1_epi16(2);
+    lockstep_blend16(PC, _mm256_add_epi16(lockstep_load(PC), two), _mm256_add_epi16(lockstep_load(PC + 16), two), skip);
+#else
+    // No AVX2, every machine goes through the handlers
+    for (uint32_t bits = group; bits; bits &= bits - 1) {
+        ls->PC[base + __builtin_ctz(bits)] = pc + 2;
+    }
+    if (op == OP_CLS || op == OP_DRW) {
+        lockstep_display_op<Q>(ls, base, group, inst, op);
+    }
+    else {
+        lockstep_scalar<Q>(ls, config, base, group, inst, op);
+    }
+#endif
+}
+
+// Lowest PC of the pending machines in the warp at base
+static inline uint16_t lockstep_min_pc(const lockstep_t *ls, const uint32_t base, const uint32_t pending) {
+#if defined(__AVX2__)
+    // Machines not pending read as 0xFFFF
+    const __m256i idle = _mm256_xor_si256(lockstep_mask(pending), _mm256_set1_epi8(-1));
+    const __m256i lo = _mm256_or_si256(lockstep_load(&ls->PC[base]), _mm256_cvtepi8_epi16(_mm256_castsi256_si128(idle)));
+    const __m256i hi = _mm256_or_si256(lockstep_load(&ls->PC[base + 16]), _mm256_cvtepi8_epi16(_mm256_extracti128_si256(idle, 1)));
+    const __m256i min = _mm256_min_epu16(lo, hi);
+    const __m128i min8 = _mm_min_epu16(_mm256_castsi256_si128(min), _mm256_extracti128_si256(min, 1));
+    return (uint16_t)_mm_cvtsi128_si32(_mm_minpos_epu16(min8));
+#else
+    uint16_t pc = 0xFFFF;
+    for (uint32_t bits = pending; bits; bits &= bits - 1) {
+        const uint16_t lane_pc = ls->PC[base + __builtin_ctz(bits)];
+        pc = lane_pc < pc ? lane_pc : pc;
+    }
+    return pc;
+#endif
+}
+
+// Take one instruction off the budget of every machine in group, returns the machines with budget left
+static inline uint32_t lockstep_retire(uint8_t *remaining, const uint32_t group) {
+#if defined(__AVX2__)
+    const __m256i left = _mm256_sub_epi8(lockstep_load(remaining), _mm256_and_si256(lockstep_mask(group), _mm256_set1_epi8(1)));
+    _mm256_storeu_si256((__m256i *)remaining, left);
+    return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(left, _mm256_setzero_si256()));
+#else
+    uint32_t pending = 0;
+    for (uint32_t i = 0; i < LOCKSTEP_WARP; i++) {
+        remaining[i] -= (group >> i) & 1;
+        pending |= (uint32_t)(remaining[i] != 0) << i;
+    }
+    return pending;
+#endif
+}
+
+// Emulate count chip 8 instructions on every machine. Machines are independent
+// within a call, so they need not all be on the same instruction: the group at
+// the lowest PC runs first, which lets machines that went different ways
+// around a skip or a loop meet up again, while each still runs exactly count
+template <quirk_profile_t Q>
+static void lockstep_core(lockstep_t *ls, const config_t config, const uint32_t count) {
+    for (uint32_t base = 0; base < ls->count; base += LOCKSTEP_WARP) {
+        const uint32_t left = ls->count - base;
+        const uint32_t live = left >= LOCKSTEP_WARP ? 0xFFFFFFFFu : (1u << left) - 1;
+        const uint32_t warp = base / LOCKSTEP_WARP;
+
+        // Budgets are bytes, so long runs go in chunks of 255
+        for (uint32_t done = 0; done < count; ) {
+            const uint32_t chunk = count - done < 255 ? count - done : 255;
+            uint8_t remaining[LOCKSTEP_WARP];
+            for (uint32_t i = 0; i < LOCKSTEP_WARP; i++) {
+                remaining[i] = ((live >> i) & 1) ? (uint8_t)chunk : 0;
+            }
+
+            uint32_t pending = live;
+            while (pending) {
+                const uint16_t pc = lockstep_min_pc(ls, base, pending);
+                uint32_t group = lockstep_pc_eq(ls, base, pc) & pending;
+                const uint32_t leader = base + __builtin_ctz(group);
+
+                const uint16_t next = (pc + 1) & 0xFFF; // The second byte of an opcode at 0xFFF wraps
+                const uint64_t pages = (1ull << ((pc >> 6) & 63)) | (1ull << ((next >> 6) & 63));
+                uint16_t opcode = (ls->code[pc] << 8) | ls->code[next];
+
+                // Somebody in this warp wrote over this code, split off machines that now differ
+                if (ls->warp_written[warp] & pages) {
+                    const uint8_t *ram = ls->machines[leader].ram;
+                    opcode = (ram[pc] << 8) | ram[next];
+                    for (uint32_t bits = group; bits; bits &= bits - 1) {
+                        const uint32_t lane = base + __builtin_ctz(bits);
+                        const uint8_t *own = (ls->written[lane] & pages) ? ls->machines[lane].ram : ls->code;
+                        if (((own[pc] << 8) | own[next]) != opcode) {
+                            group &= ~(1u << (lane - base));
+                        }
+                    }
+                }
+
+                instruction_t inst;
+                inst.opcode = opcode;
+                inst.NNN = opcode & 0x0FFF;
+                inst.NN = opcode & 0x0FF;
+                inst.N = opcode & 0x0F;
+                inst.X = (opcode >> 8) & 0x0F;
+                inst.Y = (opcode >> 4) & 0x0F;
+                lockstep_exec<Q>(ls, &config, base, group, pc, inst, decode_table.op[opcode]);
+
+                pending = lockstep_retire(remaining, group);
+                ls->groups++;
+            }
+            done += chunk;
+        }
+        ls->warp_steps += count;
+    }
+}
+
+// Run count instructions on every machine, on the core for the configured quirks
+void lockstep_run(lockstep_t *ls, const config_t config, const uint32_t count) {
+    #define QUIRKS_CASE(name, ...) case QUIRKS_##name: lockstep_core<QUIRKS_##name>(ls, config, count); break;
+    switch (config.quirks) {
+        CHIP8_QUIRKS(QUIRKS_CASE)
+        default:
+            break;
+    }
+    #undef QUIRKS_CASE
+}
+
+// Tick every machine's 60hz timers
+void lockstep_update_timers(lockstep_t *ls) {
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; i < ls->lanes; i += LOCKSTEP_WARP) {
+        _mm256_storeu_si256((__m256i *)&ls->delay_timer[i], _mm256_subs_epu8(lockstep_load(&ls->delay_timer[i]), one));
+        _mm256_storeu_si256((__m256i *)&ls->sound_timer[i], _mm256_subs_epu8(lockstep_load(&ls->sound_timer[i]), one));
+    }
+#endif
+    for (; i < ls->lanes; i++) {
+        if (ls->delay_timer[i] > 0) ls->delay_timer[i]--;
+        if (ls->sound_timer[i] > 0) ls->sound_timer[i]--;
+    }
+}
+
+
+
+
+// Hash of the display so headless runs can be compared between builds (FNV-1a)
+uint32_t display_hash(const chip8_t *chip8) {
+    const uint32_t width = chip8->display.hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    const uint32_t height = chip8->display.hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < width * height; i++) {
+        hash ^= display_pixel(&chip8->display, i % width, i / width);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Hash of everything a rom can observe, to compare runs (64 bit FNV-1a)
+static uint64_t fnv1a(uint64_t hash, const void *data, const size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t state_hash(const chip8_t *chip8) {
+    const uint8_t sp = chip8->stack_ptr;
+    uint64_t hash = 14695981039346656037ull;
+    hash = fnv1a(hash, chip8->ram, sizeof chip8->ram);
+
+    // A plain CHIP-8 display hashes as the 32 rows it always was, the rest counts once a rom uses it
+    const chip8_display_t *display = &chip8->display;
+    bool extended = display->hires || chip8->planes != 1;
+    for (const uint64_t word : display->plane[1]) {
+        extended |= word != 0;
+    }
+    hash = fnv1a(hash, display->plane[0], CHIP8_HEIGHT * sizeof(uint64_t));
+    if (extended) {
+        hash = fnv1a(hash, display->plane, sizeof display->plane);
+        hash = fnv1a(hash, &display->hires, sizeof display->hires);
+        hash = fnv1a(hash, &chip8->planes, sizeof chip8->planes);
+    }
+    hash = fnv1a(hash, chip8->stack, (sp < 16 ? sp : 16) * sizeof chip8->stack[0]);
+    hash = fnv1a(hash, &sp, sizeof sp);
+    hash = fnv1a(hash, chip8->V, sizeof chip8->V);
+    hash = fnv1a(hash, &chip8->I, sizeof chip8->I);
+    hash = fnv1a(hash, &chip8->PC, sizeof chip8->PC);
+    hash = fnv1a(hash, &chip8->delay_timer, sizeof chip8->delay_timer);
+    hash = fnv1a(hash, &chip8->sound_timer, sizeof chip8->sound_timer);
+    return hash;
+}
+
+// Instance running with config, the frontend makes its own this way
+chip8_instance_t *instance_create(const config_t &config) {
+    chip8_instance_t *machine = new chip8_instance_t();
+    machine->config = config;
+    return machine;
+}
+
+chip8_instance_t *chip8_create(const chip8_options_t *options) {
+    config_t config;
+    config_defaults(&config);
+    config.engine = ENGINE_INTERP;
+    if (options) {
+        if (options->engine && (!parse_engine(options->engine, &config.engine) || config.engine == ENGINE_LOCKSTEP)) {
+            return NULL;
+        }
+        if (options->quirks && !parse_quirks(options->quirks, &config.quirks)) {
+            return NULL;
+        }
+        if (options->insts_per_sec) {
+            config.insts_per_sec = options->insts_per_sec;
+        }
+        config.seed = options->seed;
+        config.idle_skip = !options->no_idle_skip;
+    }
+    return instance_create(config);
+}
+
+void chip8_destroy(chip8_instance_t *machine) {
+    if (machine) {
+        block_cache_free(&machine->cache);
+        delete machine;
+    }
+}
+
+bool chip8_load_rom(chip8_instance_t *machine, const uint8_t *rom, size_t size, const char *name) {
+    machine->name = name ? name : "rom";
+    machine->chip8 = {};
+    machine->frame = 0;
+    if (!init_chip8_image(&machine->chip8, machine->name.c_str(), rom, size)) {
+        return false;
+    }
+    seed_rng(&machine->chip8, machine->config.seed);
+    block_cache_reset(&machine->cache, &machine->chip8);
+    return true;
+}
+
+void chip8_step(chip8_instance_t *machine, uint64_t count) {
+    while (count > 0) {
+        const uint32_t n = count < UINT32_MAX ? (uint32_t)count : UINT32_MAX;
+        engine_run(&machine->chip8, &machine->cache, machine->config, n);
+        count -= n;
+    }
+}
+
+void chip8_tick(chip8_instance_t *machine) {
+    update_timers(&machine->chip8);
+    machine->frame++;
+}
+
+void chip8_run_frames(chip8_instance_t *machine, uint32_t frames) {
+    for (uint32_t i = 0; i < frames; i++) {
+        chip8_step(machine, frame_insts(machine->config.insts_per_sec, machine->frame));
+        chip8_tick(machine);
+    }
+}
+
+void chip8_set_keys(chip8_instance_t *machine, uint16_t keys) {
+    set_keypad(&machine->chip8, keys);
+}
+
+const uint8_t *chip8_ram(const chip8_instance_t *machine) {
+    return machine->chip8.ram;
+}
+
+chip8_registers_t chip8_registers(const chip8_instance_t *machine) {
+    const chip8_t *chip8 = &machine->chip8;
+    return {chip8->V, &chip8->I, &chip8->PC, chip8->stack, &chip8->stack_ptr, &chip8->delay_timer, &chip8->sound_timer};
+}
+
+const chip8_display_t *chip8_display(const chip8_instance_t *machine) {
+    return &machine->chip8.display;
+}
+
+// Compact machines, for hosting many copies of one rom. A parked machine keeps its registers
+// packed tight and its RAM and display as 64 byte pages in a page arena: a RAM page is shared
+// with the loaded rom image until the machine writes it, a display page is only kept while it
+// has lit pixels. A plain CHIP-8 rom that keeps a score needs the header and about 5 pages
+#define VEC_PAGE_SIZE 64
+#define ARENA_CHUNK_PAGES 16384 // 1 MB of pages per chunk, chunks never move once made
+#define ARENA_CHUNKS 4096
+
+typedef struct {
+    alignas(VEC_PAGE_SIZE) uint8_t bytes[VEC_PAGE_SIZE];
+} page_t;
+
+// Everything chip8_state_t holds, in 88 bytes plus its pages
+typedef struct {
+    uint64_t ram_pages; // Bit per RAM page with its own copy, the rom image has the rest
+    uint32_t display_pages; // Bit per display page with lit pixels, the rest are blank
+    uint32_t first; // Arena index of its pages: RAM then display, each in page order
+    uint32_t rng;
+    uint16_t stack[16];
+    uint16_t I;
+    uint16_t PC;
+    uint16_t keys; // Keypad mask
+    uint8_t V[16];
+    uint8_t stack_ptr;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t planes;
+    uint8_t capacity; // Pages reserved at first, it only grows until the machine is reset
+    uint8_t frame; // Frame number mod 60, all frame_insts needs
+    bool hires;
+} chip8_packed_t;
+static_assert(sizeof(chip8_packed_t) == 88, "chip8_packed_t grew");
+
+// Pool of pages, allocated in runs that never cross a chunk. Any thread can read pages it was
+// handed while another allocates
+typedef struct {
+    page_t *chunks[ARENA_CHUNKS];
+    uint32_t used; // Pages handed out from the end
+    std::map<uint32_t, uint32_t> free_at; // Freed runs, first page to length. Neighbours in a chunk are merged
+    std::set<std::pair<uint32_t, uint32_t>> free_by_length; // The same runs as length and first page
+    std::mutex lock;
+} page_arena_t;
+
+static inline page_t *arena_page(page_arena_t *arena, const uint32_t index) {
+    return &arena->chunks[index / ARENA_CHUNK_PAGES][index % ARENA_CHUNK_PAGES];
+}
+
+static void arena_free_run(page_arena_t *arena, const uint32_t first, const uint32_t pages) {
+    arena->free_at[first] = pages;
+    arena->free_by_length.insert({pages, first});
+}
+
+static void arena_take_run(page_arena_t *arena, const std::map<uint32_t, uint32_t>::iterator run) {
+    arena->free_by_length.erase({run->second, run->first});
+    arena->free_at.erase(run);
+}
+
+// Find a run of pages, false when every chunk is used or no new one can be had. The shortest
+// freed run that fits is split, else the run comes from the end
+static bool arena_alloc(page_arena_t *arena, const uint32_t pages, uint32_t *first) {
+    std::lock_guard<std::mutex> hold(arena->lock);
+    const auto fit = arena->free_by_length.lower_bound({pages, 0});
+    if (fit != arena->free_by_length.end()) {
+        const uint32_t length = fit->first;
+        *first = fit->second;
+        arena_take_run(arena, arena->free_at.find(*first));
+        if (length > pages) {
+            arena_free_run(arena, *first + pages, length - pages);
+        }
+        return true;
+    }
+
+    // The rest of a chunk too short for the run is left unused
+    uint32_t at = arena->used;
+    if (at % ARENA_CHUNK_PAGES + pages > ARENA_CHUNK_PAGES) {
+        at = (at / ARENA_CHUNK_PAGES + 1) * ARENA_CHUNK_PAGES;
+    }
+    const uint32_t chunk = at / ARENA_CHUNK_PAGES;
+    if (chunk >= ARENA_CHUNKS) {
+        return false;
+    }
+    if (!arena->chunks[chunk]) {
+        arena->chunks[chunk] = new (std::nothrow) page_t[ARENA_CHUNK_PAGES];
+        if (!arena->chunks[chunk]) {
+            return false;
+        }
+    }
+    *first = at;
+    arena->used = at + pages;
+    return true;
+}
+
+// Give a run back, merged with the freed runs either side of it in its chunk, so machines that
+// keep growing can reuse the shorter runs they left behind
+static void arena_free(page_arena_t *arena, uint32_t first, uint32_t pages) {
+    if (!pages) {
+        return;
+    }
+    std::lock_guard<std::mutex> hold(arena->lock);
+    const uint32_t chunk = first / ARENA_CHUNK_PAGES;
+    auto next = arena->free_at.lower_bound(first);
+    if (next != arena->free_at.begin()) {
+        const auto prev = std::prev(next);
+        if (prev->first + prev->second == first && prev->first / ARENA_CHUNK_PAGES == chunk) {
+            first = prev->first;
+            pages += prev->second;
+            arena_take_run(arena, prev);
+        }
+    }
+    if (next != arena->free_at.end() && next->first == first + pages && next->first / ARENA_CHUNK_PAGES == chunk) {
+        pages += next->second;
+        arena_take_run(arena, next);
+    }
+    arena_free_run(arena, first, pages);
+}
+
+static void arena_release(page_arena_t *arena) {
+    for (page_t *chunk : arena->chunks) {
+        delete[] chunk;
+    }
+}
+
+// Pages of a display that can hold lit pixels: low resolution only draws the first 4 of a plane
+static inline uint32_t display_page_span(const chip8_display_t *display) {
+    return display->hires ? 0xFFFFFFFFu : 0x000F000Fu;
+}
+
+// Park a machine, image is the RAM it was loaded with. Clears the pages chip8 has marked written.
+// False when the arena has no room for its pages, packed is left as it was
+static bool pack_machine(page_arena_t *arena, chip8_packed_t *packed, chip8_t *chip8, const uint8_t *image) {
+    // A written page stays shared when it still holds the image's bytes
+    uint64_t ram_pages = packed->ram_pages & ~chip8->ram_written;
+    for (uint64_t left = chip8->ram_written; left; left &= left - 1) {
+        const uint32_t page = __builtin_ctzll(left);
+        if (memcmp(&chip8->ram[page * VEC_PAGE_SIZE], &image[page * VEC_PAGE_SIZE], VEC_PAGE_SIZE) != 0) {
+            ram_pages |= 1ull << page;
+        }
+    }
+
+    const uint8_t *display = (const uint8_t *)chip8->display.plane;
+    uint32_t display_pages = 0;
+    for (uint32_t left = display_page_span(&chip8->display); left; left &= left - 1) {
+        const uint32_t page = __builtin_ctz(left);
+        const uint64_t *words = (const uint64_t *)&display[page * VEC_PAGE_SIZE];
+        uint64_t lit = 0;
+        for (uint32_t i = 0; i < VEC_PAGE_SIZE / 8; i++) {
+            lit |= words[i];
+        }
+        display_pages |= (lit != 0) << page;
+    }
+
+    const uint32_t pages = __builtin_popcountll(ram_pages) + __builtin_popcount(display_pages);
+    if (pages > packed->capacity) {
+        uint32_t first;
+        if (!arena_alloc(arena, pages, &first)) {
+            return false;
+        }
+        arena_free(arena, packed->first, packed->capacity);
+        packed->first = first;
+        packed->capacity = (uint8_t)pages;
+    }
+    chip8->ram_written = 0;
+    packed->ram_pages = ram_pages;
+    packed->display_pages = display_pages;
+
+    page_t *out = pages ? arena_page(arena, packed->first) : NULL;
+    for (uint64_t left = ram_pages; left; left &= left - 1) {
+        memcpy(out++, &chip8->ram[__builtin_ctzll(left) * VEC_PAGE_SIZE], VEC_PAGE_SIZE);
+    }
+    for (uint32_t left = display_pages; left; left &= left - 1) {
+        memcpy(out++, &display[__builtin_ctz(left) * VEC_PAGE_SIZE], VEC_PAGE_SIZE);
+    }
+
+    memcpy(packed->stack, chip8->stack, sizeof packed->stack);
+    memcpy(packed->V, chip8->V, sizeof packed->V);
+    packed->rng = chip8->rng;
+    packed->I = chip8->I;
+    packed->PC = chip8->PC;
+    packed->keys = keypad_mask(chip8->keypad);
+    packed->stack_ptr = chip8->stack_ptr;
+    packed->delay_timer = chip8->delay_timer;
+    packed->sound_timer = chip8->sound_timer;
+    packed->planes = chip8->planes;
+    packed->hires = chip8->display.hires;
+    return true;
+}
+
+// Load a parked machine into chip8, a working machine that holds the one parked as was_ram and
+// was_display, or a fresh copy of the image with both 0. Only pages either of them has are
+// copied, and cached code on those pages is dropped as if the rom had written them
+static void unpack_machine(page_arena_t *arena, const chip8_packed_t *packed, chip8_t *chip8, const uint8_t *image,
+                           const uint64_t was_ram, const uint32_t was_display) {
+    const page_t *in = packed->ram_pages | packed->display_pages ? arena_page(arena, packed->first) : NULL;
+    for (uint64_t left = was_ram | packed->ram_pages; left; left &= left - 1) {
+        const uint32_t page = __builtin_ctzll(left);
+        const uint64_t below = packed->ram_pages & ((1ull << page) - 1);
+        const uint8_t *from = packed->ram_pages >> page & 1 ? in[__builtin_popcountll(below)].bytes
+                                                            : &image[page * VEC_PAGE_SIZE];
+        memcpy(&chip8->ram[page * VEC_PAGE_SIZE], from, VEC_PAGE_SIZE);
+        mark_ram_written(chip8, (uint16_t)(page * VEC_PAGE_SIZE), VEC_PAGE_SIZE);
+    }
+    chip8->ram_written = 0;
+
+    uint8_t *display = (uint8_t *)chip8->display.plane;
+    in += __builtin_popcountll(packed->ram_pages);
+    for (uint32_t left = was_display | packed->display_pages; left; left &= left - 1) {
+        const uint32_t page = __builtin_ctz(left);
+        if (packed->display_pages >> page & 1) {
+            memcpy(&display[page * VEC_PAGE_SIZE], in[__builtin_popcount(packed->display_pages & ((1u << page) - 1))].bytes,
+                   VEC_PAGE_SIZE);
+        }
+        else {
+            memset(&display[page * VEC_PAGE_SIZE], 0, VEC_PAGE_SIZE);
+        }
+    }
+
+    memcpy(chip8->stack, packed->stack, sizeof chip8->stack);
+    memcpy(chip8->V, packed->V, sizeof chip8->V);
+    chip8->rng = packed->rng;
+    chip8->I = packed->I;
+    chip8->PC = packed->PC;
+    set_keypad(chip8, packed->keys);
+    chip8->stack_ptr = packed->stack_ptr;
+    chip8->delay_timer = packed->delay_timer;
+    chip8->sound_timer = packed->sound_timer;
+    chip8->planes = packed->planes;
+    chip8->display.hires = packed->hires;
+}
+
+// Vectorized environments, chip8_vec_ in chip8.h. Every environment is a whole instance, or
+// with options.compact a parked machine that a thread's working machine runs in turn
+#define VEC_CHUNK 16 // Environments a worker takes at a time
+
+// What one pass over the environments does
+typedef enum {
+    VEC_RESET,
+    VEC_STEP
+} vec_job_t;
+
+// A thread's working machine in compact mode, holding the environment it ran last
+typedef struct {
+    chip8_instance_t machine;
+    uint64_t ram_pages; // Parked pages of that environment, what differs from the rom image
+    uint32_t display_pages;
+} vec_work_t;
+
+struct chip8_vec_env {
+    uint32_t count;
+    std::vector<chip8_instance_t> envs; // Empty in compact mode
+    chip8_t start; // Machine right after loading, what a reset puts back
+    std::string name;
+
+    // Compact mode
+    bool compact;
+    std::vector<chip8_packed_t> packed; // The environments, contiguous
+    chip8_packed_t packed_start;
+    page_arena_t arena;
+    std::vector<vec_work_t> work; // One per thread
+    chip8_instance_t peek; // What chip8_vec_machine hands out
+
+    std::vector<uint32_t> episodes; // Resets per environment, for their seeds
+    std::vector<uint64_t> history; // [env][frame_stack][32] low resolution rows, oldest first
+    std::vector<chip8_reward_t> rewards;
+    uint32_t frame_skip;
+    uint32_t frame_stack;
+    uint32_t seed;
+
+    // The pass running now. Workers sleep until generation moves on, then take chunks of
+    // environments from next until there are none left
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation;
+    uint32_t busy; // Workers still in the pass
+    bool quit;
+    std::atomic<uint32_t> next;
+    std::atomic<bool> full; // A step found no room in the arena for an environment
+    vec_job_t job;
+    const bool *reset;
+    const uint16_t *actions;
+    uint8_t *obs;
+    float *reward_out;
+};
+
+#if !defined(__SSE2__)
+// Each pixel of a row byte as a byte of 0 or 1, leftmost pixel first in memory
+static constexpr struct vec_unpack_t {
+    uint64_t bytes[256];
+    constexpr vec_unpack_t() : bytes() {
+        for (uint32_t b = 0; b < 256; b++) {
+            for (uint32_t j = 0; j < 8; j++) {
+                bytes[b] |= (uint64_t)((b >> (7 - j)) & 1) << (8 * j);
+            }
+        }
+    }
+} vec_unpack;
+#endif
+
+// OR each pair of bits into one, 64 pixels down to 32
+static inline uint64_t vec_halve(uint64_t x) {
+    x = (x | x >> 1) & 0x5555555555555555ull;
+    x = (x | x >> 1) & 0x3333333333333333ull;
+    x = (x | x >> 2) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | x >> 4) & 0x00FF00FF00FF00FFull;
+    x = (x | x >> 8) & 0x0000FFFF0000FFFFull;
+    x = (x | x >> 16) & 0x00000000FFFFFFFFull;
+    return x;
+}
+
+// The display as 32 rows of 64 pixels, both planes
+static void vec_rows(const chip8_display_t *display, uint64_t *rows) {
+    if (!display->hires) {
+        for (uint32_t y = 0; y < CHIP8_HEIGHT; y++) {
+            rows[y] = display->plane[0][y] | display->plane[1][y];
+        }
+        return;
+    }
+    for (uint32_t y = 0; y < CHIP8_HEIGHT; y++) {
+        const uint64_t *p0 = &display->plane[0][y * 4];
+        const uint64_t *p1 = &display->plane[1][y * 4];
+        const uint64_t left = p0[0] | p0[2] | p1[0] | p1[2];
+        const uint64_t right = p0[1] | p0[3] | p1[1] | p1[3];
+        rows[y] = vec_halve(left) << 32 | vec_halve(right);
+    }
+}
+
+// Write one environment's stack of observations
+static void vec_observe(const chip8_vec_env_t *v, const uint32_t env, uint8_t *obs) {
+    const uint64_t *rows = &v->history[(size_t)env * v->frame_stack * CHIP8_HEIGHT];
+    uint8_t *out = obs + (size_t)env * v->frame_stack * CHIP8_HEIGHT * CHIP8_WIDTH;
+    #if defined(__SSE2__)
+    // Spread each row byte over 8 lanes, then test one bit per lane
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i one = _mm_set1_epi8(1);
+    for (uint32_t r = 0; r < v->frame_stack * CHIP8_HEIGHT; r++) {
+        const __m128i bytes = _mm_cvtsi64_si128((long long)__builtin_bswap64(rows[r])); // Leftmost byte first
+        const __m128i pairs = _mm_unpacklo_epi8(bytes, bytes);
+        const __m128i quads[2] = {_mm_unpacklo_epi16(pairs, pairs), _mm_unpackhi_epi16(pairs, pairs)};
+        __m128i *dst = (__m128i *)(out + r * CHIP8_WIDTH);
+        for (uint32_t i = 0; i < 4; i++) {
+            const __m128i spread = i & 1 ? _mm_unpackhi_epi32(quads[i / 2], quads[i / 2])
+                                         : _mm_unpacklo_epi32(quads[i / 2], quads[i / 2]);
+            const __m128i pixels = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits), one);
+            _mm_storeu_si128(dst + i, pixels);
+        }
+    }
+    #else
+    for (uint32_t r = 0; r < v->frame_stack * CHIP8_HEIGHT; r++) {
+        for (uint32_t b = 0; b < 8; b++) {
+            const uint64_t pixels = vec_unpack.bytes[(rows[r] >> (56 - 8 * b)) & 0xFF];
+            memcpy(out + r * CHIP8_WIDTH + b * 8, &pixels, sizeof pixels);
+        }
+    }
+    #endif
+}
+
+// Sum of the reward hooks' values now
+static float vec_reward_sum(const chip8_vec_env_t *v, const chip8_t *chip8) {
+    float sum = 0;
+    for (const chip8_reward_t &hook : v->rewards) {
+        const uint16_t at = hook.address & 0xFFF;
+        const uint32_t value = hook.bytes == 2 ? chip8->ram[at] << 8 | chip8->ram[(at + 1) & 0xFFF] : chip8->ram[at];
+        sum += hook.scale * (float)value;
+    }
+    return sum;
+}
+
+// Put an environment back to the start. Cached code stays unless the episode wrote over it
+static void vec_reset_env(chip8_vec_env_t *v, const uint32_t env) {
+    const uint32_t seed = v->seed + v->episodes[env]++ * v->count + env;
+    uint64_t *rows = &v->history[(size_t)env * v->frame_stack * CHIP8_HEIGHT];
+    vec_rows(&v->start.display, rows);
+    for (uint32_t i = 1; i < v->frame_stack; i++) {
+        memcpy(rows + i * CHIP8_HEIGHT, rows, CHIP8_HEIGHT * sizeof(uint64_t));
+    }
+
+    // Parked: hand the pages back, the rom image has the rest
+    if (v->compact) {
+        chip8_packed_t *packed = &v->packed[env];
+        arena_free(&v->arena, packed->first, packed->capacity);
+        *packed = v->packed_start;
+        packed->rng = rng_state(seed);
+        return;
+    }
+
+    chip8_instance_t *machine = &v->envs[env];
+    chip8_t *chip8 = &machine->chip8;
+    const uint64_t pages = chip8->code_pages;
+    uint16_t lo = chip8->code_dirty_lo;
+    uint16_t hi = chip8->code_dirty_hi;
+    for (uint64_t left = pages; left; left &= left - 1) {
+        const uint16_t at = (uint16_t)(__builtin_ctzll(left) * 64);
+        if (memcmp(&chip8->ram[at], &v->start.ram[at], 64) != 0) {
+            if (lo >= hi) {
+                lo = at;
+                hi = at + 64;
+            }
+            else {
+                lo = at < lo ? at : lo;
+                hi = at + 64 > hi ? at + 64 : hi;
+            }
+        }
+    }
+
+    *chip8 = v->start;
+    chip8->code_pages = pages;
+    chip8->code_dirty_lo = lo;
+    chip8->code_dirty_hi = hi;
+    seed_rng(chip8, seed);
+    machine->frame = 0;
+}
+
+static void vec_step_env(chip8_vec_env_t *v, const uint32_t env, const uint32_t thread) {
+    // Parked: run it on this thread's working machine
+    chip8_instance_t *machine;
+    vec_work_t *work = NULL;
+    chip8_packed_t *packed = NULL;
+    if (v->compact) {
+        work = &v->work[thread];
+        packed = &v->packed[env];
+        machine = &work->machine;
+        unpack_machine(&v->arena, packed, &machine->chip8, v->start.ram, work->ram_pages, work->display_pages);
+        machine->frame = packed->frame;
+    }
+    else {
+        machine = &v->envs[env];
+    }
+
+    const float before = v->reward_out ? vec_reward_sum(v, &machine->chip8) : 0;
+    chip8_set_keys(machine, v->actions ? v->actions[env] : 0);
+    chip8_run_frames(machine, v->frame_skip);
+    if (v->reward_out) {
+        v->reward_out[env] = vec_reward_sum(v, &machine->chip8) - before;
+    }
+
+    // Parked again before its observations move on, so one the arena has no room for is left as
+    // it was before the step. The working machine then differs from the image wherever it wrote
+    if (packed) {
+        if (!pack_machine(&v->arena, packed, &machine->chip8, v->start.ram)) {
+            work->ram_pages = packed->ram_pages | machine->chip8.ram_written;
+            work->display_pages = 0xFFFFFFFFu;
+            if (v->reward_out) {
+                v->reward_out[env] = 0;
+            }
+            v->full = true;
+            return;
+        }
+        packed->frame = (uint8_t)(machine->frame % 60);
+        work->ram_pages = packed->ram_pages;
+        work->display_pages = packed->display_pages;
+    }
+
+    // Oldest frame out, newest in
+    uint64_t *rows = &v->history[(size_t)env * v->frame_stack * CHIP8_HEIGHT];
+    memmove(rows, rows + CHIP8_HEIGHT, (v->frame_stack - 1) * CHIP8_HEIGHT * sizeof(uint64_t));
+    vec_rows(&machine->chip8.display, rows + (v->frame_stack - 1) * CHIP8_HEIGHT);
+}
+
+// Take chunks of the current pass until there are none left
+static void vec_work(chip8_vec_env_t *v, const uint32_t thread) {
+    const uint32_t count = v->count;
+    uint32_t first;
+    while ((first = v->next.fetch_add(VEC_CHUNK)) < count) {
+        const uint32_t last = first + VEC_CHUNK < count ? first + VEC_CHUNK : count;
+        for (uint32_t env = first; env < last; env++) {
+            if (v->job == VEC_STEP) {
+                vec_step_env(v, env, thread);
+            }
+            else if (!v->reset || v->reset[env]) {
+                vec_reset_env(v, env);
+            }
+            if (v->obs) {
+                vec_observe(v, env, v->obs);
+            }
+        }
+    }
+}
+
+static void vec_worker(chip8_vec_env_t *v, const uint32_t thread) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> hold(v->lock);
+    while (true) {
+        v->wake.wait(hold, [&] { return v->quit || v->generation != seen; });
+        if (v->quit) {
+            return;
+        }
+        seen = v->generation;
+        hold.unlock();
+        vec_work(v, thread);
+        hold.lock();
+        if (--v->busy == 0) {
+            v->done.notify_one();
+        }
+    }
+}
+
+// Run a pass over every environment, the calling thread works on it too
+static void vec_run(chip8_vec_env_t *v, const vec_job_t job) {
+    v->job = job;
+    v->next = 0;
+    if (!v->workers.empty()) {
+        std::lock_guard<std::mutex> hold(v->lock);
+        v->busy = (uint32_t)v->workers.size();
+        v->generation++;
+    }
+    v->wake.notify_all();
+    vec_work(v, 0);
+    std::unique_lock<std::mutex> hold(v->lock);
+    v->done.wait(hold, [&] { return v->busy == 0; });
+}
+
+chip8_vec_env_t *chip8_vec_create(const chip8_vec_options_t *options, const uint8_t *rom, size_t size,
+                                  const char *name) {
+    if (!options || options->num_envs == 0) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < options->num_rewards; i++) {
+        if (options->rewards[i].bytes > 2) {
+            return NULL;
+        }
+    }
+
+    // Load once into a scratch machine, every environment starts from a copy of it
+    chip8_instance_t *first = chip8_create(&options->machine);
+    if (!first) {
+        return NULL;
+    }
+    chip8_vec_env_t *v = new chip8_vec_env_t();
+    v->name = name ? name : "rom";
+    if (!chip8_load_rom(first, rom, size, v->name.c_str())) {
+        chip8_destroy(first);
+        delete v;
+        return NULL;
+    }
+    v->start = first->chip8;
+    v->start.rom_name = v->name.c_str();
+    v->count = options->num_envs;
+    v->compact = options->compact;
+    v->seed = options->machine.seed;
+    v->frame_skip = options->frame_skip ? options->frame_skip : 1;
+    v->frame_stack = options->frame_stack ? options->frame_stack : 1;
+    v->rewards.assign(options->rewards, options->rewards + options->num_rewards);
+    v->episodes.assign(options->num_envs, 0);
+    v->history.assign((size_t)options->num_envs * v->frame_stack * CHIP8_HEIGHT, 0);
+
+    // The caller's thread is one of the workers
+    uint32_t threads = options->threads ? options->threads : std::thread::hardware_concurrency();
+    const uint32_t chunks = (options->num_envs + VEC_CHUNK - 1) / VEC_CHUNK;
+    threads = threads < chunks ? threads : chunks;
+    threads = threads ? threads : 1;
+
+    // Compact: each thread gets a working machine, a copy of the loaded one, and the
+    // environments start parked with no pages of their own
+    if (v->compact) {
+        v->work.resize(threads);
+        for (vec_work_t &work : v->work) {
+            work.machine.config = first->config;
+            work.machine.chip8 = v->start;
+            block_cache_reset(&work.machine.cache, &work.machine.chip8);
+        }
+        v->peek.config = first->config;
+        if (!pack_machine(&v->arena, &v->packed_start, &v->start, v->start.ram)) {
+            chip8_destroy(first);
+            chip8_vec_destroy(v);
+            return NULL;
+        }
+        v->packed.assign(options->num_envs, v->packed_start);
+    }
+    else {
+        v->envs.resize(options->num_envs);
+        for (uint32_t env = 0; env < options->num_envs; env++) {
+            chip8_instance_t *machine = &v->envs[env];
+            machine->config = first->config;
+            machine->chip8 = v->start;
+            block_cache_reset(&machine->cache, &machine->chip8);
+        }
+    }
+    for (uint32_t env = 0; env < options->num_envs; env++) {
+        vec_reset_env(v, env);
+    }
+    chip8_destroy(first);
+
+    // Ready to step straight away, and the first chip8_vec_reset is still episode 0
+    v->episodes.assign(options->num_envs, 0);
+
+    for (uint32_t i = 1; i < threads; i++) {
+        v->workers.emplace_back(vec_worker, v, i);
+    }
+    return v;
+}
+
+void chip8_vec_destroy(chip8_vec_env_t *v) {
+    if (!v) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> hold(v->lock);
+        v->quit = true;
+    }
+    v->wake.notify_all();
+    for (std::thread &worker : v->workers) {
+        worker.join();
+    }
+    for (chip8_instance_t &machine : v->envs) {
+        block_cache_free(&machine.cache);
+    }
+    for (vec_work_t &work : v->work) {
+        block_cache_free(&work.machine.cache);
+    }
+    arena_release(&v->arena);
+    delete v;
+}
+
+void chip8_vec_reset(chip8_vec_env_t *v, const bool *reset, uint8_t *obs) {
+    v->reset = reset;
+    v->obs = obs;
+    vec_run(v, VEC_RESET);
+}
+
+bool chip8_vec_step(chip8_vec_env_t *v, const uint16_t *actions, uint8_t *obs, float *rewards) {
+    v->actions = actions;
+    v->obs = obs;
+    v->reward_out = rewards;
+    v->full = false;
+    vec_run(v, VEC_STEP);
+    return !v->full;
+}
+
+chip8_instance_t *chip8_vec_machine(chip8_vec_env_t *v, uint32_t i) {
+    if (!v->compact) {
+        return &v->envs[i];
+    }
+    v->peek.chip8 = v->start;
+    unpack_machine(&v->arena, &v->packed[i], &v->peek.chip8, v->start.ram, 0, 0);
+    v->peek.frame = v->packed[i].frame;
+    return &v->peek;
+}
+
+size_t chip8_vec_bytes(const chip8_vec_env_t *v) {
+    size_t bytes = v->history.size() * sizeof(uint64_t);
+    if (!v->compact) {
+        return bytes + v->count * sizeof(chip8_instance_t);
+    }
+    bytes += v->count * sizeof(chip8_packed_t) + v->work.size() * sizeof(vec_work_t);
+    for (uint32_t env = 0; env < v->count; env++) {
+        bytes += v->packed[env].capacity * sizeof(page_t);
+    }
+    return bytes;
+}
@@ -0,0 +1,355 @@
+// Internal to the emulator: the machine, config and engine types chip8_core.cpp and the frontend
+// in chip8.cpp share, and the core's calls the frontend makes. Not part of libchip8, chip8.h is its API
+#ifndef CHIP8_CORE_H
+#define CHIP8_CORE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+// x86-64 JIT is only built where the calling convention is SysV and RWX memory can be mapped
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define CHIP8_JIT
+#endif
+
+// Execution engines
+typedef enum
+{
+    ENGINE_INTERP, // Fetch, decode and dispatch every instruction
+    ENGINE_BLOCK,  // Run cached pre-decoded basic blocks
+    ENGINE_JIT,    // Compile hot blocks to x86-64, block engine for the rest
+    ENGINE_AOT,    // Run the rom compiled into this build by make aot, interpreter for the rest
+    ENGINE_LOCKSTEP // Batch only: every job steps together in one structure of arrays
+} engine_t;
+
+// What FX55/FX65 leave in I
+typedef enum {
+    MEM_I_KEEP, // I is unchanged
+    MEM_I_X,    // I += X
+    MEM_I_X1,   // I += X + 1, I ends past the last register
+} quirk_memory_t;
+
+// What DXYN does at the screen edges
+typedef enum {
+    DRAW_WRAP_X, // Wrap around the right edge, clip at the bottom
+    DRAW_CLIP,   // Clip at both
+} quirk_draw_t;
+
+// Quirk profiles, the behaviours CHIP-8 variants disagree on. Name, --quirks value, 8XY6/8XYE
+// shift VY into VX, FX55/FX65 I, BNNN jumps to VX + NNN, DXYN edges
+#define CHIP8_QUIRKS(X) \
+    X(MODERN, "modern", false, MEM_I_KEEP, false, DRAW_WRAP_X) /* What this emulator has always done */ \
+    X(VIP,    "vip",    true,  MEM_I_X1,   false, DRAW_CLIP)   /* COSMAC VIP */ \
+    X(CHIP48, "chip48", false, MEM_I_X,    true,  DRAW_CLIP)   /* CHIP-48 on the HP 48 */ \
+    X(SCHIP,  "schip",  false, MEM_I_KEEP, true,  DRAW_CLIP)   /* SUPER-CHIP 1.1 */
+
+#define QUIRKS_ENUM(name, str, shift_vy, memory, jump_vx, draw) QUIRKS_##name,
+typedef enum {
+    CHIP8_QUIRKS(QUIRKS_ENUM)
+    QUIRKS_COUNT
+} quirk_profile_t;
+#undef QUIRKS_ENUM
+
+typedef struct {
+    const char *name;
+    bool shift_vy;
+    quirk_memory_t memory;
+    bool jump_vx;
+    quirk_draw_t draw;
+} quirks_t;
+
+// Handlers read these as compile time constants, see OP_HANDLER
+#define QUIRKS_ENTRY(name, str, shift_vy, memory, jump_vx, draw) {str, shift_vy, memory, jump_vx, draw},
+static constexpr quirks_t quirk_table[QUIRKS_COUNT] = {
+    CHIP8_QUIRKS(QUIRKS_ENTRY)
+};
+#undef QUIRKS_ENTRY
+
+// Configuration object
+typedef struct 
+{
+    uint32_t window_width; // SDL Window width, in window pixels whatever the rom's resolution
+    uint32_t window_height; // SDL Window height
+    uint32_t fg_color; // Foreground colour, plane 0
+    uint32_t bg_color; // background colour
+    uint32_t plane2_color; // XO-CHIP plane 1 colour
+    uint32_t blend_color; // Where both planes are lit
+    bool pixel_outlines; // Draw [pixel outline]
+    uint32_t insts_per_sec; // CPU Clock rat or hz
+    bool headless; // Run without SDL window, renderer or frame pacing
+    uint32_t max_frames; // Headless frame budget (60 frames = 1 emulated second)
+    uint64_t max_insts; // Headless instruction budget, overrides max_frames when > 0
+    engine_t engine; // Execution engine
+    quirk_profile_t quirks; // Quirk profile the rom runs with
+    const char *rom_name; // Rom to run
+    const char *batch_manifest; // Run every job in this manifest instead of one rom
+    uint32_t threads; // Batch worker threads, 0 for one per core
+    const char *out_path; // Batch results file, stdout when NULL
+    const char *load_state; // Start from this save state instead of a fresh machine
+    const char *save_state; // Write a save state here when a headless run ends
+    uint32_t rewind_mb; // Rewind history budget, 0 turns recording off
+    uint32_t rewind_interval; // Frames between rewind records
+    uint32_t seed; // CXNN seed, 0 picks one from the clock
+    const char *record_input; // Write keypad changes here when a windowed run ends
+    const char *replay_input; // Play this input log back headless
+    uint32_t audio_buffer; // Audio device buffer, in samples
+    uint32_t audio_latency_ms; // Most sound the ring holds ahead of the device
+    uint32_t spin_us; // Frame pacing spins this long before each deadline instead of sleeping
+    bool idle_skip; // Fast-forward through loops that only wait for a timer or a key
+    const char *aot_out; // Write the rom out as C++ for make aot instead of running it
+    #ifdef PROFILE
+    const char *profile_out; // Profile reports go to <profile_out>.json, .csv and .folded
+    bool profile_timed; // Time every instruction as well as counting it
+    #endif
+    #ifdef TRACE
+    const char *trace_out; // Trace files are <trace_out>.<thread>.c8t
+    const char *decode_trace; // Print this trace file instead of running a rom
+    #endif
+} config_t;
+
+// Emulator states
+typedef enum 
+{
+    QUIT,
+    RUNNING,
+    PAUSE
+} emulator_state_t;
+
+// CHIP8 Instruction format
+typedef struct {
+    uint16_t opcode;
+    uint16_t NNN; // 12 bit address
+    uint8_t NN;  // 8 bit
+    uint8_t N; // 4 bit
+    uint8_t X;  // 4 bit register identifier
+    uint8_t Y;  // 4 bit register identifier
+} instruction_t;
+
+// Chip 8 Object
+typedef struct 
+{
+    emulator_state_t state;
+    uint8_t ram[4096];
+    chip8_display_t display;
+    uint8_t planes; // XO-CHIP FN01 plane mask draws, clears and scrolls act on, 1 for plain CHIP-8
+    uint16_t stack[16]; // Subroutine stack
+    uint8_t stack_ptr; // Index of the next free stack entry, wraps at 16
+    uint8_t V[16]; // Data Register
+    uint16_t I; // Index Register
+    uint8_t delay_timer; // Decrement at 60hz wheb > 0
+    uint8_t sound_timer; // Decrement at 60hz and play tones > 0
+    uint16_t PC; // Program Counter
+    bool keypad[16]; // Key pad 0x0-0xF
+    const char *rom_name; // Current rom name
+    instruction_t inst; // Current chip 8 instruction
+    uint64_t code_pages; // Bit per 64 byte RAM page holding cached code
+    uint16_t code_dirty_lo; // Lowest cached code address written since last check
+    uint16_t code_dirty_hi; // One past the highest, lo >= hi when nothing was written
+    uint64_t ram_written; // Bit per 64 byte RAM page written, compact machines keep their own copy of those
+    uint32_t rng; // CXNN random state, per machine so instances never share it
+    uint64_t idle_insts; // Instructions fast-forwarded through idle loops, see idle_skip
+    uint32_t idle_wait; // Instructions left to run before the next idle loop check, counted across frames
+    uint32_t idle_chunk; // Instructions between checks, grows while none finds a loop
+    
+} chip8_t;
+
+// Everything a rom can observe, plain copies so a snapshot is close to a memcpy
+typedef struct {
+    uint8_t ram[4096];
+    chip8_display_t display;
+    uint8_t planes;
+    uint16_t stack[16];
+    uint8_t stack_ptr;
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    bool keypad[16];
+    uint32_t rng;
+} chip8_state_t;
+
+// Pre-decoded instruction inside a cached block
+typedef struct {
+    instruction_t inst;
+    uint8_t op; // op_class_t
+    uint8_t exec; // What the block engine dispatches on: op, or OP_COUNT + the fuse_op_t starting here
+} uop_t;
+
+// Runs of opcodes roms use all the time. The block engine counts how often each one starts and
+// runs its opcodes as usual: with the uops decoded already a fused handler only saves a dispatch,
+// and measured no faster. Counter loops are the exception, those are worked out, see fuse_loop.
+// Name and the handler of the run's first opcode
+#define CHIP8_FUSIONS(X) \
+    X(LD_I_DRW,  op_ld_i)     /* ANNN DXYN */ \
+    X(LD_LD_DRW, op_ld_nn)    /* 6XNN 6YNN DXYN */ \
+    X(ADD_SE,    op_add_nn)   /* 7XNN 3XNN */ \
+    X(ADD_SNE,   op_add_nn)   /* 7XNN 4XNN */ \
+    X(DT_SE,     op_ld_vx_dt) /* FX07 3XNN, timer waits */ \
+    X(DT_SNE,    op_ld_vx_dt) /* FX07 4XNN */
+
+#define FUSE_ENUM(name, first) FUSE_##name,
+typedef enum {
+    FUSE_NONE,
+    CHIP8_FUSIONS(FUSE_ENUM)
+    FUSE_LOOP, // 7XNN 3XNN 1NNN back to the 7XNN
+    FUSE_COUNT
+} fuse_op_t;
+#undef FUSE_ENUM
+
+// Straight-line run of instructions ending at a jump, call, return or skip
+typedef struct {
+    uint16_t start; // Address of the first instruction
+    uint16_t end; // One past the last RAM byte decoded
+    uint16_t count; // Number of uops
+    bool valid; // Cleared when the RAM under it is written
+    uint32_t first; // Index of the first uop in the pool
+    uint32_t hits; // Visits, for the JIT to find hot blocks
+    bool loop; // 7XNN 3XNN on one register, maybe a counter loop, see fuse_loop
+    void *code; // Native code from the JIT, NULL if not compiled
+} block_t;
+
+#define BLOCK_MAX_UOPS 64 // Longest block before it is split
+#define BLOCK_POOL_LIMIT 65536 // Flush the whole cache once the uop pool grows past this
+
+// Decoded blocks for one chip 8 machine
+typedef struct {
+    int32_t block_at[4096]; // Block index per start address, -1 if not decoded
+    std::vector<block_t> blocks;
+    std::vector<uop_t> uops;
+    uint8_t *code; // JIT code cache, mapped on first compile
+    uint32_t code_used; // Bytes of code cache in use
+    uint64_t fused[FUSE_COUNT]; // Times each run started, and counter loops were worked out
+    #ifdef AOT_SOURCE
+    std::vector<uint8_t> aot_valid; // Per compiled block, RAM still holds the bytes it was compiled from
+    #endif
+} block_cache_t;
+
+// Lockstep engine: many copies of one rom stepped together. The hot registers are
+// stored as arrays across machines (V[x][machine]) so one AVX2 op updates a whole
+// warp of machines. Machines whose PC and opcode agree run as one group, the rest
+// of the warp regroups and runs in more passes of the same step
+#define LOCKSTEP_WARP 32 // Machines per group pass, one byte lane each in a 256 bit register
+
+typedef struct {
+    uint32_t count; // Machines in use
+    uint32_t lanes; // count rounded up to a whole warp
+    std::vector<uint8_t> V[16]; // V[x][machine]
+    std::vector<uint16_t> I;
+    std::vector<uint16_t> PC;
+    std::vector<uint8_t> delay_timer;
+    std::vector<uint8_t> sound_timer;
+    std::vector<uint8_t> keys[2]; // Keypad bits, keys 0-7 and 8-15
+    std::vector<chip8_t> machines; // Everything else per machine: RAM, display, stack, keypad, RNG
+    std::vector<uint64_t> written; // Bit per 64 byte RAM page a machine wrote, its code may differ there
+    std::vector<uint64_t> warp_written; // Union of written over each warp
+    uint8_t code[4096]; // RAM every machine started with, opcodes come from here until a page is written
+    uint64_t warp_steps; // Instructions run per warp
+    uint64_t groups; // Group passes they took, equal when no machine diverged
+} lockstep_t;
+
+// libchip8, the API in chip8.h. An instance is a machine plus what it takes to run one on its own
+struct chip8_instance {
+    chip8_t chip8;
+    block_cache_t cache; // Only filled by the block and JIT engines
+    config_t config;
+    uint64_t frame; // Frames ended by chip8_tick, paces chip8_run_frames
+    std::string name; // Owns the rom name chip8.rom_name points at
+};
+
+// Colour index of one pixel, plane 0 in bit 0 and plane 1 in bit 1, x and y in the display's resolution
+static inline uint8_t display_pixel(const chip8_display_t *display, const uint32_t x, const uint32_t y) {
+    const uint32_t at = display->hires ? y * 2 + x / 64 : y;
+    const uint32_t bit = 63 - x % 64;
+    return ((display->plane[0][at] >> bit) & 1) | ((display->plane[1][at] >> bit) & 1) << 1;
+}
+
+// Text escaped to go between the quotes of a JSON string, for rom paths in the reports
+static inline std::string json_escape(const char *text) {
+    std::string escaped;
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            escaped += '\\';
+            escaped += *c;
+        }
+        else if ((uint8_t)*c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof code, "\\u%04X", (uint8_t)*c);
+            escaped += code;
+        }
+        else {
+            escaped += *c;
+        }
+    }
+    return escaped;
+}
+
+// Set all 16 keys from a mask
+static inline void set_keypad(chip8_t *chip8, const uint16_t keys) {
+    for (uint8_t i = 0; i < 16; i++) {
+        chip8->keypad[i] = (keys >> i) & 1;
+    }
+}
+
+// And back to a mask, bit N is key N
+static inline uint16_t keypad_mask(const bool keypad[16]) {
+    uint16_t keys = 0;
+    for (uint8_t i = 0; i < 16; i++) {
+        keys |= (uint16_t)keypad[i] << i;
+    }
+    return keys;
+}
+
+// Instructions in frame number frame. insts_per_sec rarely divides by 60, so frames carry the
+// fraction along: 500 Hz runs 8 or 9 a frame, and any 60 frames run exactly 500
+static inline uint32_t frame_insts(const uint32_t insts_per_sec, const uint64_t frame) {
+    return (uint32_t)((frame + 1) * insts_per_sec / 60 - frame * insts_per_sec / 60);
+}
+
+// chip8_core.cpp, what the frontend calls besides the API in chip8.h
+void config_defaults(config_t *config);
+bool parse_quirks(const char *name, quirk_profile_t *profile);
+bool parse_engine(const char *name, engine_t *engine);
+
+bool init_chip8_image(chip8_t *chip8, const char rom_name[], const uint8_t *rom, const size_t rom_size);
+void seed_rng(chip8_t *chip8, const uint32_t seed);
+void update_timers(chip8_t *chip8);
+void snapshot_chip8(const chip8_t *chip8, chip8_state_t *state);
+void restore_chip8(chip8_t *chip8, const chip8_state_t *state);
+uint32_t display_hash(const chip8_t *chip8);
+uint64_t state_hash(const chip8_t *chip8);
+#if defined(DEBUG) || defined(TRACE)
+void print_debug_info(chip8_t *chip8);
+#endif
+
+void engine_run(chip8_t *chip8, block_cache_t *cache, const config_t config, uint32_t count);
+void block_cache_reset(block_cache_t *cache, chip8_t *chip8);
+void block_cache_free(block_cache_t *cache);
+extern const char *const fuse_names[FUSE_COUNT];
+bool aot_write(const chip8_t *chip8, const char *rom_name, const quirk_profile_t quirks, const char *path);
+#ifdef AOT_SOURCE
+const char *aot_rom(const uint8_t **code, size_t *size);
+#endif
+
+bool lockstep_init(lockstep_t *ls, const chip8_t *start, const uint32_t count);
+void lockstep_set_keys(lockstep_t *ls, const uint32_t machine, const uint16_t keys);
+chip8_t *lockstep_machine(lockstep_t *ls, const uint32_t machine);
+void lockstep_run(lockstep_t *ls, const config_t config, const uint32_t count);
+void lockstep_update_timers(lockstep_t *ls);
+
+// An instance with a whole config, where chip8_create only takes chip8_options_t
+chip8_instance_t *instance_create(const config_t &config);
+
+#ifdef PROFILE
+void profile_start(const bool timed);
+bool write_profile(const chip8_t *chip8, const char *prefix);
+#endif
+
+#ifdef TRACE
+void trace_start(const char *prefix);
+bool decode_trace(const char *path);
+#endif
+
+#endif